@@ -0,0 +1,430 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements batch mode, which answers a file of questions instead of chatting:
+ *
+ *   main --batch questions.txt --out answers.txt [--load kb.ini] [--threads n]
+ *
+ * Every line of the questions file is split into words the same way as the main loop splits
+ * what the user types, and answered from the knowledge base (loaded from --load, if given) by
+ * chatbot_answer_question(). No one is asked for the answers the knowledge base does not know,
+ * they are written out as misses. The answers file has one line for each line of the questions
+ * file, in the same order:
+ *
+ *   answer<TAB>the answer           if the knowledge base knows it
+ *   miss<TAB>I don't know. ...?     if it does not
+ *   error<TAB>what the chatbot says if the line is not a question with an entity
+ *
+ * and an empty line for each empty one. The lines are read BATCH_BLOCK_LINES at a time, and each
+ * block is shared out between n threads (one per processor if n is 0 or not given) that answer
+ * their part of it into a buffer of their own, then the buffers are written out in order. The
+ * knowledge base is only read, in concurrent mode (see kb_set_concurrent()), and it is loaded without
+ * its journal, so nothing is written next to it.
+ */
+
+// Answering with several threads uses POSIX threads, where they are available
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define BATCH_HAVE_THREADS 1
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "chat1002.h"
+
+#ifdef BATCH_HAVE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Number of lines read from the questions file and answered at a time
+#define BATCH_BLOCK_LINES 65536
+
+// Most threads that answer a block at once
+#define BATCH_MAX_THREADS 64
+
+// Size of the output buffer each thread starts with, it grows as needed
+#define BATCH_OUTPUT_BUFFER (64 * 1024)
+
+// The part of a block of lines that one thread answers, and what it wrote
+typedef struct batch_worker {
+	knowledge_base* kb;
+	char (*lines)[MAX_INPUT];
+	unsigned int first;
+	unsigned int count;
+
+	// The answers to the lines, one line each, and whether the buffer ran out of memory
+	char* output;
+	size_t size;
+	size_t capacity;
+	bool failed;
+
+	// How many lines were answered, and how many were misses
+	unsigned long answered;
+	unsigned long missed;
+} batch_worker;
+
+// Helper functions defined further down in this file
+static unsigned int batch_read_block(FILE* f, char (*lines)[MAX_INPUT]);
+static void batch_run(batch_worker* workers, unsigned int count);
+static void* batch_answer(void* arg);
+static void batch_append(batch_worker* worker, const char* status, const char* text, size_t len);
+static unsigned int batch_thread_count(unsigned int threads);
+static double batch_seconds(void);
+
+/*
+ * Run batch mode, for main() when it is given --batch.
+ *
+ * Input:
+ *   argc - the number of command line arguments
+ *   argv - the command line arguments, argv[1] being "--batch"
+ *
+ * Returns:
+ *   0, if every question was answered (or written out as a miss)
+ *   1, if the arguments are wrong, a file could not be read or written, or we ran out of memory
+ */
+int chatbot_batch(int argc, char* argv[])
+{
+
+	const char* questions_name = argc > 2 ? argv[2] : NULL;
+	const char* answers_name = NULL;
+	const char* load_name = NULL;
+	unsigned int threads = 0;
+
+	for (int i = 3; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--out") == 0)
+		{
+			answers_name = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--load") == 0)
+		{
+			load_name = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--threads") == 0)
+		{
+			threads = (unsigned int) strtoul(argv[i + 1], NULL, 10);
+		}
+	}
+
+	if (questions_name == NULL || answers_name == NULL)
+	{
+		printf("Usage: %s --batch questions.txt --out answers.txt [--load kb.ini] [--threads n]\n", argv[0]);
+		return 1;
+	}
+
+	// Load the knowledge base the way LOAD does, but without its journal: batch mode learns nothing
+	if (load_name != NULL)
+	{
+		char response[MAX_RESPONSE];
+		int loaded = chatbot_load_file(load_name, 0, response, sizeof(response));
+
+		printf("%s: %s\n", chatbot_botname(), response);
+
+		if (loaded != KB_OK)
+		{
+			knowledge_unload();
+			return 1;
+		}
+	}
+
+	FILE* questions = fopen(questions_name, "r");
+	FILE* answers = questions != NULL ? fopen(answers_name, "w") : NULL;
+
+	if (questions == NULL || answers == NULL)
+	{
+		printf("Could not open %s.\n", questions == NULL ? questions_name : answers_name);
+
+		if (questions != NULL)
+		{
+			fclose(questions);
+		}
+
+		knowledge_unload();
+		return 1;
+	}
+
+	/* The knowledge base is only read from now on. Lookups take no lock if the system allows it,
+	else they share a lock on each section, else one thread answers everything. */
+	knowledge_base* kb = knowledge_default();
+
+	if (kb_set_concurrent(kb, KB_CONCURRENT_RCU) != KB_OK && kb_set_concurrent(kb, KB_CONCURRENT_LOCKED) != KB_OK)
+	{
+		threads = 1;
+	}
+
+	threads = batch_thread_count(threads);
+
+	char (*lines)[MAX_INPUT] = malloc(sizeof(*lines) * BATCH_BLOCK_LINES);
+	batch_worker workers[BATCH_MAX_THREADS];
+	memset(workers, 0, sizeof(workers));
+
+	bool failed = lines == NULL;
+	unsigned long total = 0;
+	unsigned long missed = 0;
+	double start = batch_seconds();
+
+	while (!failed)
+	{
+		unsigned int count = batch_read_block(questions, lines);
+
+		if (count == 0)
+		{
+			break;
+		}
+
+		// Share the block out, a thread gets no lines if there are fewer lines than threads
+		for (unsigned int t = 0; t < threads; t++)
+		{
+			workers[t].kb = kb;
+			workers[t].lines = lines;
+			workers[t].first = (unsigned int) ((unsigned long long) count * t / threads);
+			workers[t].count = (unsigned int) ((unsigned long long) count * (t + 1) / threads) - workers[t].first;
+			workers[t].size = 0;
+		}
+
+		batch_run(workers, threads);
+
+		// Write the answers out in the order of the lines
+		for (unsigned int t = 0; t < threads && !failed; t++)
+		{
+			failed = workers[t].failed || fwrite(workers[t].output, 1, workers[t].size, answers) != workers[t].size;
+			total += workers[t].answered;
+			missed += workers[t].missed;
+			workers[t].answered = 0;
+			workers[t].missed = 0;
+		}
+	}
+
+	double seconds = batch_seconds() - start;
+
+	failed = failed || ferror(questions) || fclose(answers) != 0;
+	fclose(questions);
+
+	for (unsigned int t = 0; t < threads; t++)
+	{
+		free(workers[t].output);
+	}
+
+	free(lines);
+	knowledge_unload();
+
+	if (failed)
+	{
+		printf("Could not answer the questions in %s into %s.\n", questions_name, answers_name);
+		return 1;
+	}
+
+	printf("%s: Answered %lu questions from %s into %s in %.3f seconds (%lu misses, %.0f questions per second, %u thread%s).\n",
+		chatbot_botname(), total, questions_name, answers_name, seconds, missed, seconds > 0 ? total / seconds : 0,
+		threads, threads == 1 ? "" : "s");
+
+	return 0;
+}
+
+/*
+ * Read up to BATCH_BLOCK_LINES lines, without their line endings. A line too long for MAX_INPUT
+ * is cut short, the rest of it is skipped.
+ *
+ * Returns: the number of lines read, 0 at the end of the file
+ */
+static unsigned int batch_read_block(FILE* f, char (*lines)[MAX_INPUT])
+{
+	unsigned int count = 0;
+
+	while (count < BATCH_BLOCK_LINES && fgets(lines[count], MAX_INPUT, f) != NULL)
+	{
+		char* end = strchr(lines[count], '\n');
+
+		if (end != NULL)
+		{
+			*end = '\0';
+		}
+		else
+		{
+			int c;
+
+			while ((c = fgetc(f)) != EOF && c != '\n')
+			{
+				continue;
+			}
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Run the first count workers at the same time, each on a thread of its own (the first one on this
+ * thread). A worker whose thread cannot be started runs on this thread afterwards.
+ */
+static void batch_run(batch_worker* workers, unsigned int count)
+{
+
+#ifdef BATCH_HAVE_THREADS
+	pthread_t threads[BATCH_MAX_THREADS];
+	bool started[BATCH_MAX_THREADS] = { false };
+
+	for (unsigned int t = 1; t < count; t++)
+	{
+		started[t] = pthread_create(&threads[t], NULL, batch_answer, &workers[t]) == 0;
+	}
+
+	batch_answer(&workers[0]);
+
+	for (unsigned int t = 1; t < count; t++)
+	{
+		if (started[t])
+		{
+			pthread_join(threads[t], NULL);
+		}
+		else
+		{
+			batch_answer(&workers[t]);
+		}
+	}
+#else
+	for (unsigned int t = 0; t < count; t++)
+	{
+		batch_answer(&workers[t]);
+	}
+#endif
+}
+
+/*
+ * Answer a worker's lines into its output buffer.
+ */
+static void* batch_answer(void* arg)
+{
+	batch_worker* worker = arg;
+	char* inv[MAX_INPUT];
+	char response[MAX_RESPONSE];
+
+	// The views of answers are only used until they are copied to the buffer (see kb_rcu_register())
+	int reader = kb_rcu_register(worker->kb);
+
+	for (unsigned int i = worker->first; i < worker->first + worker->count; i++)
+	{
+		int inc = split_words(worker->lines[i], inv);
+
+		// An empty line stays empty, so that line numbers still match
+		if (inc == 0)
+		{
+			batch_append(worker, NULL, NULL, 0);
+			continue;
+		}
+
+		kb_view answer;
+		int result = chatbot_answer_question(worker->kb, inc, inv, &answer, response, MAX_RESPONSE);
+
+		if (result == KB_OK)
+		{
+			batch_append(worker, "answer", answer.text, answer.len);
+		}
+		else
+		{
+			batch_append(worker, result == KB_NOTFOUND ? "miss" : "error", response, strlen(response));
+			worker->missed += result == KB_NOTFOUND;
+		}
+
+		worker->answered++;
+	}
+
+	if (reader >= 0)
+	{
+		kb_rcu_unregister(worker->kb, reader);
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a line to a worker's output buffer: the status and the text separated by a tab, or an empty
+ * line if status is NULL. If the buffer runs out of memory, the worker is marked as failed.
+ */
+static void batch_append(batch_worker* worker, const char* status, const char* text, size_t len)
+{
+	size_t status_len = status != NULL ? strlen(status) + 1 : 0;
+	size_t needed = worker->size + status_len + len + 1;
+
+	if (worker->failed)
+	{
+		return;
+	}
+
+	if (needed > worker->capacity)
+	{
+		size_t capacity = worker->capacity > 0 ? worker->capacity : BATCH_OUTPUT_BUFFER;
+
+		while (capacity < needed)
+		{
+			capacity *= 2;
+		}
+
+		char* bigger = realloc(worker->output, capacity);
+
+		if (bigger == NULL)
+		{
+			printf("Ran out of memory.\nNo memory is allocated.\n");
+			worker->failed = true;
+			return;
+		}
+
+		worker->output = bigger;
+		worker->capacity = capacity;
+	}
+
+	char* out = worker->output + worker->size;
+
+	if (status != NULL)
+	{
+		memcpy(out, status, status_len - 1);
+		out[status_len - 1] = '\t';
+		memcpy(out + status_len, text, len);
+	}
+
+	out[status_len + len] = '\n';
+	worker->size = needed;
+}
+
+/*
+ * Work out how many threads to answer with.
+ *
+ * Input:
+ *   threads - the number of threads asked for, 0 for one per processor
+ *
+ * Returns: the number of threads, from 1 to BATCH_MAX_THREADS
+ */
+static unsigned int batch_thread_count(unsigned int threads)
+{
+
+#ifdef BATCH_HAVE_THREADS
+	if (threads == 0)
+	{
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = processors > 0 ? (unsigned int) processors : 1;
+	}
+#else
+	threads = 1;
+#endif
+
+	return threads > BATCH_MAX_THREADS ? BATCH_MAX_THREADS : threads;
+}
+
+/*
+ * Get the current time in seconds, for timing.
+ */
+static double batch_seconds(void)
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
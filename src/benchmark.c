@@ -0,0 +1,979 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the BENCHMARK intent, used to measure the performance
+ * of the knowledge base data structures for debugging purposes.
+ *
+ * benchmark [entities] [n] - compares the chained and open addressing entity
+ *                            hash tables (and a frozen table) with n generated entities
+ * benchmark parse [mb]      - compares the line parsing loop that knowledge_read() used to
+ *                            have with the line scanner engines on mb megabytes of generated lines
+ * benchmark save [n]        - compares the fprintf() loop that knowledge_write() used to have with
+ *                            knowledge_write_frozen() on one and several threads, with n generated
+ *                            entities in every section
+ * benchmark threads [w] [t] - times lookups and puts (w percent of them) on 1, 2, 4, ... up to t threads
+ *                            sharing a knowledge base, with lookups locking each section and without locks
+ */
+
+// The threads benchmark uses POSIX threads, where they are available
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define BENCHMARK_HAVE_THREADS 1
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "chat1002.h"
+
+#ifdef BENCHMARK_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+// Contains struct declarations for data structure and its function prototypes
+#include "datastructure.h"
+
+// Number of generated entities used when the user does not give one
+#define BENCHMARK_DEFAULT_ENTITIES 1000000
+
+// Megabytes of generated lines parsed when the user does not give a size
+#define BENCHMARK_DEFAULT_PARSE_MB 256
+
+// Size of the block of generated lines that is repeated to fill the text to parse
+#define BENCHMARK_PARSE_BLOCK (1024 * 1024)
+
+// Entities in each section of the knowledge base shared by the threads benchmark
+#define BENCHMARK_THREADS_ENTITIES 100000
+
+// Lookups and puts done by each thread of the threads benchmark
+#define BENCHMARK_THREADS_OPERATIONS 1000000
+
+// Percentage of puts and largest number of threads used when the user does not give them
+#define BENCHMARK_DEFAULT_WRITE_PERCENT 1.0
+#define BENCHMARK_DEFAULT_THREADS 8
+
+// Operations each thread of the threads benchmark does between saying it holds nothing (see kb_rcu_quiescent())
+#define BENCHMARK_RCU_QUIESCENT 1024
+
+// Most threads the threads benchmark runs at once
+#define BENCHMARK_MAX_THREADS 64
+
+// What each thread of the threads benchmark is given, and what it found
+typedef struct benchmark_worker {
+	knowledge_base* kb;
+	char** keys;
+	unsigned int write_threshold;
+	unsigned int seed;
+	unsigned long found;
+
+	// true if the knowledge base is in KB_CONCURRENT_RCU mode, so that the worker registers as a reader
+	bool rcu;
+} benchmark_worker;
+
+// Written to after each line is parsed, so that the compiler cannot skip copying the entity and description
+static volatile char benchmark_sink;
+
+// Helper functions defined further down in this file
+static double benchmark_seconds(void);
+static char** benchmark_keys(const char* prefix, unsigned int count);
+static void benchmark_free_keys(char** keys, unsigned int count);
+static void benchmark_entity_engine(const char* name, int engine, bool freeze, char** keys, char** missing, unsigned int count);
+static int benchmark_parse(int inc, char* inv[], char* response, int n);
+static char* benchmark_parse_text(size_t size);
+static size_t benchmark_parse_loop(const char* text, size_t size);
+static size_t benchmark_parse_scanner(int engine, const char* text, size_t size);
+static int benchmark_save(int inc, char* inv[], char* response, int n);
+static int benchmark_save_fprintf(FILE* f, frozen_ht* const* tables);
+static void benchmark_save_time(const char* name, frozen_ht* const* tables, bool old_loop, unsigned int threads);
+static int benchmark_threads(int inc, char* inv[], char* response, int n);
+static void benchmark_threads_series(benchmark_worker* workers, unsigned int max_threads, const char* mode);
+static double benchmark_threads_time(benchmark_worker* workers, unsigned int count);
+static void* benchmark_threads_run(void* arg);
+
+/*
+ * Determine whether an intent is BENCHMARK.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "benchmark"
+ *  0, otherwise
+ */
+int chatbot_is_benchmark(const char* intent)
+{
+	return compare_token(intent, "benchmark") == 0;
+}
+
+/*
+ * Perform the BENCHMARK intent.
+ *
+ * inv[1] may name the benchmark to run, inv[2] may give the number of entities.
+ * The results are printed to the console, like DISPLAY.
+ *
+ * Returns:
+ *  0 (the chatbot always continues chatting after a benchmark)
+ */
+int chatbot_do_benchmark(int inc, char* inv[], char* response, int n)
+{
+	// The parsing benchmark takes a size instead of a number of entities
+	if (inc > 1 && compare_token(inv[1], "parse") == 0)
+	{
+		return benchmark_parse(inc, inv, response, n);
+	}
+
+	// So does the saving benchmark, which builds a whole knowledge base
+	if (inc > 1 && compare_token(inv[1], "save") == 0)
+	{
+		return benchmark_save(inc, inv, response, n);
+	}
+
+	// The threads benchmark takes a percentage of puts and a number of threads
+	if (inc > 1 && compare_token(inv[1], "threads") == 0)
+	{
+		return benchmark_threads(inc, inv, response, n);
+	}
+
+	// Index of the word giving the number of entities
+	int count_word = 1;
+
+	// Skip the benchmark name if one was given
+	if (inc > 1 && compare_token(inv[1], "entities") == 0)
+	{
+		count_word = 2;
+	}
+
+	// Number of entities to generate
+	unsigned int count = BENCHMARK_DEFAULT_ENTITIES;
+
+	if (inc > count_word)
+	{
+		count = (unsigned int) strtoul(inv[count_word], NULL, 10);
+
+		if (count == 0)
+		{
+			snprintf(response, n, "Please give a number of entities to benchmark with.");
+			return 0;
+		}
+	}
+
+	// Generate the keys up front so that only the hash table work is timed
+	char** keys = benchmark_keys("entity", count);
+	char** missing = benchmark_keys("missing", count);
+
+	if (keys == NULL || missing == NULL)
+	{
+		benchmark_free_keys(keys, count);
+		benchmark_free_keys(missing, count);
+		snprintf(response, n, "No memory space :-(");
+		return 0;
+	}
+
+	printf("%u entities, nanoseconds per operation:\n", count);
+	printf("%-10s %10s %10s %10s\n", "engine", "set", "get hit", "get miss");
+
+	benchmark_entity_engine("chained", ENTITY_HT_CHAINED, false, keys, missing, count);
+	benchmark_entity_engine("open", ENTITY_HT_OPEN, false, keys, missing, count);
+	benchmark_entity_engine("frozen", ENTITY_HT_ENGINE, true, keys, missing, count);
+
+	benchmark_free_keys(keys, count);
+	benchmark_free_keys(missing, count);
+
+	snprintf(response, n, "Benchmark complete.");
+	return 0;
+}
+
+/*
+ * Time set, get (hit) and get (miss) on an entity hash table of the given engine,
+ * and print one line of results.
+ *
+ * If freeze is true, the table is frozen after every key is set (the time
+ * taken to freeze counts as part of set), so gets use the frozen table.
+ *
+ * Input:
+ *   name    - the name of the engine to print
+ *   engine  - ENTITY_HT_CHAINED or ENTITY_HT_OPEN
+ *   freeze  - whether to freeze the table before the gets
+ *   keys    - the keys to insert and look up
+ *   missing - keys that are never inserted
+ *   count   - the number of keys in each array
+ */
+static void benchmark_entity_engine(const char* name, int engine, bool freeze, char** keys, char** missing, unsigned int count)
+{
+	ht* hashtable = create_entity_ht_engine(engine);
+
+	if (hashtable == NULL)
+	{
+		return;
+	}
+
+	// Time inserting every key
+	double start = benchmark_seconds();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		entity_ht_set(hashtable, keys[i], "benchmark description");
+	}
+	if (freeze)
+	{
+		entity_ht_freeze(hashtable);
+	}
+	double set_time = benchmark_seconds() - start;
+
+	// Time looking up every key, in a different order to the one they were inserted in
+	unsigned int found = 0;
+	start = benchmark_seconds();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (entity_ht_get(hashtable, keys[(i * 7919u) % count], NULL) != NULL)
+		{
+			found++;
+		}
+	}
+	double hit_time = benchmark_seconds() - start;
+
+	// Time looking up keys that are not in the table
+	start = benchmark_seconds();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (entity_ht_get(hashtable, missing[i], NULL) != NULL)
+		{
+			found++;
+		}
+	}
+	double miss_time = benchmark_seconds() - start;
+
+	printf("%-10s %10.1f %10.1f %10.1f\n", name, set_time * 1e9 / count, hit_time * 1e9 / count,
+		miss_time * 1e9 / count);
+
+	// Every hit should have been found and no miss should have been
+	if (found != count)
+	{
+		printf("%s: found %u of %u entities!\n", name, found, count);
+	}
+
+	unload_entity_ht(hashtable);
+}
+
+/*
+ * Perform "benchmark parse [mb]": time splitting every line of mb megabytes of generated
+ * knowledge base text into its entity and description, with the byte-by-byte loop that
+ * knowledge_read() used to have and with every line scanner engine this processor supports.
+ *
+ * Returns:
+ *  0 (the chatbot always continues chatting after a benchmark)
+ */
+static int benchmark_parse(int inc, char* inv[], char* response, int n)
+{
+
+	// Megabytes of text to parse
+	size_t megabytes = BENCHMARK_DEFAULT_PARSE_MB;
+
+	if (inc > 2)
+	{
+		megabytes = strtoul(inv[2], NULL, 10);
+
+		if (megabytes == 0)
+		{
+			snprintf(response, n, "Please give a number of megabytes to benchmark with.");
+			return 0;
+		}
+	}
+
+	size_t size = megabytes * 1024 * 1024;
+	char* text = benchmark_parse_text(size);
+
+	if (text == NULL)
+	{
+		snprintf(response, n, "No memory space :-(");
+		return 0;
+	}
+
+	printf("%zu MB of lines, MB per second:\n", megabytes);
+	printf("%-10s %10s %14s\n", "parser", "MB/s", "bytes parsed");
+
+	// The loop knowledge_read() used to have, one byte at a time
+	double start = benchmark_seconds();
+	size_t parsed = benchmark_parse_loop(text, size);
+	double seconds = benchmark_seconds() - start;
+
+	printf("%-10s %10.1f %14zu\n", "loop", megabytes / seconds, parsed);
+
+	// Every line scanner engine up to the best one this processor supports
+	for (int engine = SCAN_SCALAR; engine <= scan_best_engine(); engine++)
+	{
+		start = benchmark_seconds();
+		parsed = benchmark_parse_scanner(engine, text, size);
+		seconds = benchmark_seconds() - start;
+
+		printf("%-10s %10.1f %14zu\n", scan_engine_name(engine), megabytes / seconds, parsed);
+	}
+
+	free(text);
+
+	snprintf(response, n, "Benchmark complete.");
+	return 0;
+}
+
+/*
+ * Generate size bytes of knowledge base text: "entity=description" lines of different
+ * lengths, up to the longest line knowledge_read() accepts. A block of lines is generated
+ * and repeated, the text always ends with a complete line.
+ *
+ * Returns: the text (not null-terminated), or NULL if we ran out of memory
+ */
+static char* benchmark_parse_text(size_t size)
+{
+	char* text = malloc(size);
+
+	if (text == NULL)
+	{
+		return NULL;
+	}
+
+	// Generate one block of lines
+	size_t block_size = size < BENCHMARK_PARSE_BLOCK ? size : BENCHMARK_PARSE_BLOCK;
+	size_t used = 0;
+	unsigned int line = 0;
+
+	while (true)
+	{
+		char entry[MAX_ENTITY + MAX_RESPONSE + 2];
+		int key_len = 4 + line % 40;
+		int value_len = 10 + (line * 7919u) % 200;
+
+		int length = snprintf(entry, sizeof(entry), "%.*s%u=%.*s\n", key_len, "entity name number for the parsing benchmark",
+			line, value_len, "description text that goes on for a while, the quick brown fox jumps over the lazy dog "
+			"while the chatbot answers questions about the ICT cluster and its modules, again and again until the line "
+			"is long enough to look like a real answer from a curated knowledge base");
+
+		if (used + length > block_size)
+		{
+			break;
+		}
+
+		memcpy(text + used, entry, length);
+		used += length;
+		line++;
+	}
+
+	// Pad the block with blank lines so that it ends with a complete line
+	memset(text + used, '\n', block_size - used);
+
+	// Repeat the block to fill the text, the last copy may be cut short
+	for (size_t offset = block_size; offset < size; offset += block_size)
+	{
+		size_t copy = size - offset < block_size ? size - offset : block_size;
+		memcpy(text + offset, text, copy);
+	}
+
+	// End with a complete line
+	text[size - 1] = '\n';
+
+	return text;
+}
+
+/*
+ * Split every line of the text into its entity and description, the way knowledge_read()
+ * used to: copy the line (as fgets() does), look for '=' one byte at a time, then copy the
+ * description while working out the length of the line again for every byte.
+ *
+ * Returns: the number of bytes of entities and descriptions found (to compare the parsers)
+ */
+static size_t benchmark_parse_loop(const char* text, size_t size)
+{
+	char input_buffer[MAX_ENTITY + MAX_RESPONSE + 2];
+	char entity_key_buffer[MAX_ENTITY + MAX_RESPONSE + 2];
+	char description_value_buffer[MAX_ENTITY + MAX_RESPONSE + 2];
+	size_t parsed = 0;
+	size_t position = 0;
+
+	while (position < size)
+	{
+
+		// Copy the line, like fgets()
+		size_t line_len = 0;
+		while (position < size && line_len < sizeof(input_buffer) - 1)
+		{
+			char c = text[position++];
+			input_buffer[line_len++] = c;
+
+			if (c == '\n')
+			{
+				break;
+			}
+		}
+		input_buffer[line_len] = '\0';
+
+		// Seek up to '=', or the end of the line
+		unsigned int i = 0, j = 0, k = 0;
+		bool entry_flag = false;
+
+		do
+		{
+			if (input_buffer[0] == '=')
+			{
+				break;
+			}
+
+			if (input_buffer[j] == '=')
+			{
+				entry_flag = true;
+				break;
+			}
+			else if (input_buffer[j] == '\n' || input_buffer[j] == '\0')
+			{
+				break;
+			}
+
+			j++;
+		} while (j < sizeof(input_buffer));
+
+		if (!entry_flag)
+		{
+			continue;
+		}
+
+		// Copy the entity
+		while (i != j)
+		{
+			entity_key_buffer[i] = input_buffer[i];
+			i++;
+		}
+		entity_key_buffer[i] = '\0';
+		i++;
+
+		// Copy the description, working out the length of the line for every byte
+		while (i != strlen(input_buffer) - 1)
+		{
+			description_value_buffer[k] = input_buffer[i];
+			k++;
+			i++;
+		}
+		description_value_buffer[k] = '\0';
+
+		benchmark_sink = entity_key_buffer[0] ^ description_value_buffer[0];
+		parsed += j + k;
+	}
+
+	return parsed;
+}
+
+/*
+ * Split every line of the text into its entity and description with a line scanner engine,
+ * copying them out the same way as benchmark_parse_loop() does.
+ *
+ * Returns: the number of bytes of entities and descriptions found (to compare the parsers)
+ */
+static size_t benchmark_parse_scanner(int engine, const char* text, size_t size)
+{
+	char entity_key_buffer[MAX_ENTITY + MAX_RESPONSE + 2];
+	char description_value_buffer[MAX_ENTITY + MAX_RESPONSE + 2];
+	const char* data = text;
+	const char* end = text + size;
+	size_t parsed = 0;
+
+	while (data < end)
+	{
+		const char* equals = NULL;
+		const char* line_end = scan_line_using(engine, data, end, &equals);
+		const char* line = data;
+
+		data = line_end < end ? line_end + 1 : end;
+
+		if (equals == NULL || equals == line)
+		{
+			continue;
+		}
+
+		// Copy the entity and the description
+		size_t key_len = equals - line;
+		size_t value_len = line_end - equals - 1;
+
+		memcpy(entity_key_buffer, line, key_len);
+		entity_key_buffer[key_len] = '\0';
+
+		memcpy(description_value_buffer, equals + 1, value_len);
+		description_value_buffer[value_len] = '\0';
+
+		benchmark_sink = entity_key_buffer[0] ^ description_value_buffer[0];
+		parsed += key_len + value_len;
+	}
+
+	return parsed;
+}
+
+/*
+ * Perform "benchmark save [n]": fill every section with n generated entities, freeze them, and
+ * time writing them all to a temporary .ini file with the fprintf() loop that knowledge_write()
+ * used to have, then with knowledge_write_frozen() on one thread and on KB_SAVE_THREADS threads.
+ *
+ * Returns:
+ *  0 (the chatbot always continues chatting after a benchmark)
+ */
+static int benchmark_save(int inc, char* inv[], char* response, int n)
+{
+
+	// Number of entities in each section
+	unsigned int count = BENCHMARK_DEFAULT_ENTITIES;
+
+	if (inc > 2)
+	{
+		count = (unsigned int) strtoul(inv[2], NULL, 10);
+
+		if (count == 0)
+		{
+			snprintf(response, n, "Please give a number of entities to benchmark with.");
+			return 0;
+		}
+	}
+
+	char** keys = benchmark_keys("entity", count);
+	ht* sections[SECTION_TABLE_SIZE] = { NULL };
+	frozen_ht* tables[SECTION_TABLE_SIZE] = { NULL };
+	bool built = keys != NULL;
+
+	// Descriptions of different lengths, cut from the same text
+	const char* description = "description text that goes on for a while, the quick brown fox jumps over the lazy dog "
+		"while the chatbot answers questions about the ICT cluster and its modules";
+	unsigned int description_len = (unsigned int) strlen(description);
+
+	for (int i = 0; i < SECTION_TABLE_SIZE && built; i++)
+	{
+		sections[i] = create_entity_ht_engine(ENTITY_HT_ENGINE);
+		built = sections[i] != NULL;
+
+		for (unsigned int e = 0; e < count && built; e++)
+		{
+			built = entity_ht_set_view(sections[i], keys[e], (unsigned int) strlen(keys[e]), description,
+				10 + (e * 7919u + i) % (description_len - 10));
+		}
+
+		built = built && entity_ht_freeze(sections[i]);
+		tables[i] = built ? sections[i]->frozen : NULL;
+	}
+
+	if (built)
+	{
+		printf("%u entities in each of %d sections, MB per second:\n", count, SECTION_TABLE_SIZE);
+		printf("%-10s %10s %14s\n", "writer", "MB/s", "bytes written");
+
+		benchmark_save_time("fprintf", tables, true, 0);
+		benchmark_save_time("buffered", tables, false, 1);
+		benchmark_save_time("parallel", tables, false, KB_SAVE_THREADS);
+	}
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		if (sections[i] != NULL)
+		{
+			unload_entity_ht(sections[i]);
+		}
+	}
+
+	benchmark_free_keys(keys, count);
+
+	if (!built)
+	{
+		snprintf(response, n, "No memory space :-(");
+		return 0;
+	}
+
+	snprintf(response, n, "Benchmark complete.");
+	return 0;
+}
+
+/*
+ * Time writing frozen tables to a temporary file (deleted afterwards), and print one line of results.
+ *
+ * Input:
+ *   name     - the name of the writer to print
+ *   tables   - the frozen table of each section
+ *   old_loop - true to write with the fprintf() loop, false with knowledge_write_frozen()
+ *   threads  - the number of threads for knowledge_write_frozen() (0 for KB_SAVE_THREADS)
+ */
+static void benchmark_save_time(const char* name, frozen_ht* const* tables, bool old_loop, unsigned int threads)
+{
+	FILE* f = tmpfile();
+
+	if (f == NULL)
+	{
+		printf("%s: could not open a temporary file!\n", name);
+		return;
+	}
+
+	double start = benchmark_seconds();
+
+	int result = old_loop ? benchmark_save_fprintf(f, tables) : knowledge_write_frozen(f, tables, threads);
+
+	// Count the time taken to hand the last of the file to the system
+	if (fflush(f) != 0)
+	{
+		result = KB_INVALID;
+	}
+
+	double seconds = benchmark_seconds() - start;
+	long size = ftell(f);
+
+	fclose(f);
+
+	if (result != KB_OK)
+	{
+		printf("%s: could not write the file!\n", name);
+		return;
+	}
+
+	printf("%-10s %10.1f %14ld\n", name, size / (1024.0 * 1024.0) / seconds, size);
+}
+
+/*
+ * Write frozen tables to a file the way knowledge_write() used to: one fprintf() per section
+ * and per entry (the strings of a frozen table are null-terminated).
+ *
+ * Returns:
+ *   KB_OK, if the file was written
+ *   KB_INVALID, if the file could not be written
+ */
+static int benchmark_save_fprintf(FILE* f, frozen_ht* const* tables)
+{
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		const frozen_ht* table = tables[i];
+
+		if (table == NULL)
+		{
+			continue;
+		}
+
+		fprintf(f, "[%s]\n", kb_intent_words[i]);
+
+		for (uint32_t e = 0; e < table->count; e++)
+		{
+			fprintf(f, "%s=%s\n", table->strings + table->entries[e].key_offset,
+				table->strings + table->entries[e].value_offset);
+		}
+
+		fprintf(f, "\n");
+	}
+
+	return ferror(f) ? KB_INVALID : KB_OK;
+}
+
+/*
+ * Perform "benchmark threads [w] [t]": fill every section of a knowledge base with
+ * BENCHMARK_THREADS_ENTITIES generated entities, turn concurrent mode on, and time 1, 2, 4, ...
+ * up to t threads (and t itself) each doing BENCHMARK_THREADS_OPERATIONS lookups and puts on it,
+ * w percent of them puts, first with lookups locking each section and then without locks (in
+ * KB_CONCURRENT_LOCKED and KB_CONCURRENT_RCU modes). One thread is also timed with concurrent mode
+ * off, to show what each mode costs.
+ *
+ * Returns:
+ *  0 (the chatbot always continues chatting after a benchmark)
+ */
+static int benchmark_threads(int inc, char* inv[], char* response, int n)
+{
+
+#ifndef BENCHMARK_HAVE_THREADS
+	snprintf(response, n, "Threads are not available on this system.");
+	return 0;
+#else
+	double write_percent = BENCHMARK_DEFAULT_WRITE_PERCENT;
+	unsigned int max_threads = BENCHMARK_DEFAULT_THREADS;
+
+	if (inc > 2)
+	{
+		write_percent = strtod(inv[2], NULL);
+
+		if (write_percent < 0 || write_percent > 100)
+		{
+			snprintf(response, n, "Please give a percentage of puts between 0 and 100.");
+			return 0;
+		}
+	}
+
+	if (inc > 3)
+	{
+		max_threads = (unsigned int) strtoul(inv[3], NULL, 10);
+
+		if (max_threads == 0 || max_threads > BENCHMARK_MAX_THREADS)
+		{
+			snprintf(response, n, "Please give a number of threads between 1 and %d.", BENCHMARK_MAX_THREADS);
+			return 0;
+		}
+	}
+
+	char** keys = benchmark_keys("entity", BENCHMARK_THREADS_ENTITIES);
+	knowledge_base* kb = kb_create();
+	bool built = keys != NULL && kb != NULL;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE && built; i++)
+	{
+		built = section_ht_set(kb->sections, i, create_entity_ht());
+
+		for (unsigned int e = 0; e < BENCHMARK_THREADS_ENTITIES && built; e++)
+		{
+			built = kb_put(kb, kb_intent_words[i], keys[e], "a description of the entity") == KB_FOUND;
+		}
+	}
+
+	if (built)
+	{
+		benchmark_worker workers[BENCHMARK_MAX_THREADS];
+
+		// A put is done when the low 16 bits of a random number fall under the threshold
+		unsigned int write_threshold = (unsigned int) (write_percent / 100.0 * 65536.0);
+
+		for (unsigned int t = 0; t < max_threads; t++)
+		{
+			workers[t].kb = kb;
+			workers[t].keys = keys;
+			workers[t].write_threshold = write_threshold;
+			workers[t].seed = 2463534242u + t * 7919u;
+			workers[t].found = 0;
+			workers[t].rcu = false;
+		}
+
+		printf("%d entities in each of %d sections, %.1f%% puts, %d operations per thread:\n",
+			BENCHMARK_THREADS_ENTITIES, SECTION_TABLE_SIZE, write_percent, BENCHMARK_THREADS_OPERATIONS);
+		printf("%-8s %-8s %16s %10s\n", "threads", "mode", "operations/s", "speedup");
+
+		// One thread without concurrent mode first, to show what each mode costs
+		double unlocked = benchmark_threads_time(workers, 1);
+		printf("%-8u %-8s %16.0f %10s\n", 1, "off", unlocked, "");
+
+		built = kb_set_concurrent(kb, KB_CONCURRENT_LOCKED) == KB_OK;
+
+		if (built)
+		{
+			benchmark_threads_series(workers, max_threads, "locked");
+		}
+
+		// The same again with lookups taking no lock (where the system has what it needs for them)
+		int result = kb_set_concurrent(kb, KB_CONCURRENT_RCU);
+		built = result != KB_NOMEM;
+
+		if (result == KB_OK)
+		{
+			for (unsigned int t = 0; t < max_threads; t++)
+			{
+				workers[t].rcu = true;
+			}
+
+			benchmark_threads_series(workers, max_threads, "rcu");
+		}
+	}
+
+	kb_destroy(kb);
+	benchmark_free_keys(keys, BENCHMARK_THREADS_ENTITIES);
+
+	if (!built)
+	{
+		snprintf(response, n, "No memory space :-(");
+		return 0;
+	}
+
+	snprintf(response, n, "Benchmark complete.");
+	return 0;
+#endif
+}
+
+/*
+ * Time the threads benchmark on 1, 2, 4, ... up to max_threads threads (and max_threads itself),
+ * and print one line of results for each.
+ *
+ * Input:
+ *   workers     - the workers, max_threads of them
+ *   max_threads - the largest number of threads
+ *   mode        - the name of the knowledge base's concurrent mode to print
+ */
+static void benchmark_threads_series(benchmark_worker* workers, unsigned int max_threads, const char* mode)
+{
+	double single = 0;
+	unsigned int t = 1;
+
+	while (true)
+	{
+		double rate = benchmark_threads_time(workers, t);
+
+		if (rate == 0)
+		{
+			printf("%u: could not start the threads!\n", t);
+			return;
+		}
+
+		if (t == 1)
+		{
+			single = rate;
+		}
+
+		printf("%-8u %-8s %16.0f %9.2fx\n", t, mode, rate, rate / single);
+
+		// Double the threads each time, ending with max_threads whether or not it is a power of 2
+		if (t == max_threads)
+		{
+			return;
+		}
+
+		t = t * 2 < max_threads ? t * 2 : max_threads;
+	}
+}
+
+/*
+ * Run the first count workers of the threads benchmark at the same time, each on a thread of its own.
+ *
+ * Returns: the operations per second done by all of them together, 0 if the threads could not be started
+ */
+static double benchmark_threads_time(benchmark_worker* workers, unsigned int count)
+{
+
+#ifdef BENCHMARK_HAVE_THREADS
+	pthread_t threads[BENCHMARK_MAX_THREADS];
+	unsigned int started = 0;
+	double start = benchmark_seconds();
+
+	// A single worker runs on this thread, so that it is timed without a thread being started
+	if (count == 1)
+	{
+		benchmark_threads_run(&workers[0]);
+		started = 1;
+	}
+	else
+	{
+		while (started < count && pthread_create(&threads[started], NULL, benchmark_threads_run, &workers[started]) == 0)
+		{
+			started++;
+		}
+
+		for (unsigned int t = 0; t < started; t++)
+		{
+			pthread_join(threads[t], NULL);
+		}
+	}
+
+	double seconds = benchmark_seconds() - start;
+
+	for (unsigned int t = 0; t < started; t++)
+	{
+		benchmark_sink = (char) workers[t].found;
+	}
+
+	if (started < count)
+	{
+		return 0;
+	}
+
+	return (double) count * BENCHMARK_THREADS_OPERATIONS / seconds;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Do one worker's share of the threads benchmark: lookups and puts of random entities in random sections.
+ */
+static void* benchmark_threads_run(void* arg)
+{
+	benchmark_worker* worker = arg;
+	unsigned int seed = worker->seed;
+	int reader = worker->rcu ? kb_rcu_register(worker->kb) : KB_INVALID;
+
+	for (unsigned int i = 0; i < BENCHMARK_THREADS_OPERATIONS; i++)
+	{
+		// Nothing looked up earlier is kept, so the tables replaced since can be freed
+		if (reader >= 0 && i % BENCHMARK_RCU_QUIESCENT == 0)
+		{
+			kb_rcu_quiescent(worker->kb, reader);
+		}
+
+		// xorshift, so that the threads do not share the state of rand()
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		const char* key = worker->keys[(seed >> 8) % BENCHMARK_THREADS_ENTITIES];
+		const char* intent = kb_intent_words[(seed >> 28) % SECTION_TABLE_SIZE];
+
+		if ((seed & 0xFFFF) < worker->write_threshold)
+		{
+			kb_put(worker->kb, intent, key, "a description the entity has learned");
+		}
+		else
+		{
+			kb_view view;
+			worker->found += kb_get_view(worker->kb, intent, key, strlen(key), &view) == KB_OK;
+		}
+	}
+
+	if (reader >= 0)
+	{
+		kb_rcu_unregister(worker->kb, reader);
+	}
+
+	worker->seed = seed;
+	return NULL;
+}
+
+/*
+ * Generate an array of keys "<prefix><number>".
+ *
+ * Returns: the array, or NULL if we ran out of memory
+ */
+static char** benchmark_keys(const char* prefix, unsigned int count)
+{
+	char** keys = calloc(count, sizeof(char*));
+
+	if (keys == NULL)
+	{
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		char key[MAX_ENTITY];
+		snprintf(key, MAX_ENTITY, "%s%u", prefix, i);
+
+		keys[i] = malloc(strlen(key) + 1);
+
+		if (keys[i] == NULL)
+		{
+			benchmark_free_keys(keys, count);
+			return NULL;
+		}
+
+		strcpy(keys[i], key);
+	}
+
+	return keys;
+}
+
+/*
+ * Free an array of keys made by benchmark_keys().
+ */
+static void benchmark_free_keys(char** keys, unsigned int count)
+{
+	if (keys == NULL)
+	{
+		return;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		free(keys[i]);
+	}
+
+	free(keys);
+}
+
+/*
+ * Get the current time in seconds, for timing.
+ */
+static double benchmark_seconds(void)
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
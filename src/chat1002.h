@@ -22,6 +22,50 @@
 /* the maximum number of characters allowed in a response (including the terminating null) */
 #define MAX_RESPONSE 256
 
+/*
+ * the question words (intents) that the knowledge base keeps a section for.
+ * This is the only place they are listed: the intent_id values, the sections
+ * table, the [section] names accepted in .ini files and the question words
+ * understood by chatbot_main() are all generated from this list when compiling.
+ *
+ * Each entry is X(intent_id, question word, capitalised question word).
+ */
+#define KB_INTENTS(X) \
+    X(KB_WHAT,  "what",  "What") \
+    X(KB_WHERE, "where", "Where") \
+    X(KB_WHO,   "who",   "Who")
+
+/* intent_id values, numbered from 0 to KB_INTENT_COUNT - 1 in the order of KB_INTENTS */
+#define KB_INTENT_ENUM(id, word, title) id,
+enum intent_id { KB_INTENTS(KB_INTENT_ENUM) KB_INTENT_COUNT };
+
+/* the question word and capitalised question word of each intent_id (defined in chatbot.c) */
+extern const char* const kb_intent_words[KB_INTENT_COUNT];
+extern const char* const kb_intent_titles[KB_INTENT_COUNT];
+
+/* 1 to load .ini files by mapping them into memory (knowledge_read_mapped()) where the system supports it,
+ * 0 to always read them with knowledge_read() */
+#define KB_LOAD_MAPPED 1
+
+/* number of threads used to load a mapped .ini file (knowledge_read_parallel()), 0 for one per processor */
+#define KB_LOAD_THREADS 0
+
+/* a loaded file has the answers learned since written into it in the background (and its journal emptied)
+ * once its journal holds this many records or bytes, see knowledge_journal_checkpoint() */
+#define KB_JOURNAL_CHECKPOINT_RECORDS 1000
+#define KB_JOURNAL_CHECKPOINT_BYTES   (4 * 1024 * 1024)
+
+/* 1 for SAVE to write the file on a thread of its own and answer straight away (knowledge_save_background()),
+ * 0 to answer once the file has been written (knowledge_save()) */
+#define KB_SAVE_BACKGROUND 1
+
+/* file that questions the knowledge base cannot answer are kept in by "pending on" when no file is given,
+ * see knowledge_pending_open() */
+#define KB_PENDING_FILE "pending.txt"
+
+/* number of threads used to format the sections of a .ini file being saved (knowledge_write_frozen()), 0 for one per processor */
+#define KB_SAVE_THREADS 0
+
 /* return codes for knowledge_get() and knowledge_put() */
 #define KB_OK        0
 #define KB_FOUND     0
@@ -29,24 +73,47 @@
 #define KB_INVALID  -2
 #define KB_NOMEM    -3
 
+/* modes for kb_set_concurrent(): one thread at a time, lookups sharing a lock on each section,
+ * or lookups taking no lock at all (the tables they read are replaced, never changed in place) */
+#define KB_CONCURRENT_OFF    0
+#define KB_CONCURRENT_LOCKED 1
+#define KB_CONCURRENT_RCU    2
+
+/* a response stored in the knowledge base, by its position and length; it is not null-terminated */
+typedef struct kb_view {
+    const char* text;
+    size_t len;
+} kb_view;
+
+/* a knowledge base, created by kb_create() (its members are in datastructure.h) */
+typedef struct knowledge_base knowledge_base;
+
 /* functions defined in main.c */
 int compare_token(const char* token1, const char* token2);
 void prompt_user(char* buf, int n, const char* format, ...);
+int split_words(char* input, char* inv[]);
 
 /* functions defined in chatbot.c */
 const char* chatbot_botname();
 const char* chatbot_username();
 int chatbot_main(int inc, char* inv[], char* response, int n);
+kb_view chatbot_output(const char* response);
 int chatbot_is_exit(const char* intent);
 int chatbot_do_exit(int inc, char* inv[], char* response, int n);
 int chatbot_is_load(const char* intent);
 int chatbot_do_load(int inc, char* inv[], char* response, int n);
+int chatbot_load_file(const char* file_name, int journal, char* response, int n);
 int chatbot_is_question(const char* intent);
 int chatbot_do_question(int inc, char* inv[], char* response, int n);
+int chatbot_answer_question(knowledge_base* kb, int inc, char* inv[], kb_view* answer, char* response, int n);
 int chatbot_is_reset(const char* intent);
 int chatbot_do_reset(int inc, char* inv[], char* response, int n);
 int chatbot_is_save(const char* intent);
 int chatbot_do_save(int inc, char* inv[], char* response, int n);
+int chatbot_is_pending(const char* intent);
+int chatbot_do_pending(int inc, char* inv[], char* response, int n);
+int chatbot_is_answer(const char* intent);
+int chatbot_do_answer(int inc, char* inv[], char* response, int n);
 int chatbot_is_smalltalk(const char* intent);
 int chatbot_do_smalltalk(int inc, char* inv[], char* response, int n);
 
@@ -54,11 +121,75 @@ int chatbot_do_smalltalk(int inc, char* inv[], char* response, int n);
 int chatbot_is_display(const char* intent);
 int chatbot_do_display(int inc, char* inv[], char* response, int n);
 
-/* functions defined in knowledge.c */
+/* batch mode, answering a file of questions on several threads, defined in batch.c */
+int chatbot_batch(int argc, char* argv[]);
+
+/* functions used to benchmark the knowledge base, defined in benchmark.c */
+int chatbot_is_benchmark(const char* intent);
+int chatbot_do_benchmark(int inc, char* inv[], char* response, int n);
+
+/* functions defined in knowledge.c, each working on the knowledge base it is given */
+knowledge_base* kb_create();
+void kb_destroy(knowledge_base* kb);
+int kb_get(knowledge_base* kb, const char* intent, const char* entity, char* response, int n);
+int kb_get_view(knowledge_base* kb, const char* intent, const char* entity, size_t entity_len, kb_view* response);
+int kb_get_words(knowledge_base* kb, const char* intent, char* const* words, kb_view* response);
+int kb_put(knowledge_base* kb, const char* intent, const char* entity, const char* response);
+void kb_reset(knowledge_base* kb);
+int kb_freeze(knowledge_base* kb);
+int kb_is_empty(knowledge_base* kb);
+int kb_set_concurrent(knowledge_base* kb, int mode);
+int kb_rcu_register(knowledge_base* kb);
+void kb_rcu_quiescent(knowledge_base* kb, int reader);
+void kb_rcu_unregister(knowledge_base* kb, int reader);
+int kb_read(knowledge_base* kb, FILE* f);
+int kb_read_mapped(knowledge_base* kb, const char* file_name);
+int kb_read_parallel(knowledge_base* kb, const char* file_name, unsigned int* threads);
+void kb_write(knowledge_base* kb, FILE* f);
+int kb_save(knowledge_base* kb, const char* file_name, int* rewritten);
+int kb_save_background(knowledge_base* kb, const char* file_name);
+int kb_save_poll(knowledge_base* kb, int wait, char* file_name, int n, int* rewritten);
+int kb_read_binary(knowledge_base* kb, FILE* f);
+int kb_write_binary(knowledge_base* kb, FILE* f);
+int kb_journal_open(knowledge_base* kb, const char* file_name);
+int kb_journal_commit(knowledge_base* kb);
+int kb_journal_checkpoint(knowledge_base* kb);
+void kb_journal_close(knowledge_base* kb);
+int kb_pending_open(knowledge_base* kb, const char* file_name);
+int kb_pending_add(knowledge_base* kb, const char* intent, const char* entity);
+int kb_pending_flush(knowledge_base* kb, int wait);
+int kb_pending_answer(knowledge_base* kb, FILE* f);
+int kb_pending_write(knowledge_base* kb, FILE* f);
+void kb_pending_close(knowledge_base* kb);
+
+/* functions defined in knowledge.c, each working on the default knowledge base used by the chatbot */
+knowledge_base* knowledge_default();
 int knowledge_get(const char* intent, const char* entity, char* response, int n);
+int knowledge_get_view(const char* intent, const char* entity, size_t entity_len, kb_view* response);
+int knowledge_get_words(const char* intent, char* const* words, kb_view* response);
 int knowledge_put(const char* intent, const char* entity, const char* response);
 void knowledge_reset();
+void knowledge_unload();
+int knowledge_freeze();
+int knowledge_is_empty();
 int knowledge_read(FILE* f);
+int knowledge_read_mapped(const char* file_name);
+int knowledge_read_parallel(const char* file_name, unsigned int* threads);
 void knowledge_write(FILE* f);
+int knowledge_save(const char* file_name, int* rewritten);
+int knowledge_save_background(const char* file_name);
+int knowledge_save_poll(int wait, char* file_name, int n, int* rewritten);
+int knowledge_read_binary(FILE* f);
+int knowledge_write_binary(FILE* f);
+int knowledge_journal_open(const char* file_name);
+int knowledge_journal_commit();
+int knowledge_journal_checkpoint();
+void knowledge_journal_close();
+int knowledge_pending_open(const char* file_name);
+int knowledge_pending_add(const char* intent, const char* entity);
+int knowledge_pending_flush(int wait);
+int knowledge_pending_answer(FILE* f);
+int knowledge_pending_write(FILE* f);
+void knowledge_pending_close();
 
 #endif
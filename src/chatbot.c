@@ -3,8 +3,9 @@
  *
  * This file implements the behaviour of the chatbot. The main entry point to
  * this module is the chatbot_main() function, which identifies the intent
- * using the chatbot_is_*() functions then invokes the matching chatbot_do_*()
- * function to carry out the intent.
+ * by looking up the first word in the intent dispatch table (intent_table[])
+ * then invokes the matching chatbot_do_*() function to carry out the intent.
+ * The chatbot_is_*() functions recognise the same words one intent at a time.
  *
  * chatbot_main() and chatbot_do_*() have the same method signature, which
  * works as described here.
@@ -40,19 +41,106 @@
  * returned by these functions at the start of each line.
  */
 
+// Mapped files (mapping_open()) use the POSIX mmap() functions, where they are available
+// The intent dispatch table is built once for all threads (batch mode) with pthread_once()
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define KB_HAVE_MMAP 1
+#define KB_HAVE_THREADS 1
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
 #include "chat1002.h"
 
+#ifdef KB_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef KB_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // Contains struct declarations for data structure and its function prototypes
 #include "datastructure.h"
 
- // Declaring sections hashtable (an array of pointers to section_node struct)
-section_node* sections[SECTION_TABLE_SIZE];
-bool section_ht_initialized = false;
+// The question word and capitalised question word of each intent_id, generated from KB_INTENTS
+#define KB_INTENT_WORD(id, word, title) word,
+#define KB_INTENT_TITLE(id, word, title) title,
+const char* const kb_intent_words[KB_INTENT_COUNT] = { KB_INTENTS(KB_INTENT_WORD) };
+const char* const kb_intent_titles[KB_INTENT_COUNT] = { KB_INTENTS(KB_INTENT_TITLE) };
+
+// Represents an intent recognised by chatbot_main(): a first word and the function that carries it out
+// For question words, section is the intent_id of the knowledge base section (-1 otherwise)
+typedef struct intent_entry {
+    const char* word;
+    int (*handler)(int inc, char* inv[], char* response, int n);
+    int section;
+} intent_entry;
+
+// Dispatch table entry for a question word, generated from KB_INTENTS
+#define KB_INTENT_DISPATCH(id, word, title) { word, chatbot_do_question, id },
+
+/* Every first word the chatbot understands.
+Words with the same handler are listed separately, each gets its own slot in the perfect hash. */
+static const intent_entry intent_table[] =
+{
+    KB_INTENTS(KB_INTENT_DISPATCH)
+    { "exit", chatbot_do_exit, -1 },
+    { "quit", chatbot_do_exit, -1 },
+    { "display", chatbot_do_display, -1 },
+    { "benchmark", chatbot_do_benchmark, -1 },
+    { "hello", chatbot_do_smalltalk, -1 },
+    { "hi", chatbot_do_smalltalk, -1 },
+    { "hey", chatbot_do_smalltalk, -1 },
+    { "tell", chatbot_do_smalltalk, -1 },
+    { "dead", chatbot_do_smalltalk, -1 },
+    { "it", chatbot_do_smalltalk, -1 },
+    { "it's", chatbot_do_smalltalk, -1 },
+    { "greetings", chatbot_do_smalltalk, -1 },
+    { "bye", chatbot_do_smalltalk, -1 },
+    { "goodbye", chatbot_do_smalltalk, -1 },
+    { "ok", chatbot_do_smalltalk, -1 },
+    { "load", chatbot_do_load, -1 },
+    { "reset", chatbot_do_reset, -1 },
+    { "save", chatbot_do_save, -1 },
+    { "pending", chatbot_do_pending, -1 },
+    { "answer", chatbot_do_answer, -1 }
+};
+
+#define INTENT_COUNT (sizeof(intent_table) / sizeof(intent_table[0]))
+
+/* Dispatch table built from intent_table[] the first time a word is looked up.
+intent_dispatch[perfect_hash_index(&intent_hash, key_hash(word))] is the only entry the word can match.
+Batch mode looks words up on several threads at once, so with threads it is built through pthread_once(). */
+static perfect_hash intent_hash;
+static const intent_entry* intent_dispatch[INTENT_COUNT];
+#ifdef KB_HAVE_THREADS
+static pthread_once_t intent_dispatch_once = PTHREAD_ONCE_INIT;
+#else
+static bool intent_dispatch_initialized = false;
+#endif
+
+/* The answer found in the knowledge base by the last question, printed by the main loop in place
+of the response buffer (see chatbot_output()). text is NULL if the last input was not answered this way. */
+static kb_view chatbot_answer = { NULL, 0 };
+
+static void intent_dispatch_init(void);
+static const intent_entry* intent_lookup(const char* word);
+static int load_response(char* response, int n, int pairs, const char* file_name, double start, unsigned int threads, int journal, bool sole_source);
+static double chatbot_seconds(void);
+static void join_words(char* buffer, size_t size, char* const* words);
+static void save_notice(int wait);
+static int question_entity(int inc, char* inv[], char** secondword);
 
 /*
  * Get the name of the chatbot.
@@ -86,52 +174,139 @@ const char* chatbot_username()
  */
 int chatbot_main(int inc, char* inv[], char* response, int n) {
 
+    // The answer to an earlier question is not the output of this input
+    chatbot_answer.text = NULL;
+
     /* check for empty input */
     if (inc < 1) {
         snprintf(response, n, "");
         return 0;
     }
 
-    // If sections hash table is not initialized
-    if (!section_ht_initialized)
+    // Free a bit more of the memory of sections removed by earlier resets
+    reclaim_retired_sections(&knowledge_default()->retired_sections, RECLAIM_BLOCKS_PER_TURN);
+
+    // Say so if a save written in the background has finished since the last input
+    save_notice(0);
+
+    /* look for an intent and invoke the corresponding do_* function */
+    const intent_entry* intent = intent_lookup(inv[0]);
+
+    if (intent == NULL) {
+        snprintf(response, n, "I don't understand \"%s\".", inv[0]);
+        return 0;
+    }
+
+    int done = intent->handler(inc, inv, response, n);
+
+    // Write the answers learned during this turn to the journal, all together
+    knowledge_journal_commit();
+
+    // Write the questions noted down as pending during this turn to their file, without waiting for it
+    knowledge_pending_flush(0);
+
+    return done;
+
+}
+
+/*
+ * Get the chatbot's output for the last input given to chatbot_main().
+ *
+ * An answer found in the knowledge base is not copied into the response buffer, since it
+ * may be longer than the buffer: it is returned where it is stored instead. Otherwise, the
+ * output is what chatbot_main() wrote in the response buffer.
+ *
+ * Input:
+ *   response - the response buffer given to chatbot_main()
+ *
+ * Returns: the output to print (not null-terminated, see kb_view), valid until chatbot_main() is next called
+ */
+kb_view chatbot_output(const char* response)
+{
+    if (chatbot_answer.text != NULL)
     {
+        return chatbot_answer;
+    }
 
-        // Initialize section hash table pointers. Set all section pointers to NULL.
-        for (int i = 0; i < SECTION_TABLE_SIZE; i++)
-        {
-            sections[i] = NULL;
-        }
+    kb_view output = { response, strlen(response) };
+    return output;
+}
+
+/*
+ * Build the intent dispatch table: a minimal perfect hash over the (case-folded)
+ * first words in intent_table[], so that finding the intent for a word takes one
+ * hash of the word and a single comparison.
+ */
+static void intent_dispatch_init(void)
+{
+    unsigned int hashes[INTENT_COUNT];
 
-        section_ht_initialized = true;
+    // Hash every first word the chatbot understands
+    for (unsigned int i = 0; i < INTENT_COUNT; i++)
+    {
+        hashes[i] = key_hash(intent_table[i].word);
     }
 
-    /* look for an intent and invoke the corresponding do_* function */
-    if (chatbot_is_exit(inv[0]))
-        return chatbot_do_exit(inc, inv, response, n);
+    // If the perfect hash can be built, place each intent in its slot
+    if (perfect_hash_build(&intent_hash, hashes, INTENT_COUNT))
+    {
+        for (unsigned int i = 0; i < INTENT_COUNT; i++)
+        {
+            intent_dispatch[perfect_hash_index(&intent_hash, hashes[i])] = &intent_table[i];
+        }
+    }
 
-    else if (chatbot_is_display(inv[0]))
-        return chatbot_do_display(inc, inv, response, n);
+    /* Else (out of memory), intent_hash.count is left at 0 and
+    intent_lookup() goes through intent_table[] one word at a time instead. */
+}
 
-    else if (chatbot_is_smalltalk(inv[0]))
-        return chatbot_do_smalltalk(inc, inv, response, n);
+/*
+ * Find the intent for the first word of the input.
+ *
+ * Input:
+ *  word - the first word
+ *
+ * Returns:
+ *  the matching entry of intent_table[], or NULL if the word is not an intent
+ */
+static const intent_entry* intent_lookup(const char* word)
+{
+    unsigned int word_len = strlen(word);
 
-    else if (chatbot_is_load(inv[0]))
-        return chatbot_do_load(inc, inv, response, n);
+    // Build the intent dispatch table the first time round, other threads wait until it is built
+#ifdef KB_HAVE_THREADS
+    pthread_once(&intent_dispatch_once, intent_dispatch_init);
+#else
+    if (!intent_dispatch_initialized)
+    {
+        intent_dispatch_init();
+        intent_dispatch_initialized = true;
+    }
+#endif
 
-    else if (chatbot_is_question(inv[0]))
-        return chatbot_do_question(inc, inv, response, n);
+    // The dispatch table could not be built, compare against every word instead
+    if (intent_hash.count == 0)
+    {
+        for (unsigned int i = 0; i < INTENT_COUNT; i++)
+        {
+            if (key_equals(intent_table[i].word, strlen(intent_table[i].word), word, word_len))
+            {
+                return &intent_table[i];
+            }
+        }
 
-    else if (chatbot_is_reset(inv[0]))
-        return chatbot_do_reset(inc, inv, response, n);
+        return NULL;
+    }
 
-    else if (chatbot_is_save(inv[0]))
-        return chatbot_do_save(inc, inv, response, n);
+    // The word can only be the intent in its slot, check that it really is
+    const intent_entry* intent = intent_dispatch[perfect_hash_index(&intent_hash, key_hash(word))];
 
-    else {
-        snprintf(response, n, "I don't understand \"%s\".", inv[0]);
-        return 0;
+    if (key_equals(intent->word, strlen(intent->word), word, word_len))
+    {
+        return intent;
     }
 
+    return NULL;
 }
 
 /*
@@ -161,7 +336,7 @@ int chatbot_is_display(const char* intent)
 int chatbot_do_display(int inc, char* inv[], char* response, int n) 
 {
     // Display section hashtable
-    display_section_ht(sections);
+    display_section_ht(knowledge_default()->sections);
     snprintf(response, n, "Knowledge base displayed.");
 
     return 0;
@@ -194,8 +369,11 @@ int chatbot_is_exit(const char* intent)
  */
 int chatbot_do_exit(int inc, char* inv[], char* response, int n) 
 {
-    // Unload sections hashtable, free allocated memory for hash table
-    unload_section_ht(sections);
+    // Let a save being written in the background finish first
+    save_notice(1);
+
+    // Write whatever is left for the journal, and free all of the knowledge
+    knowledge_unload();
 
     snprintf(response, n, "Goodbye!");
 
@@ -229,7 +407,7 @@ int chatbot_is_load(const char* intent)
  * Returns:
  *   0 (the chatbot always continues chatting after loading knowledge)
  */
-int chatbot_do_load(int inc, char* inv[], char* response, int n) 
+int chatbot_do_load(int inc, char* inv[], char* response, int n)
 {
     // Initialize file name string buffer
     char file_name[MAX_ENTITY] = "";
@@ -256,38 +434,204 @@ int chatbot_do_load(int inc, char* inv[], char* response, int n)
         }
     }
 
+    chatbot_load_file(file_name, 1, response, n);
+
+    return 0;
+}
+
+
+/*
+ * Load a .ini or .bin file into the knowledge base, for LOAD (chatbot_do_load()) and for batch mode
+ * (chatbot_batch()), and write the response: the number of responses read and how long it took, or
+ * why the file was not loaded.
+ *
+ * Input:
+ *  file_name - the name of the file
+ *  journal   - 1 to replay the file's journal and keep it for learned answers (see load_response()),
+ *              0 to leave it alone (batch mode learns nothing, and must not leave a journal behind)
+ *  response  - a buffer to receive the response
+ *  n         - the size of the response buffer
+ *
+ * Returns:
+ *  KB_OK, if the file was loaded
+ *  KB_INVALID, if the file is not a .ini or .bin file, could not be opened or is not valid
+ *  KB_NOMEM, if there was a memory allocation failure
+ */
+int chatbot_load_file(const char* file_name, int journal, char* response, int n)
+{
+    // Let a save being written in the background finish first, it may be the file being loaded
+    save_notice(1);
+
     char support_file_type[3] = {'i', 'n', 'i'};
+    char binary_file_type[3] = {'n', 'i', 'b'};
+
+    // Check file type, chatbot only supports .ini files and .bin snapshot files
+    bool ini_file = true;
+    bool binary_file = true;
 
-    // Check file type, chatbot only supports .ini files
     for (int i = 0, len = strlen(file_name); i < 3; i++)
     {
-        if (!(tolower(file_name[len - 1 - i]) == support_file_type[i]))
+        if (i >= len || !(tolower(file_name[len - 1 - i]) == support_file_type[i]))
         {
-            snprintf(response, n, "File type not supported. Please use .ini files.");
-            return 0;
+            ini_file = false;
+        }
+
+        if (i >= len || !(tolower(file_name[len - 1 - i]) == binary_file_type[i]))
+        {
+            binary_file = false;
         }
     }
 
+    if (!ini_file && !binary_file)
+    {
+        snprintf(response, n, "File type not supported. Please use .ini or .bin files.");
+        return KB_INVALID;
+    }
+
+    // The file's journal is only used if the file is all that the knowledge base will hold (see load_response())
+    bool sole_source = knowledge_is_empty();
+
+    // Time the load, it is reported in the response
+    double start = chatbot_seconds();
+
+#if KB_LOAD_MAPPED
+    /* Map a .ini file into memory and parse it with several threads, the entries point straight into it.
+    It is not frozen afterwards, since that would copy every string out of the file again.
+    If the file cannot be mapped, it is read normally below. */
+    if (ini_file)
+    {
+        unsigned int threads = KB_LOAD_THREADS;
+        int pairs = knowledge_read_parallel(file_name, &threads);
+
+        if (pairs != KB_INVALID)
+        {
+            return load_response(response, n, pairs, file_name, start, threads, journal, sole_source);
+        }
+    }
+#endif
+
     // Try to open file for reading
-    FILE* f = fopen(file_name, "r");
+    FILE* f = fopen(file_name, binary_file ? "rb" : "r");
 
     // If file pointer is NULL, could not open file
     if (f == NULL)
     {
-        strcpy(response, "Could not open file for reading. Please check file name.");
-        return 0;
+        snprintf(response, n, "Could not open file for reading. Please check file name.");
+        return KB_INVALID;
+    }
+
+    // A snapshot file is loaded as it is, no need to freeze afterwards
+    if (binary_file)
+    {
+        int pairs = knowledge_read_binary(f);
+        fclose(f);
+
+        if (pairs == KB_INVALID)
+        {
+            snprintf(response, n, "%s is not a valid knowledge base file.", file_name);
+            return KB_INVALID;
+        }
+
+        return load_response(response, n, pairs, file_name, start, 1, journal, sole_source);
     }
 
     // Call knowledge_read() function to load file contents into hashtable
     int pairs = knowledge_read(f);
 
-    snprintf(response, n, "Read %i responses from %s.", pairs, file_name);
+    // The knowledge base is mostly only read from now on, freeze it for faster lookups
+    knowledge_freeze();
 
     fclose(f);
 
-    return 0;
+    return load_response(response, n, pairs, file_name, start, 1, journal, sole_source);
+}
+
+
+/*
+ * Finish a LOAD: replay the learned answers in the file's journal over it (see knowledge_journal_open()),
+ * which is then used for answers learned from now on, and write the response to the LOAD: the number
+ * of responses read, and how long it took. Without the journal (batch mode), only the response is written.
+ *
+ * LOAD adds to the knowledge there is already. If there was some, the knowledge base is no longer
+ * just this file, and checkpointing the journal would write the other responses into it, so no
+ * journal is kept at all (not even the one of a file loaded before).
+ *
+ * Input:
+ *  response    - a buffer to receive the response
+ *  n           - the size of the response buffer
+ *  pairs       - the number of responses read (or KB_NOMEM)
+ *  file_name   - the name of the file
+ *  start       - the time the load started at (from chatbot_seconds())
+ *  threads     - the number of threads the file was loaded with
+ *  journal     - 1 to use the file's journal, 0 to leave it alone
+ *  sole_source - true if the knowledge base was empty before the file was loaded
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int load_response(char* response, int n, int pairs, const char* file_name, double start, unsigned int threads, int journal, bool sole_source)
+{
+    if (pairs == KB_NOMEM)
+    {
+        snprintf(response, n, "No memory space :-(");
+        return KB_NOMEM;
+    }
+
+    int learned = KB_INVALID;
+
+    if (journal && sole_source)
+    {
+        learned = knowledge_journal_open(file_name);
+    }
+    else if (journal)
+    {
+        knowledge_journal_close();
+    }
+
+    if (learned == KB_NOMEM)
+    {
+        snprintf(response, n, "No memory space :-(");
+        return KB_NOMEM;
+    }
+
+    double seconds = chatbot_seconds() - start;
+
+    // Avoid dividing by zero for tiny files
+    double per_second = seconds > 0 ? pairs / seconds : 0;
+
+    int len = snprintf(response, n, "Read %i responses from %s in %.3f seconds (%.0f responses per second, %u thread%s).",
+        pairs, file_name, seconds, per_second, threads, threads == 1 ? "" : "s");
+
+    // Mention the journal, unless it holds nothing (or is not used)
+    if (journal && len >= 0 && len < n)
+    {
+        if (learned > 0)
+        {
+            snprintf(response + len, n - len, " %i learned response%s replayed from its journal.", learned,
+                learned == 1 ? " was" : "s were");
+        }
+        else if (learned == KB_INVALID && !sole_source)
+        {
+            snprintf(response + len, n - len, " Learned responses will not be journaled, since my knowledge does not all come from %s.", file_name);
+        }
+        else if (learned == KB_INVALID)
+        {
+            snprintf(response + len, n - len, " Learned responses will not be journaled.");
+        }
+    }
+
+    return KB_OK;
 }
 
+/*
+ * Get the current time in seconds, for timing.
+ */
+static double chatbot_seconds(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
 /*
  * Determine whether an intent is a question.
@@ -296,27 +640,13 @@ int chatbot_do_load(int inc, char* inv[], char* response, int n)
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is "what", "where", or "who"
+ *  1, if the intent is one of the question words in KB_INTENTS ("what", "where", or "who")
  *  0, otherwise
  */
 int chatbot_is_question(const char* intent) 
 {
-    // intent array
-    char* question[] = { "what", "where", "who" };
-    
-    // counter to check for all intents in the array
-    size_t qlen = sizeof(question) / sizeof(question[0]);
-    for (unsigned int k = 0; k < qlen; k++)
-    {
-        // if intent matches, return 1
-        if (compare_token(intent, question[k]) == 0)
-        {
-            return 1;
-        }
-    }
-    
-    // else, return 0
-    return 0;
+    // The question words are the ones that have a section in the knowledge base
+    return section_index(intent) >= 0;
 }
 
 
@@ -338,95 +668,89 @@ int chatbot_do_question(int inc, char* inv[], char* response, int n)
     // initialize counter for the word number for which the entity will start counting from
     int i = 0;
 
+    // the section of the knowledge base for the question word
+    int section = section_index(inv[0]);
+
     // the second word in the response / question, "is" or "are"
     char *secondword = NULL;
 
-    // initialize entity string
-    char entity[MAX_ENTITY] = "";
+    // entity string, only filled in if the knowledge base does not know the answer
+    char entity[MAX_INPUT];
     
-    // initialize intent buffer
-    char intent[MAX_INTENT] = "";
+    // the question word
+    const char* intent = NULL;
 
-    // initialize string for response.
-    char answer[MAX_RESPONSE + 1] = "";
+    // string for the response given by the user, if the knowledge base does not know the answer
+    char answer[MAX_RESPONSE + 1];
 
-    // initialize intent string for chatbot to relay back to user. (with capitalized first letter)
-    char string[MAX_INTENT] = "";
+    // intent string for chatbot to relay back to user. (with capitalized first letter)
+    const char* string = NULL;
+
+    // check that the question word is one we know
+    if (section < 0)
+    {
+        snprintf(response, n, "I don't understand \"%s\".", inv[0]);
+        return 0;
+    }
     
     // check if entity exists
     if(inc > 1)
     {
-        // assign intent string
-        if (compare_token(inv[0], "what") == 0)
-        {
-            strcat(string, "What");
-
-            // Copy the contents of "what" string into intent buffer
-            strcpy(intent, "what");
-        }
-        else if (compare_token(inv[0], "where") == 0)
-        {
-            strcat(string, "Where");
-
-            // Copy the contents of "where" string into intent buffer
-            strcpy(intent, "where");
-        }
-        else if (compare_token(inv[0], "who") == 0)
-        {
-            strcat(string, "Who");
-
-            // Copy the contents of "who" string into intent buffer
-            strcpy(intent, "who");
-        }
+        // assign intent string and the question word, there is no need to copy them
+        string = kb_intent_titles[section];
+        intent = kb_intent_words[section];
         
         // assign entity string
-        if (compare_token(inv[1], "is") == 0)
-        {
-            secondword = "is";
-            i = 2;
-        }
-        else if(compare_token(inv[1], "are") == 0)
-        {
-            secondword = "are";
-            i = 2;
-        }
-        else
-        {
-            i = 1;
-        }
-        for (int k = i; k < n; k++)
+        i = question_entity(inc, inv, &secondword);
+
+        // "what is" with nothing after it has no entity either
+        if (i == 0)
         {
-            /* this for loop concatenates everything into the entity string 
-            after the intent word. */
-            if (inv[k] != NULL)
-            {
-                strcat(entity, inv[k]);
-                strcat(entity, " ");
-            }
-            else
-            {
-                break;
-            }
+            snprintf(response, n, "Please give entity :-(");
+            return 0;
         }
-        
-        // remove trailing space from for loop earlier
-        entity[strlen(entity) - 1] = '\0';
 
-        /* call knowledge_get function: if return KB_OK then proceed with response.
+        /* call knowledge_get_words function: if return KB_OK then proceed with response.
+        The words after the intent word are looked up as they are in inv[], without
+        joining them into one entity string first.
         If KB_NOTFOUND, will prompt user for input. This will insert the new entity
         into the knowledge base. If KB_INVALID, return invalid intent, and insert
-        new intent into the knowledge base. */
-        int knowledgecheck = knowledge_get(intent, entity, response, n);
+        new intent into the knowledge base.
+        If pending questions are being kept, the question is noted down instead of prompting. */
+        kb_view answer_view;
+        int knowledgecheck = knowledge_get_words(intent, inv + i, &answer_view);
         
         if(knowledgecheck == KB_OK)
         {
-            /* if found, print out the response buffer. 
-            Response buffer is modified in knowledge_get if KB_OK is returned. */
+            /* if found, the answer is printed straight from the knowledge base by the main loop
+            (see chatbot_output()), it is not copied into the response buffer. */
+            chatbot_answer = answer_view;
+            snprintf(response, n, "%s", "");
+            return 0;
+        }
+
+        // The answer is not known, the entity string is needed to ask for it and to store it
+        join_words(entity, sizeof(entity), inv + i);
+        answer[0] = '\0';
+
+        /* With pending questions (see chatbot_do_pending()), nobody is asked for the answer, so
+        the chatbot never waits on the user here. The answers are learned later by ANSWER. */
+        int pendingcheck = knowledge_pending_add(intent, entity);
+
+        if (pendingcheck == KB_OK)
+        {
+            snprintf(response, n, "I don't know yet. I have noted down \"%s%s%s %s?\" to be answered later.", string,
+                secondword != NULL ? " " : "", secondword != NULL ? secondword : "", entity);
+            return 0;
+        }
+        else if (pendingcheck == KB_NOMEM)
+        {
+            snprintf(response, n, "No memory space :-(");
             return 0;
         }
 
-        // Else if there is no valid description for the entity
-        else if (knowledgecheck == KB_NOTFOUND)
+        // If there is no valid description for the entity
+        if (knowledgecheck == KB_NOTFOUND)
         {
             // get response from user.
             prompt_user(answer, MAX_RESPONSE + 1, "I don't know. %s %s %s?", string, secondword, entity);
@@ -471,25 +795,14 @@ int chatbot_do_question(int inc, char* inv[], char* response, int n)
                 return 0;
             }
 
-            char *intentkey = malloc(strlen(intent) + 1);
-
-            // Check for sufficient memory.
-            if (intentkey == NULL)
+            // assign the new entity hash table to the question word's section
+            if (!section_ht_set(knowledge_default()->sections, section, intentsection))
             {
-
-                /* Memory allocation failed for intentkey. 
-                Free memory allocated for intentsection earlier on. */
-                free(intentsection);
+                unload_entity_ht(intentsection);
                 snprintf(response, n, "No memory space :-(");
                 return 0;
             }
 
-            // Copy the contents of intent into intentkey buffer
-            strcpy(intentkey, intent);
-
-            // assign section key based on intent key
-            section_ht_set(sections, intentkey, intentsection);
-
             // get response from user.
             prompt_user(answer, MAX_RESPONSE + 1, "I don't know. %s %s %s?", string, secondword, entity);
 
@@ -501,7 +814,7 @@ int chatbot_do_question(int inc, char* inv[], char* response, int n)
             }
 
             // put response into knowledge base.
-            int putcheck = knowledge_put(intentkey, entity, answer);
+            int putcheck = knowledge_put(intent, entity, answer);
             if(putcheck == KB_OK)
             {
                 // if ok, print response to user with a kind gesture
@@ -530,79 +843,217 @@ int chatbot_do_question(int inc, char* inv[], char* response, int n)
 
 
 /*
- * Determine whether an intent is RESET.
+ * Find where the entity of a question starts: after the question word, and after "is" or "are"
+ * if the second word is one of them.
  *
  * Input:
- *  intent - the intent
+ *  inc        - the number of words in the question
+ *  inv        - the words of the question
+ *  secondword - receives "is" or "are" if the second word is one of them, else NULL
  *
  * Returns:
- *  1, if the intent is "reset"
- *  0, otherwise
+ *  the index in inv of the first word of the entity, 0 if the question has no entity
  */
-int chatbot_is_reset(const char* intent) 
+static int question_entity(int inc, char* inv[], char** secondword)
 {
-    // Check if intent is reset
-    return compare_token(intent, "reset") == 0;
+    int i = 1;
+    *secondword = NULL;
+
+    if (inc > 1 && compare_token(inv[1], "is") == 0)
+    {
+        *secondword = "is";
+        i = 2;
+    }
+    else if (inc > 1 && compare_token(inv[1], "are") == 0)
+    {
+        *secondword = "are";
+        i = 2;
+    }
+
+    return i < inc ? i : 0;
 }
 
 
 /*
- * Reset the chatbot.
+ * Answer a question from a knowledge base without asking the user anything, for batch mode
+ * (see batch.c). The question is read the way chatbot_do_question() reads it. Nothing but the
+ * knowledge base is used, so several threads can answer questions at once while it is in
+ * concurrent mode (see kb_set_concurrent()).
  *
- * See the comment at the top of the file for a description of how this
- * function is used.
+ * Input:
+ *  kb       - the knowledge base
+ *  inc      - the number of words in the question
+ *  inv      - the words of the question
+ *  answer   - receives the answer, if the knowledge base has one
+ *  response - a buffer to receive what the chatbot says otherwise
+ *  n        - the size of the response buffer
  *
  * Returns:
- *   0 (the chatbot always continues chatting after being reset)
+ *  KB_OK, if the answer was found
+ *  KB_NOTFOUND, if the knowledge base does not know it (response holds what the chatbot would ask)
+ *  KB_INVALID, if the input is not a question with an entity (response says why)
  */
-int chatbot_do_reset(int inc, char* inv[], char* response, int n) 
+int chatbot_answer_question(knowledge_base* kb, int inc, char* inv[], kb_view* answer, char* response, int n)
 {
-    // Resets the chatbot, removing all knowledge
-    knowledge_reset();
+    int section = inc > 0 ? section_index(inv[0]) : -1;
+    char* secondword;
 
-    snprintf(response, n, "%s Reset.", "Chatbot");
+    if (section < 0)
+    {
+        snprintf(response, n, "I don't understand \"%s\".", inc > 0 ? inv[0] : "");
+        return KB_INVALID;
+    }
 
-    return 0;
+    int i = question_entity(inc, inv, &secondword);
+
+    if (i == 0)
+    {
+        snprintf(response, n, "Please give entity :-(");
+        return KB_INVALID;
+    }
+
+    // A section that does not exist yet knows nothing either
+    if (kb_get_words(kb, kb_intent_words[section], inv + i, answer) == KB_OK)
+    {
+        return KB_OK;
+    }
 
+    char entity[MAX_INPUT];
+    join_words(entity, sizeof(entity), inv + i);
+
+    snprintf(response, n, "I don't know. %s%s%s %s?", kb_intent_titles[section], secondword != NULL ? " " : "",
+        secondword != NULL ? secondword : "", entity);
+
+    return KB_NOTFOUND;
 }
 
 
 /*
- * Determine whether an intent is SAVE.
+ * Join words into one string, separated by single spaces, cut short if it does not fit.
  *
  * Input:
- *  intent - the intent
- *
- * Returns:
- *  1, if the intent is "what", "where", or "who"
- *  0, otherwise
+ *  buffer - a buffer to receive the string
+ *  size   - the size of the buffer
+ *  words  - the words, ending with a NULL pointer
  */
-int chatbot_is_save(const char* intent) 
+static void join_words(char* buffer, size_t size, char* const* words)
 {
-    // Compare the intent with "save" 
-    return compare_token(intent, "save") == 0;
+    size_t len = 0;
+    buffer[0] = '\0';
+
+    for (int w = 0; words[w] != NULL && len < size; w++)
+    {
+        int written = snprintf(buffer + len, size - len, w > 0 ? " %s" : "%s", words[w]);
+
+        if (written < 0)
+        {
+            break;
+        }
+
+        len += written;
+    }
 }
 
 
 /*
- * Save the chatbot's knowledge to a file.
+ * Print a line telling the user how a save written in the background went, if one has
+ * finished (see knowledge_save_background()). It is printed ahead of the chatbot's response.
  *
- * See the comment at the top of the file for a description of how this
- * function is used.
- *
- * Returns:
- *   0 (the chatbot always continues chatting after saving knowledge)
+ * Input:
+ *  wait - 1 to wait for a save that is still being written, 0 to only report one that has finished
  */
-int chatbot_do_save(int inc, char* inv[], char* response, int n) 
+static void save_notice(int wait)
 {
+    char file_name[MAX_INPUT];
+    int rewritten = 0;
+    int result;
+
+    while ((result = knowledge_save_poll(wait, file_name, sizeof(file_name), &rewritten)) != KB_NOTFOUND)
+    {
+        if (result == KB_OK)
+        {
+            printf("%s: My knowledge has been saved to %s (%i section%s written).\n", chatbot_botname(), file_name,
+                rewritten, rewritten == 1 ? "" : "s");
+        }
+        else
+        {
+            printf("%s: Could not save my knowledge to %s.\n", chatbot_botname(), file_name);
+        }
+    }
+}
+
+
+/*
+ * Determine whether an intent is RESET.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "reset"
+ *  0, otherwise
+ */
+int chatbot_is_reset(const char* intent) 
+{
+    // Check if intent is reset
+    return compare_token(intent, "reset") == 0;
+}
+
+
+/*
+ * Reset the chatbot.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after being reset)
+ */
+int chatbot_do_reset(int inc, char* inv[], char* response, int n) 
+{
+    // Resets the chatbot, removing all knowledge
+    knowledge_reset();
+
+    snprintf(response, n, "%s Reset.", "Chatbot");
+
+    return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is SAVE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "what", "where", or "who"
+ *  0, otherwise
+ */
+int chatbot_is_save(const char* intent) 
+{
+    // Compare the intent with "save" 
+    return compare_token(intent, "save") == 0;
+}
+
+
+/*
+ * Save the chatbot's knowledge to a file.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after saving knowledge)
+ */
+int chatbot_do_save(int inc, char* inv[], char* response, int n) 
+{
+
+    // Variable initializations
+    // File name buffer
+    char filename[MAX_ENTITY];
 
-    // Variable initializations
-    // File name buffer
-    char filename[MAX_ENTITY];
-
-    // File pointer to write a new file
-    FILE *f;
-
     // String buffer to check for proper file type
     char *inifile;
 
@@ -614,7 +1065,7 @@ int chatbot_do_save(int inc, char* inv[], char* response, int n)
     {
 
         // If there is a valid section, there are valid entries
-        if (sections[i] != NULL)
+        if (knowledge_default()->sections[i] != NULL)
         {
 
             // Set can_save to true
@@ -665,23 +1116,43 @@ int chatbot_do_save(int inc, char* inv[], char* response, int n)
             inifile = strrchr(inv[1], '.');
         }
 
-        // If there is a return value in inifile, compare it with ".ini" to see if it matches
-        if(inifile != NULL && strcmp(inifile, ".ini") == 0)
-        {            
-            /*
-            Open up a file with the file name specified
-            Calls knowledge_write() and store data structure in file stream
-            close file stream and write it to the system in .ini format
-            */
-            f = fopen(filename, "w"); 
-            knowledge_write(f); 
-            fclose(f); 
+        /*
+        A .ini file is saved in .ini format, a .bin file as a binary snapshot, which loads much faster.
+        Saving to the same .ini file again only writes the sections that changed since,
+        the others are copied from the file as they are.
+        */
+        if(inifile != NULL && (strcmp(inifile, ".ini") == 0 || strcmp(inifile, ".bin") == 0))
+        {
+#if KB_SAVE_BACKGROUND
+            // The file is written on a thread of its own, the user is told when it is done (see save_notice())
+            int result = knowledge_save_background(filename);
+#else
+            int rewritten = 0;
+            int result = knowledge_save(filename, &rewritten);
+#endif
+
+            if (result == KB_NOMEM)
+            {
+                snprintf(response, n, "No memory space :-(");
+                return 0;
+            }
+
+            if (result != KB_OK)
+            {
+                snprintf(response, n, "Could not save my knowledge to %s.", filename);
+                return 0;
+            }
 
-            snprintf(response, n, "My knowledge has been saved to %s.", filename);
+#if KB_SAVE_BACKGROUND
+            snprintf(response, n, "Saving my knowledge to %s in the background.", filename);
+#else
+            snprintf(response, n, "My knowledge has been saved to %s (%i section%s written).", filename,
+                rewritten, rewritten == 1 ? "" : "s");
+#endif
         }
         else
         {            
-            snprintf(response, n, "Please specify the correct type of file name ending with '.ini'.");
+            snprintf(response, n, "Please specify the correct type of file name ending with '.ini' or '.bin'.");
         }
     }
     else
@@ -693,6 +1164,162 @@ int chatbot_do_save(int inc, char* inv[], char* response, int n)
 }
 
 
+/*
+ * Determine whether an intent is PENDING.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "pending"
+ *  0, otherwise
+ */
+int chatbot_is_pending(const char* intent)
+{
+    return compare_token(intent, "pending") == 0;
+}
+
+
+/*
+ * Keep the questions the chatbot cannot answer as pending questions, or stop keeping them,
+ * or list them.
+ *
+ *   pending on [file]   note down unanswered questions in the file (KB_PENDING_FILE if not given)
+ *                       instead of asking the user for the answers
+ *   pending off         ask the user for the answers again
+ *   pending             list the questions waiting for an answer
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after this)
+ */
+int chatbot_do_pending(int inc, char* inv[], char* response, int n)
+{
+    if (inc > 1 && compare_token(inv[1], "on") == 0)
+    {
+        const char* file_name = inc > 2 ? inv[2] : KB_PENDING_FILE;
+        int waiting = knowledge_pending_open(file_name);
+
+        if (waiting == KB_NOMEM)
+        {
+            snprintf(response, n, "No memory space :-(");
+            return 0;
+        }
+
+        snprintf(response, n, "I will note down the questions I cannot answer in %s (%i waiting for an answer).",
+            file_name, waiting);
+    }
+    else if (inc > 1 && compare_token(inv[1], "off") == 0)
+    {
+        knowledge_pending_close();
+        snprintf(response, n, "I will ask for the answers I do not know again.");
+    }
+    else
+    {
+        int waiting = knowledge_pending_write(stdout);
+
+        if (waiting == KB_INVALID)
+        {
+            snprintf(response, n, "I am not noting down pending questions. Use \"pending on\" to start.");
+        }
+        else if (waiting == KB_NOMEM)
+        {
+            snprintf(response, n, "No memory space :-(");
+        }
+        else
+        {
+            snprintf(response, n, "%i question%s waiting for an answer.", waiting, waiting == 1 ? "" : "s");
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Determine whether an intent is ANSWER.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "answer"
+ *  0, otherwise
+ */
+int chatbot_is_answer(const char* intent)
+{
+    return compare_token(intent, "answer") == 0;
+}
+
+
+/*
+ * Learn the answers to pending questions from a file, all in one go (see knowledge_pending_answer()).
+ *
+ *   answer pending [from] file
+ *
+ * "pending" and "from" may be omitted.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after this)
+ */
+int chatbot_do_answer(int inc, char* inv[], char* response, int n)
+{
+    int i = 1;
+
+    if (i < inc && compare_token(inv[i], "pending") == 0)
+    {
+        i++;
+    }
+
+    if (i < inc && compare_token(inv[i], "from") == 0)
+    {
+        i++;
+    }
+
+    if (i >= inc)
+    {
+        snprintf(response, n, "Please specify the file of answers!");
+        return 0;
+    }
+
+    FILE* f = fopen(inv[i], "r");
+
+    if (f == NULL)
+    {
+        snprintf(response, n, "Could not open file for reading. Please check file name.");
+        return 0;
+    }
+
+    int learned = knowledge_pending_answer(f);
+    fclose(f);
+
+    if (learned == KB_NOMEM)
+    {
+        snprintf(response, n, "No memory space :-(");
+        return 0;
+    }
+
+    int waiting = knowledge_pending_write(NULL);
+
+    if (waiting >= 0)
+    {
+        snprintf(response, n, "Learned %i answer%s from %s (%i question%s still waiting for an answer).",
+            learned, learned == 1 ? "" : "s", inv[i], waiting, waiting == 1 ? "" : "s");
+    }
+    else
+    {
+        snprintf(response, n, "Learned %i answer%s from %s.", learned, learned == 1 ? "" : "s", inv[i]);
+    }
+
+    return 0;
+}
+
+
 /*
  * Determine which an intent is smalltalk.
  *
@@ -799,9 +1426,22 @@ int chatbot_do_smalltalk(int inc, char* inv[], char* response, int n)
  *  It takes no arguments and returns a pointer to a ht struct.
  *  Ht stands for hash table.
  * 
+ *  The table uses the engine selected by ENTITY_HT_ENGINE.
+ *
  *  It essentialy returns a pointer to the hash table. 
  */
 ht* create_entity_ht(void)
+{
+    return create_entity_ht_engine(ENTITY_HT_ENGINE);
+}
+
+/* 
+ *  Function creates and allocates memory for an entity hash table
+ *  that uses the given engine (ENTITY_HT_CHAINED or ENTITY_HT_OPEN).
+ *
+ *  It returns a pointer to the hash table, or NULL if we ran out of memory.
+ */
+ht* create_entity_ht_engine(int engine)
 {
 
     // ALlocate memory for the entity hash table
@@ -814,28 +1454,53 @@ ht* create_entity_ht(void)
         return NULL;
     }
 
-    // Allocate memory for the entries in the entity hash table
-    new_entity_ht->entries = malloc(sizeof(node) * ENTITY_TABLE_SIZE);
+    new_entity_ht->engine = engine;
+    new_entity_ht->entries = NULL;
+    new_entity_ht->slots = NULL;
+
+    // Allocate memory for the buckets or slots in the entity hash table, all set to empty
+    if (engine == ENTITY_HT_OPEN)
+    {
+        new_entity_ht->slots = calloc(ENTITY_TABLE_SIZE, sizeof(slot));
+    }
+    else
+    {
+        new_entity_ht->entries = calloc(ENTITY_TABLE_SIZE, sizeof(node*));
+    }
 
     // Check for sufficient memory
-    if (new_entity_ht->entries == NULL)
+    if (new_entity_ht->entries == NULL && new_entity_ht->slots == NULL)
     {
         free(new_entity_ht);
         printf("Ran out of memory.\nNo memory is allocated.\n");
         return NULL;
     }
 
-    // Set all hash table pointer to NULL
-    for (int i = 0; i < ENTITY_TABLE_SIZE; i++)
-    {
-        new_entity_ht->entries[i] = NULL;
-    }
+    // The table starts out empty with the initial number of buckets
+    new_entity_ht->size = ENTITY_TABLE_SIZE;
+    new_entity_ht->count = 0;
+
+    // The arena allocates its first block on the first insert
+    new_entity_ht->arena.blocks = NULL;
+
+    // No resize is in progress yet
+    new_entity_ht->old_entries = NULL;
+    new_entity_ht->old_slots = NULL;
+    new_entity_ht->old_size = 0;
+    new_entity_ht->rehash_index = 0;
+
+    // Nothing has been frozen yet, and no entries point into a mapped file
+    new_entity_ht->frozen = NULL;
+    new_entity_ht->mappings = NULL;
+
+    // A new table is in no file yet
+    new_entity_ht->dirty = true;
 
     return new_entity_ht;
 }
 
 /*  This function sets the entity hashtable entry in the entity hashtable 
- *  for the related section node with the given section key, 
+ *  for the related section node with the given section, 
  *  entity key and the entity description. 
  *
  *  If it is a new entity entry (new key was provided), new memory is allocated
@@ -846,7 +1511,7 @@ ht* create_entity_ht(void)
  *
  *  It takes 4 arguments:
  *      1. The sections hashtable.
- *      2. The section key.
+ *      2. The section (its intent_id, see section_index()).
  *      3. The entity key.
  *      4. The description value.
  *
@@ -855,17 +1520,14 @@ ht* create_entity_ht(void)
  *
  *  Note: Section MUST exist for this function to work.
  */
-bool section_entity_ht_set(section_node* sections[], const char* section_key, const char* entity_key, char* value)
+bool section_entity_ht_set(section_node* sections[], int section, const char* entity_key, char* value)
 {
 
-    // Determine the bucket slot for the section
-    unsigned int bucket = section_hash(section_key);
-
-    // Set a pointer to point to the first item in the bucket slot
-    section_node* section = sections[bucket];
+    // Try to get the section's entity hash table, the section is found directly by its index
+    ht* hashtable = section_ht_get(sections, section);
 
     // Check if the section exists
-    if (section == NULL)
+    if (hashtable == NULL)
     {
         printf("DEBUG: You are trying to set an entity - description key value pair in "
             "an entity hashtable that does not exist.\n"
@@ -874,67 +1536,35 @@ bool section_entity_ht_set(section_node* sections[], const char* section_key, co
         return false;
     }
 
-    // Set a travesal pointer to the start of the section
-    section_node* trav = section;
-
-    // While the trav ptr points to an existing section
-    while (trav != NULL)
-    {
-
-        /* Check for key match, if there is a key match,
-        this means this is the section we want to insert data into.
-        Key compares case sensitively. */
-        if (strcmp(trav->section_key, section_key) == 0)
-        {
-
-            /* Set the section entity hashtable entry with the entity key value pair given.
-            entity_ht_set returns true / false depending on the success of the set operation. */
-            if (entity_ht_set(trav->section_ht, entity_key, value))
-            {
-                return true;
-            }
-            
-            return false;
-        }
-
-        /* Else, key comparison is not the same, 
-        we are not at the right section, go to the next section in list. */
-        trav = trav->next;
-    }
-
-    // Else trav is NULL, we reached the end of the linked list at the bucket
-    printf("DEBUG: You are trying to set an entity - description key value pair in "
-        "an entity hashtable that does not exist.\n"
-        "Create a new section first using section_ht_set().\n"
-        "No action was taken.\n");
-    return false;
+    /* Set the section entity hashtable entry with the entity key value pair given.
+    entity_ht_set returns true / false depending on the success of the set operation. */
+    return entity_ht_set(hashtable, entity_key, value);
 }
 
 /*  This function gets the entity hash table entry in the sections hash table
- *  with the given section key and entity description key value pair.
+ *  with the given section and entity description key value pair.
  *
- *  It takes 3 arguments:
+ *  It takes 4 arguments:
  *      1. The sections hashtable.
- *      2. The section key.
+ *      2. The section (its intent_id, see section_index()).
  *      3. The entity key.
+ *      4. Where to store the length of the entity description (may be NULL).
  *
- *  It returns a char* (a string) containing the entity description.
+ *  It returns a const char* containing the entity description. It is not
+ *  always null-terminated, use the length stored through the 4th argument.
  * 
  *  If it is an entry that does not exist, NULL is returned.
  *
  *  Note: Section MUST exist for this function to work.
  */
-char* section_entity_ht_get(section_node* sections[], const char* section_key, const char* entity_key)
+const char* section_entity_ht_get(section_node* sections[], int section, const char* entity_key, unsigned int* value_len)
 {
 
-    // Determine the bucket slot for the section
-    unsigned int bucket = section_hash(section_key);
-
-    // Set a pointer to point to the first item in the bucket slot
-    section_node* section = sections[bucket];
+    // Try to get the section's entity hash table, the section is found directly by its index
+    ht* hashtable = section_ht_get(sections, section);
 
     // Check if the section exists
-    if (section == NULL)
+    if (hashtable == NULL)
     {
         printf("DEBUG: You are trying to get an entity - description key value pair in "
             "an entity hashtable that does not exist.\n"
@@ -943,33 +1573,10 @@ char* section_entity_ht_get(section_node* sections[], const char* section_key, c
         return NULL;
     }
 
-    // Set a travesal pointer to the start of the section
-    section_node* trav = section;
-
-    // While the trav ptr points to an existing section
-    while (trav != NULL)
-    {
-
-        /* Check for key match, if there is a key match,
-        this means this is the section we want to insert data into.
-        Key compares case sensitively. */
-        if (strcmp(trav->section_key, section_key) == 0)
-        {
-
-            /* Get and return the entity description with the given key
-            entity_ht_get() gets the value from the entity hash table. If a
-            value is found, the value is return, else NULL is returned. */
-            char* matched_value = entity_ht_get(trav->section_ht, entity_key);
-            return matched_value;
-        }
-
-        // Else, we are not at the right section, go to the next section in list.
-        trav = trav->next;
-    }
-
-    /* We reached the end of the list.
-    There is an entry, but no matching key. Return NULL. */
-    return NULL;
+    /* Get and return the entity description with the given key
+    entity_ht_get() gets the value from the entity hash table. If a
+    value is found, the value is return, else NULL is returned. */
+    return entity_ht_get(hashtable, entity_key, value_len);
 }
 
 /*  This is a helper function that sets the entity hash table entry
@@ -981,6 +1588,9 @@ char* section_entity_ht_get(section_node* sections[], const char* section_key, c
  *  If there is already an existing entry with the same key,
  *  the entry's value is updated instead.
  *
+ *  If the table is in the middle of growing, a few more old buckets are moved
+ *  over to the new bucket array first.
+ *
  *  It takes 3 arguments:
  *      1. The entity hashtable.
  *      2. The entity key.
@@ -990,113 +1600,465 @@ char* section_entity_ht_get(section_node* sections[], const char* section_key, c
  */
 bool entity_ht_set(ht* hashtable, const char* key, char* value)
 {
+    unsigned int key_len = strlen(key);
+    return entity_ht_insert(hashtable, key, key_len, key_hash_len(key, key_len), value, strlen(value), true);
+}
 
-    // Determine the bucket slot for the description value
-    unsigned int bucket = entity_hash(key);
+/*  This is a helper function that sets the entity hash table entry with the
+ *  given entity description key value pair, without copying the key or value.
+ *
+ *  The entry points straight at the key and value given, which must stay in
+ *  memory (unchanged) for as long as the entry does, e.g. slices of a mapped file
+ *  held by the table (see entity_ht_hold_mapping()). Neither has to be null-terminated.
+ *
+ *  It takes 5 arguments:
+ *      1. The entity hashtable.
+ *      2. The entity key.
+ *      3. The length of the entity key.
+ *      4. The description value.
+ *      5. The length of the description value.
+ *
+ *  It returns true if it is set, false if is not.
+ */
+bool entity_ht_set_view(ht* hashtable, const char* key, unsigned int key_len, const char* value, unsigned int value_len)
+{
+    return entity_ht_insert(hashtable, key, key_len, key_hash_len(key, key_len), value, value_len, false);
+}
 
-    // Try to get an entry from the bucket
-    node* entry = hashtable->entries[bucket];
+/*  This is a helper function that does the work of entity_ht_set() and
+ *  entity_ht_set_view(), for a key and value of known length whose hash
+ *  has already been worked out.
+ *
+ *  It takes 7 arguments:
+ *      1. The entity hashtable.
+ *      2. The entity key.
+ *      3. The length of the entity key.
+ *      4. The full hash of the entity key, from key_hash_len().
+ *      5. The description value.
+ *      6. The length of the description value.
+ *      7. Whether to copy the key and value into the table's arena (true),
+ *         or to point at them (false).
+ *
+ *  It returns true if it is set, false if is not.
+ */
+bool entity_ht_insert(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    const char* value, unsigned int value_len, bool copy)
+{
+
+    // Do a bit of the pending resize work, if any
+    entity_ht_rehash_step(hashtable, ENTITY_REHASH_STEP);
 
-    // There is no entry, put it into the bucket slot
-    if (entry == NULL)
+    // The table no longer matches the last file it was saved to
+    hashtable->dirty = true;
+
+    // Look for an existing entry with the same key, key compares case-insensitively.
+    node* trav = entity_ht_find(hashtable, key, full_hash, key_len, NULL);
+
+    // If there is a key match, replace the value
+    if (trav != NULL)
     {
 
-        // Create a new entry, helper function used to allocate memory.
-        node* new_entry = create_entity_entry(key, value);
+        /* Allocate memory for new value from the table's arena, unless it is not to be copied.
+        The old value cannot be freed on its own, its memory is given back
+        together with the rest of the arena when the table is unloaded. */
+        const char* new_value = copy ? arena_strndup(&hashtable->arena, value, value_len) : value;
 
-        // If NULL is returned, ran out of memory
-        if (new_entry == NULL)
+        // Check for sufficient memory
+        if (new_value == NULL)
         {
-
-            // Return false, set opertaion failed
+            printf("Ran out of memory.\nNo memory is allocated.\n");
             return false;
         }
 
-        // Set the entity hash table entry pointer to point to the new entry.
-        hashtable->entries[bucket] = new_entry;
+        // Replace the value
+        trav->description_value = new_value;
+        trav->value_len = value_len;
 
         // Return true, set operation successful
         return true;
     }
 
-    /* Else there is already an entry in bucket,
-    create a linked list instead. */
+    /* Else there is no entry with this key, we want to insert a new entry.
+    New entries always go into the current bucket array. */
+
+    // Create a new entry, helper function used to allocate memory.
+    node* new_entry = create_entity_entry(&hashtable->arena, key, full_hash, key_len, value, value_len, copy);
+
+    // If NULL is returned, ran out of memory
+    if (new_entry == NULL)
+    {
+
+        // Return false, set opertaion failed
+        return false;
+    }
+
+    if (hashtable->engine == ENTITY_HT_OPEN)
+    {
+
+        // Place the new entry in a free slot, keeping its hash and key length alongside
+        slot new_slot = { full_hash, key_len, new_entry };
+        open_ht_insert(hashtable->slots, hashtable->size, new_slot);
+        hashtable->count++;
+
+        // Grow the table if too many slots are in use
+        if (hashtable->count * 100 > hashtable->size * ENTITY_OPEN_MAX_LOAD_PERCENT)
+        {
+            entity_ht_resize(hashtable, hashtable->size * 2);
+        }
+    }
+    else
+    {
+
+        // Insert the new entry at the front of the linked list for its bucket
+        unsigned int bucket = entity_hash(full_hash, hashtable->size);
+        new_entry->next = hashtable->entries[bucket];
+        hashtable->entries[bucket] = new_entry;
+        hashtable->count++;
+
+        // Grow the table if it is getting too full
+        if (hashtable->count > hashtable->size * ENTITY_TABLE_MAX_LOAD)
+        {
+            entity_ht_resize(hashtable, hashtable->size * 2);
+        }
+    }
+
+    // Return true, set operation successful
+    return true;
+}
+
+/*  This is a helper function that finds the entry with the given key in the
+ *  entity hash table. While the table is growing, both the current and the
+ *  old bucket array are searched.
+ *
+ *  It takes 5 arguments:
+ *      1. The entity hashtable.
+ *      2. The entity key.
+ *      3. The full hash of the entity key, from key_hash().
+ *      4. The length of the entity key.
+ *      5. The words of the entity key if it is a list of words (see key_hash_words()), else NULL.
+ *
+ *  It returns the matching entry, or NULL if there is no entry with the key.
+ */
+node* entity_ht_find(ht* hashtable, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words)
+{
+    node* entry;
+
+    // Open addressing tables are searched slot by slot instead
+    if (hashtable->engine == ENTITY_HT_OPEN)
+    {
+
+        // Search the current slot array first, it has the newest entries
+        entry = open_ht_find(hashtable->slots, hashtable->size, key, full_hash, key_len, words);
+
+        // If not found and the table is growing, the entry may still be in the old slot array only
+        if (entry == NULL && hashtable->old_slots != NULL)
+        {
+            entry = open_ht_find(hashtable->old_slots, hashtable->old_size, key, full_hash, key_len, words);
+        }
+
+        return entry;
+    }
+
+    // Search the bucket in the current bucket array
+    entry = chained_ht_find(hashtable->entries[entity_hash(full_hash, hashtable->size)], key, full_hash, key_len, words);
+
+    // If not found and the table is growing, the entry may not have been moved over from the old bucket array yet
+    if (entry == NULL && hashtable->old_entries != NULL)
+    {
+        unsigned int old_bucket = entity_hash(full_hash, hashtable->old_size);
+
+        // Old buckets below rehash_index have already been moved (and are empty)
+        if (old_bucket >= hashtable->rehash_index)
+        {
+            entry = chained_ht_find(hashtable->old_entries[old_bucket], key, full_hash, key_len, words);
+        }
+    }
 
-    // Create a travesal pointer to the first entry in the bucket
-    node* trav = hashtable->entries[bucket];
+    return entry;
+}
 
-    // Create another travesal to keep track of the previous item in the bucket
-    node* prev = hashtable->entries[bucket];
+/*  This is a helper function that finds the entry with the given key in
+ *  the linked list of one bucket of a chained entity hash table.
+ *
+ *  The entity key string is only read when both the hash and the key length match.
+ *
+ *  It takes 5 arguments:
+ *      1. The first entry in the bucket.
+ *      2. The entity key.
+ *      3. The full hash of the entity key, from key_hash().
+ *      4. The length of the entity key.
+ *      5. The words of the entity key if it is a list of words (see key_hash_words()), else NULL.
+ *
+ *  It returns the matching entry, or NULL if there is no entry with the key.
+ */
+node* chained_ht_find(node* entry, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words)
+{
+    node* trav = entry;
 
-    // While there is still a node in the bucket (linked list)
     while (trav != NULL)
     {
 
-        // If there is a key match, key compares case sensitively.
-        if (strcmp(trav->entity_key, key) == 0)
+        // If there is a key match, comparing hash and length before the key itself
+        if (trav->hash == full_hash && entity_key_equals(trav->entity_key, trav->key_len, key, key_len, words))
         {
+            return trav;
+        }
+
+        // Else, traverse to the next linked entry
+        trav = trav->next;
+    }
+
+    /* We reached the end of the list.
+    There is no entry with a matching key. Return NULL. */
+    return NULL;
+}
+
+/*  This is a helper function that starts growing (or shrinking) the entity
+ *  hash table to the given number of buckets.
+ *
+ *  A new, empty bucket array is allocated and the current one becomes the old
+ *  bucket array. The entries are then moved over a few buckets at a time by
+ *  entity_ht_rehash_step() on every get and set, so the cost of moving them is
+ *  spread out instead of being paid by the operation that triggered the resize.
+ *
+ *  It takes 2 arguments:
+ *      1. The entity hashtable.
+ *      2. The new number of buckets (must be a power of two).
+ *
+ *  It returns true if the resize was started, false if we ran out of memory.
+ *  The table is left untouched (and still usable) if resizing fails.
+ */
+bool entity_ht_resize(ht* hashtable, unsigned int new_size)
+{
+
+    // Allocate memory for the new bucket or slot array, all set to empty
+    node** new_entries = NULL;
+    slot* new_slots = NULL;
+
+    if (hashtable->engine == ENTITY_HT_OPEN)
+    {
+        new_slots = calloc(new_size, sizeof(slot));
+    }
+    else
+    {
+        new_entries = calloc(new_size, sizeof(node*));
+    }
+
+    // Check for sufficient memory, the old table is kept as it is
+    if (new_entries == NULL && new_slots == NULL)
+    {
+        return false;
+    }
+
+    /* Only one resize can be in progress at a time, so finish the previous one first.
+    With ENTITY_REHASH_STEP > 1 the previous resize has always finished long before
+    the table fills up again, so this is not expected to do any work. */
+    entity_ht_rehash_step(hashtable, hashtable->old_size);
 
-            // Allocate memory for new value
-            char *new_value = malloc(strlen(value) + 1);
+    // The current array becomes the old one, entries are moved over incrementally
+    hashtable->old_entries = hashtable->entries;
+    hashtable->old_slots = hashtable->slots;
+    hashtable->old_size = hashtable->size;
+    hashtable->rehash_index = 0;
 
-            // Check for sufficient memory
-            if (new_value == NULL)
+    // Switch over to the new array
+    hashtable->entries = new_entries;
+    hashtable->slots = new_slots;
+    hashtable->size = new_size;
+
+    return true;
+}
+
+/*  This is a helper function that moves entries from the old bucket array into
+ *  the current bucket array while the entity hash table is growing.
+ *
+ *  Chained entries are relinked rather than copied, so no entry memory is allocated
+ *  or freed. Open addressing entries are copied into the new slot array but left
+ *  in place in the old one, so that lookups that still probe the old slot array
+ *  never find a gap in the middle of a run of slots.
+ *
+ *  Once every old bucket has been moved, the old bucket array is freed.
+ *
+ *  It takes 2 arguments:
+ *      1. The entity hashtable.
+ *      2. The maximum number of old buckets to move.
+ */
+void entity_ht_rehash_step(ht* hashtable, unsigned int steps)
+{
+
+    // If no resize is in progress, there is nothing to do
+    if (hashtable->old_size == 0)
+    {
+        return;
+    }
+
+    // Move the entries of up to 'steps' old buckets
+    while (steps > 0 && hashtable->rehash_index < hashtable->old_size)
+    {
+        if (hashtable->engine == ENTITY_HT_OPEN)
+        {
+
+            // Copy the old slot over if it is in use
+            if (hashtable->old_slots[hashtable->rehash_index].entry != NULL)
             {
-                printf("Ran out of memory.\nNo memory is allocated.\n");
-                return false;
+                open_ht_insert(hashtable->slots, hashtable->size, hashtable->old_slots[hashtable->rehash_index]);
             }
+        }
+        else
+        {
+            node* trav = hashtable->old_entries[hashtable->rehash_index];
+
+            while (trav != NULL)
+            {
 
-            // If there's enough memory, copy the contents of value into new_value
-            strcpy(new_value, value);
+                // Remember the next entry before relinking this one
+                node* next = trav->next;
+                unsigned int bucket = entity_hash(trav->hash, hashtable->size);
 
-            // Free existing description_value
-            free(trav->description_value);
+                // Push the entry to the front of its new bucket
+                trav->next = hashtable->entries[bucket];
+                hashtable->entries[bucket] = trav;
 
-            // Replace the value
-            trav->description_value = new_value;
+                trav = next;
+            }
 
-            // Return true, set operation successful
-            return true;
+            // The old bucket is now empty
+            hashtable->old_entries[hashtable->rehash_index] = NULL;
         }
 
-        // Else there is no match, check next entry
-        prev = trav;
-        trav = trav->next;
+        hashtable->rehash_index++;
+        steps--;
+    }
+
+    // If every old bucket has been moved, the resize is done
+    if (hashtable->rehash_index == hashtable->old_size)
+    {
+        free(hashtable->old_entries);
+        free(hashtable->old_slots);
+        hashtable->old_entries = NULL;
+        hashtable->old_slots = NULL;
+        hashtable->old_size = 0;
+        hashtable->rehash_index = 0;
+    }
+}
+
+/*  This is a helper function that finds an entry in an open addressing slot array.
+ *
+ *  Slots are probed one after another from the slot the hash points to. Thanks to
+ *  Robin Hood insertion, the search can stop as soon as it reaches a slot whose entry
+ *  is closer to its own home slot than the key being searched for would be.
+ *  The entity key string is only read when both the hash and the key length match,
+ *  and is then compared case-insensitively.
+ *
+ *  It takes 6 arguments:
+ *      1. The slot array.
+ *      2. The number of slots in the array (a power of two).
+ *      3. The entity key.
+ *      4. The full hash of the entity key, from key_hash().
+ *      5. The length of the entity key.
+ *      6. The words of the entity key if it is a list of words (see key_hash_words()), else NULL.
+ *
+ *  It returns the matching entry, or NULL if there is no entry with the key.
+ */
+node* open_ht_find(slot* slots, unsigned int size, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words)
+{
+    unsigned int mask = size - 1;
+    unsigned int i = full_hash & mask;
+    unsigned int distance = 0;
+
+    // While the slot is in use
+    while (slots[i].entry != NULL)
+    {
+
+        // Distance of the entry in this slot from its own home slot
+        unsigned int slot_distance = (i - (slots[i].hash & mask)) & mask;
+
+        // The key would have been placed here by now if it was in the table
+        if (slot_distance < distance)
+        {
+            return NULL;
+        }
+
+        // Check for key match, comparing hash and length before the key itself
+        if (slots[i].hash == full_hash && entity_key_equals(slots[i].entry->entity_key, slots[i].key_len, key, key_len, words))
+        {
+            return slots[i].entry;
+        }
+
+        // Else, try the next slot
+        i = (i + 1) & mask;
+        distance++;
     }
 
-    /* Reach end of linked list for the hashtable[bucket] 
-    if program execution reaches here. This means we want to insert a new entry. */
+    // Reached an empty slot, the key is not in the table
+    return NULL;
+}
+
+/*  This is a helper function that inserts a slot into an open addressing slot array
+ *  using Robin Hood hashing. The key must not already be in the array, and
+ *  the array must have at least one empty slot.
+ *
+ *  While probing, the new slot takes the place of any entry that is closer to its home
+ *  slot than the new slot is to its own, and that entry carries on probing instead.
+ *  This keeps every entry close to its home slot and probe lengths short and even.
+ *
+ *  It takes 3 arguments:
+ *      1. The slot array.
+ *      2. The number of slots in the array (a power of two).
+ *      3. The slot to insert (hash, key length and entry).
+ */
+void open_ht_insert(slot* slots, unsigned int size, slot new_slot)
+{
+    unsigned int mask = size - 1;
+    unsigned int i = new_slot.hash & mask;
+    unsigned int distance = 0;
 
-    // Insert new entry
-    // If trav is NULL, we are at the end of the linked list for the bucket slot
-    if (trav == NULL)
+    // While the slot is in use
+    while (slots[i].entry != NULL)
     {
 
-        // Create a new entry, helper function used to allocate memory
-        node* new_entry = create_entity_entry(key, value);
+        // Distance of the entry in this slot from its own home slot
+        unsigned int slot_distance = (i - (slots[i].hash & mask)) & mask;
 
-        // If NULL is returned, ran out of memory
-        if (new_entry == NULL)
+        // If the entry in this slot is better off than the one being inserted, swap them
+        if (slot_distance < distance)
         {
-            return false;
+            slot displaced = slots[i];
+            slots[i] = new_slot;
+            new_slot = displaced;
+            distance = slot_distance;
         }
 
-        // Insert entry
-        prev->next = new_entry;
+        // Try the next slot
+        i = (i + 1) & mask;
+        distance++;
     }
 
-    return true;
+    // Found an empty slot
+    slots[i] = new_slot;
 }
 
+
 /* Helper function used to allocate memory for an entry in the entity hashtable
+ * The entry, its key and its value are allocated together in one piece from the arena.
  * It takes as its arguments:
- *  1. key - entity string
- *  2. value - description string related to entity
+ *  1. arena - the arena of the entity hashtable
+ *  2. key - entity string
+ *  3. full_hash - hash of the entity string, from key_hash()
+ *  4. key_len - length of the entity string
+ *  5. value - description string related to entity
+ *  6. value_len - length of the description string
+ *  7. copy - whether to copy the key and value (if false, only the entry is allocated
+ *     and it points at the key and value given)
  */
-node* create_entity_entry(const char* key, char* value)
+node* create_entity_entry(arena* arena, const char* key, unsigned int full_hash, unsigned int key_len,
+    const char* value, unsigned int value_len, bool copy)
 {
-    // Create a new node
-    node* new_entry = malloc(sizeof(node));
+    size_t key_size = copy ? key_len + 1 : 0;
+    size_t value_size = copy ? value_len + 1 : 0;
+
+    // Create a new node, with room for the key and value right after it
+    node* new_entry = arena_alloc(arena, sizeof(node) + key_size + value_size);
 
     // Check for sufficient memory
     if (new_entry == NULL)
@@ -1105,238 +2067,1230 @@ node* create_entity_entry(const char* key, char* value)
         return NULL;
     }
 
-    // Create a new key
-    new_entry->entity_key = malloc(strlen(key) + 1);
+    if (copy)
+    {
+
+        // Copy the key and value data into the entry, null-terminated
+        char* key_copy = (char *) (new_entry + 1);
+        memcpy(key_copy, key, key_len);
+        key_copy[key_len] = '\0';
 
-    // If ran out of memory
-    if (new_entry->entity_key == NULL)
+        char* value_copy = key_copy + key_size;
+        memcpy(value_copy, value, value_len);
+        value_copy[value_len] = '\0';
+
+        new_entry->entity_key = key_copy;
+        new_entry->description_value = value_copy;
+    }
+    else
     {
-        
-        // Free the existing allocated memory for the entry node
-        free(new_entry);
-        printf("Ran out of memory.\nNo memory is allocated.\n");
-        return NULL;
+
+        // Point at the key and value where they are
+        new_entry->entity_key = key;
+        new_entry->description_value = value;
     }
 
-    // Create a new value
-    new_entry->description_value = malloc(strlen(value) + 1);
+    // Keep the hash and length of the key for lookups, and the length of the value
+    new_entry->hash = full_hash;
+    new_entry->key_len = key_len;
+    new_entry->value_len = value_len;
+
+    // Set new node next pointer to NULL
+    new_entry->next = NULL;
+
+    return new_entry;
+}
+
+/*  This is a helper function that allocates memory from an arena.
+ *
+ *  Memory is handed out from the current block by moving a pointer along,
+ *  and a new block is allocated from the system once it runs out. Memory
+ *  handed out by an arena cannot be freed on its own, only the whole arena
+ *  can be freed with arena_free().
+ *
+ *  It takes 2 arguments:
+ *      1. The arena.
+ *      2. The number of bytes needed.
+ *
+ *  It returns a pointer to the memory, or NULL if we ran out of memory.
+ */
+void* arena_alloc(arena* arena, size_t size)
+{
+
+    // Round the size up so that everything handed out stays suitably aligned
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+    arena_block* block = arena->blocks;
 
-    // If ran out of memory
-    if (new_entry->description_value == NULL)
+    // If the current block has room, hand out the next piece of it
+    if (block != NULL && block->size - block->used >= size)
     {
+        void* memory = (char *) block->data + block->used;
+        block->used += size;
+        return memory;
+    }
 
-        // Free the existing allocated memory for the entry key
-        free((char *) new_entry->entity_key);
+    // Else, allocate a new block (a bigger one for allocations that would not fit in a normal one)
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    arena_block* new_block = malloc(sizeof(arena_block) + block_size);
 
-        // Free the existing allocated memory for the entry node
-        free(new_entry);
-        printf("Ran out of memory.\nNo memory is allocated.\n");
+    // Check for sufficient memory
+    if (new_block == NULL)
+    {
         return NULL;
     }
 
-    // Copy the key and value data into the entry
-    strcpy((char *) new_entry->entity_key, key);
-    strcpy(new_entry->description_value, value);
+    new_block->size = block_size;
+    new_block->used = size;
 
-    // Set new node next pointer to NULL
-    new_entry->next = NULL;
+    /* The first block in the list is the one handed out from.
+    An oversized block is full straight away, so keep handing out from the current block. */
+    if (block != NULL && block_size > ARENA_BLOCK_SIZE)
+    {
+        new_block->next = block->next;
+        block->next = new_block;
+    }
+    else
+    {
+        new_block->next = block;
+        arena->blocks = new_block;
+    }
 
-    return new_entry;
+    return new_block->data;
+}
+
+/*  This is a helper function that copies a string into memory from an arena.
+ *  The copy is null-terminated, the string does not need to be.
+ *
+ *  It takes 3 arguments:
+ *      1. The arena.
+ *      2. The string to copy.
+ *      3. The length of the string.
+ *
+ *  It returns the copy, or NULL if we ran out of memory.
+ */
+char* arena_strndup(arena* arena, const char* string, size_t length)
+{
+    char* copy = arena_alloc(arena, length + 1);
+
+    if (copy != NULL)
+    {
+        memcpy(copy, string, length);
+        copy[length] = '\0';
+    }
+
+    return copy;
+}
+
+/*  This is a helper function that frees all the memory of an arena at once,
+ *  one block at a time.
+ *
+ *  It takes 1 arguments:
+ *      1. The arena.
+ */
+void arena_free(arena* arena)
+{
+    arena_release(arena, RECLAIM_ALL_BLOCKS);
+}
+
+/*  This is a helper function that frees some of the blocks of an arena.
+ *  It is used to give back the memory of a retired section a bit at a time.
+ *
+ *  It takes 2 arguments:
+ *      1. The arena.
+ *      2. The maximum number of blocks to free.
+ *
+ *  It returns the number of blocks freed. The arena is empty once this is
+ *  less than max_blocks.
+ */
+unsigned int arena_release(arena* arena, unsigned int max_blocks)
+{
+    unsigned int released = 0;
+
+    while (arena->blocks != NULL && released < max_blocks)
+    {
+        arena_block* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+        released++;
+    }
+
+    return released;
 }
 
 /*  This is a helper function that gets the entity hash table entry
  *  with the given entity description key value pair.
  *
- *  It takes 2 arguments:
+ *  It takes 3 arguments:
  *      1. The entity hashtable.
  *      2. The entity key.
+ *      3. Where to store the length of the entity description (may be NULL).
  *
- *  It returns a char* (a string) containing the entity description.
+ *  It returns a const char* containing the entity description. It is not
+ *  always null-terminated, use the length stored through the 3rd argument.
  * 
  *  If it is an entry that does not exist, NULL is returned.
  */
-char* entity_ht_get(ht* hashtable, const char* key)
+const char* entity_ht_get(ht* hashtable, const char* key, unsigned int* value_len)
 {
+    return entity_ht_get_len(hashtable, key, strlen(key), value_len);
+}
+
+/*  This is a helper function that gets the entity hash table entry
+ *  for an entity key of known length, which does not have to be null-terminated.
+ *
+ *  It takes 4 arguments:
+ *      1. The entity hashtable.
+ *      2. The entity key.
+ *      3. The length of the entity key.
+ *      4. Where to store the length of the entity description (may be NULL).
+ *
+ *  It returns the entity description as entity_ht_get() does.
+ */
+const char* entity_ht_get_len(ht* hashtable, const char* key, unsigned int key_len, unsigned int* value_len)
+{
+    return entity_ht_lookup(hashtable, key, key_len, key_hash_len(key, key_len), NULL, value_len);
+}
+
+/*  This is a helper function that gets the entity hash table entry for an
+ *  entity key given as a list of words, e.g. the words of a question, standing
+ *  for the words joined by single spaces. The words are hashed and compared
+ *  where they are, they are never joined into one string.
+ *
+ *  It takes 3 arguments:
+ *      1. The entity hashtable.
+ *      2. The words of the entity key, ending with a NULL pointer.
+ *      3. Where to store the length of the entity description (may be NULL).
+ *
+ *  It returns the entity description as entity_ht_get() does.
+ */
+const char* entity_ht_get_words(ht* hashtable, char* const* words, unsigned int* value_len)
+{
+    unsigned int key_len = 0;
+    unsigned int full_hash = key_hash_words(words, &key_len);
 
-    // Determine the bucket slot
-    unsigned int bucket = entity_hash(key);
+    return entity_ht_lookup(hashtable, NULL, key_len, full_hash, words, value_len);
+}
 
-    // Try to get an entry from the bucket
-    node* entry = hashtable->entries[bucket];
+/*  This is a helper function that does the work of entity_ht_get_len() and
+ *  entity_ht_get_words(), for a key whose hash has already been worked out.
+ *
+ *  If the table is in the middle of growing, a few more old buckets are moved
+ *  over to the new bucket array first.
+ *
+ *  If the table has been frozen, entries set since the freeze are looked at first,
+ *  then the frozen entries.
+ *
+ *  It takes 6 arguments:
+ *      1. The entity hashtable.
+ *      2. The entity key (unused if it is a list of words).
+ *      3. The length of the entity key.
+ *      4. The full hash of the entity key, from key_hash_len() or key_hash_words().
+ *      5. The words of the entity key if it is a list of words, else NULL.
+ *      6. Where to store the length of the entity description (may be NULL).
+ *
+ *  It returns the entity description as entity_ht_get() does.
+ */
+const char* entity_ht_lookup(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len)
+{
 
-    // There is no entry at the bucket slot, return NULL
-    if (entry == NULL)
-    {
-        return NULL;
-    }
+    // Do a bit of the pending resize work, if any
+    entity_ht_rehash_step(hashtable, ENTITY_REHASH_STEP);
 
-    // There is an entry, check key.
-    // Create a trav pointer to the head of the linked list at the bucket slot
-    node* trav = entry;
-    while (trav != NULL)
-    {
+    return entity_ht_peek(hashtable, key, key_len, full_hash, words, value_len);
+}
+
+/*  This is a helper function that looks an entity up as entity_ht_lookup() does,
+ *  without doing any of the pending resize work. It never changes the table, so
+ *  several threads can look in the same table at once, as long as no entry is set
+ *  in the meantime (see kb_set_concurrent() in knowledge.c).
+ *
+ *  It takes the same 6 arguments as entity_ht_lookup().
+ *
+ *  It returns the entity description as entity_ht_get() does.
+ */
+const char* entity_ht_peek(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len)
+{
+
+    // Look for the entry in the table
+    node* entry = entity_ht_find(hashtable, key, full_hash, key_len, words);
+
+    // If there is an entry with a matching key, return the entity description
+    if (entry != NULL)
+    {
+        if (value_len != NULL)
+        {
+            *value_len = entry->value_len;
+        }
+
+        return entry->description_value;
+    }
+
+    // Else, look for the entry in the frozen entries, if any
+    if (hashtable->frozen != NULL)
+    {
+        const frozen_entry* frozen_match = frozen_ht_find(hashtable->frozen, key, full_hash, key_len, words);
+
+        if (frozen_match != NULL)
+        {
+            if (value_len != NULL)
+            {
+                *value_len = frozen_match->value_len;
+            }
+
+            return hashtable->frozen->strings + frozen_match->value_offset;
+        }
+    }
+
+    // There is no entry with a matching key, return NULL
+    return NULL;
+}
+
+/*  This is a helper function to display the entity hashtable
+ *  for debugging purposes.
+ *
+ *  It takes 1 arguments:
+ *      1. The entity hashtable to be displayed.
+ */
+void display_entity_ht(ht* hashtable)
+{
+
+    // Open addressing tables are displayed slot by slot
+    if (hashtable->engine == ENTITY_HT_OPEN)
+    {
+        for (unsigned int i = 0; i < hashtable->size; i++)
+        {
+            if (hashtable->slots[i].entry != NULL)
+            {
+                node* entry = hashtable->slots[i].entry;
+                printf("\tslots[%u]: { %.*s=%.*s }\n", i, (int) entry->key_len, entry->entity_key,
+                    (int) entry->value_len, entry->description_value);
+            }
+        }
+
+        // If the table is growing, also display the entries not copied yet
+        for (unsigned int i = hashtable->rehash_index; i < hashtable->old_size; i++)
+        {
+            if (hashtable->old_slots[i].entry != NULL)
+            {
+                node* entry = hashtable->old_slots[i].entry;
+                printf("\told slots[%u]: { %.*s=%.*s }\n", i, (int) entry->key_len, entry->entity_key,
+                    (int) entry->value_len, entry->description_value);
+            }
+        }
+
+        display_frozen_ht(hashtable->frozen);
+        return;
+    }
+
+    // Iterate through the entity hashtable
+    for (unsigned int i = 0; i < hashtable->size; i++)
+    {
+        // If there is an entry in the entity hashtable
+        if (hashtable->entries[i] != NULL)
+        {
+            printf("\thashtable[%u]: ", i);
+            display_entity_bucket(hashtable->entries[i]);
+        }
+    }
+
+    // If the table is growing, also display the entries not moved yet
+    for (unsigned int i = hashtable->rehash_index; i < hashtable->old_size; i++)
+    {
+        if (hashtable->old_entries[i] != NULL)
+        {
+            printf("\told hashtable[%u]: ", i);
+            display_entity_bucket(hashtable->old_entries[i]);
+        }
+    }
+
+    display_frozen_ht(hashtable->frozen);
+}
+
+/*  This is a helper function to display the frozen entries of an entity
+ *  hashtable for debugging purposes, bucket by bucket.
+ *
+ *  It takes 1 arguments:
+ *      1. The frozen entries (nothing is displayed if NULL).
+ */
+void display_frozen_ht(frozen_ht* frozen)
+{
+    if (frozen == NULL)
+    {
+        return;
+    }
+
+    // Iterate through the buckets
+    for (uint32_t i = 0; i < frozen->bucket_count; i++)
+    {
+
+        // Print the entries of the bucket, they are next to each other in the entries array
+        for (uint32_t j = frozen->buckets[i]; j < frozen->buckets[i + 1]; j++)
+        {
+            printf("\tfrozen[%u]: { %s=%s }\n", i, frozen->strings + frozen->entries[j].key_offset,
+                frozen->strings + frozen->entries[j].value_offset);
+        }
+    }
+}
+
+/*  This is a helper function to display the linked list of entries
+ *  in one bucket of an entity hashtable for debugging purposes.
+ *
+ *  It takes 1 arguments:
+ *      1. The first entry in the bucket.
+ */
+void display_entity_bucket(node* entry)
+{
+
+    // Set a travesal pointer to the start of the linked list at bucket
+    node* trav = entry;
+
+    // While there is a linked entry in the bucket
+    while (trav != NULL)
+    {
+
+        // Print the contents
+        printf("{ %.*s=%.*s } -> ", (int) trav->key_len, trav->entity_key, (int) trav->value_len, trav->description_value);
+
+        // Set travesal to the next linked entry in bucket
+        trav = trav->next;
+    }
+
+    printf("NULL\n");
+}
+
+/*  This is a helper function to Unload entity hash table from memory
+ *
+ *  Every entry lives in the table's arena, so they are all freed together
+ *  a block at a time instead of one by one.
+ *
+ *  It takes 1 arguments:
+ *      1. The entity hashtable to unload.
+ */
+void unload_entity_ht(ht* hashtable)
+{
+
+    // Free every entry, entity key and description value
+    arena_free(&hashtable->arena);
+
+    // Free the bucket or slot arrays (free() ignores the ones not in use)
+    free(hashtable->entries);
+    free(hashtable->slots);
+    free(hashtable->old_entries);
+    free(hashtable->old_slots);
+
+    // Free the frozen entries, if any
+    frozen_ht_free(hashtable->frozen);
+
+    // Let go of the mapped files that entries pointed into
+    entity_ht_release_mappings(hashtable);
+
+    // Free the hashtable struct itself
+    free(hashtable);
+}
+
+/*  This is a helper function that starts a visit of every entry in an entity
+ *  hash table. Call entity_iter_next() to get the entries one at a time.
+ *
+ *  Each entry is returned once, even while the table is growing. The entry
+ *  returned may be freed before asking for the next one.
+ *
+ *  Frozen entries are returned last, skipping the ones set again since the freeze.
+ *  They are returned through the iterator itself, so a frozen entry is only
+ *  valid until the next call to entity_iter_next().
+ *
+ *  It takes 2 arguments:
+ *      1. The iterator to set up.
+ *      2. The entity hashtable to visit.
+ */
+void entity_iter_init(entity_iter* iter, ht* hashtable)
+{
+    iter->hashtable = hashtable;
+    iter->old = false;
+    iter->index = 0;
+    iter->next = NULL;
+    iter->frozen = false;
+    iter->frozen_index = 0;
+}
+
+/*  This is a helper function that gets the next entry of an entity hash table visit
+ *  started with entity_iter_init().
+ *
+ *  It takes 1 arguments:
+ *      1. The iterator.
+ *
+ *  It returns the next entry, or NULL when every entry has been visited.
+ */
+node* entity_iter_next(entity_iter* iter)
+{
+    ht* hashtable = iter->hashtable;
+
+    // Once every other entry has been visited, carry on with the frozen entries
+    if (iter->frozen)
+    {
+        return frozen_iter_next(iter);
+    }
+
+    while (true)
+    {
+
+        // Carry on down the linked list of the current chained bucket
+        if (iter->next != NULL)
+        {
+            node* entry = iter->next;
+            iter->next = entry->next;
+            return entry;
+        }
+
+        unsigned int size = iter->old ? hashtable->old_size : hashtable->size;
+
+        // Reached the end of the array
+        if (iter->index >= size)
+        {
+
+            /* If the table is growing, carry on with the old array.
+            Old buckets below rehash_index have already been moved (or copied) over. */
+            if (!iter->old && hashtable->old_size != 0)
+            {
+                iter->old = true;
+                iter->index = hashtable->rehash_index;
+                continue;
+            }
+
+            // Move on to the frozen entries
+            iter->frozen = true;
+            return frozen_iter_next(iter);
+        }
+
+        if (hashtable->engine == ENTITY_HT_OPEN)
+        {
+
+            // Return the entry in the next slot, if the slot is in use
+            slot* slots = iter->old ? hashtable->old_slots : hashtable->slots;
+            node* entry = slots[iter->index++].entry;
+
+            if (entry != NULL)
+            {
+                return entry;
+            }
+        }
+        else
+        {
+
+            // Start on the linked list of the next bucket
+            node** entries = iter->old ? hashtable->old_entries : hashtable->entries;
+            iter->next = entries[iter->index++];
+        }
+    }
+}
+
+/*  This is a helper function that gets the next frozen entry of an entity hash
+ *  table visit, once entity_iter_next() has been through every other entry.
+ *
+ *  Frozen entries that have been set again since the freeze are skipped,
+ *  since the newer entry has already been returned.
+ *
+ *  It takes 1 arguments:
+ *      1. The iterator.
+ *
+ *  It returns the iterator's frozen_node holding the next frozen entry,
+ *  or NULL when every frozen entry has been visited.
+ */
+node* frozen_iter_next(entity_iter* iter)
+{
+    ht* hashtable = iter->hashtable;
+    frozen_ht* frozen = hashtable->frozen;
+
+    // The table has no frozen entries
+    if (frozen == NULL)
+    {
+        return NULL;
+    }
+
+    while (iter->frozen_index < frozen->count)
+    {
+        const frozen_entry* entry = &frozen->entries[iter->frozen_index++];
+        const char* key = frozen->strings + entry->key_offset;
+
+        // Skip the entry if it has been set again since the freeze
+        if (hashtable->count != 0 && entity_ht_find(hashtable, key, entry->hash, entry->key_len, NULL) != NULL)
+        {
+            continue;
+        }
+
+        // Hand the entry out through the iterator's node
+        iter->frozen_node.entity_key = key;
+        iter->frozen_node.description_value = frozen->strings + entry->value_offset;
+        iter->frozen_node.hash = entry->hash;
+        iter->frozen_node.key_len = entry->key_len;
+        iter->frozen_node.value_len = entry->value_len;
+        iter->frozen_node.next = NULL;
+
+        return &iter->frozen_node;
+    }
+
+    return NULL;
+}
+
+/*  This function freezes an entity hash table: every entry is compacted into an
+ *  immutable, read-optimized copy (a frozen_ht), and the table itself is emptied.
+ *
+ *  The frozen copy is one contiguous block of memory. Entries are grouped by bucket
+ *  in one array, so a lookup reads one bucket position and then the entries next to it,
+ *  and keys and descriptions are packed into one block of strings found by 32-bit offsets
+ *  instead of pointers. Nothing is allocated per entry.
+ *
+ *  Entries set after the freeze go into the (now empty) table as usual, and take
+ *  priority over the frozen ones. Freezing the table again merges them in.
+ *
+ *  It takes 1 arguments:
+ *      1. The entity hashtable to freeze.
+ *
+ *  It returns true if the table is frozen, false if we ran out of memory
+ *  (the table is then left as it was).
+ */
+bool entity_ht_freeze(ht* hashtable)
+{
+
+    // Already frozen, with nothing set since
+    if (hashtable->frozen != NULL && hashtable->count == 0)
+    {
+        return true;
+    }
+
+    entity_iter iter;
+    node* entry;
+
+    // Count the entries, and the space for their strings (with null terminators)
+    size_t count = 0;
+    size_t strings_size = 0;
+
+    entity_iter_init(&iter, hashtable);
+    while ((entry = entity_iter_next(&iter)) != NULL)
+    {
+        count++;
+        strings_size += (size_t) entry->key_len + entry->value_len + 2;
+    }
+
+    // The strings must be small enough to be found by 32-bit offsets
+    if (strings_size > UINT32_MAX)
+    {
+        printf("Knowledge base is too big to freeze.\nNo action was taken.\n");
+        return false;
+    }
+
+    // One bucket per entry, rounded up to a power of two
+    uint32_t bucket_count = 1;
+    while (bucket_count < count)
+    {
+        bucket_count *= 2;
+    }
+
+    // Allocate the frozen table, its image, and a new (empty) bucket array for the table
+    void* image = malloc(frozen_ht_image_size(count, bucket_count, strings_size));
+    frozen_ht* frozen = image == NULL ? NULL : create_frozen_ht(image, count, bucket_count, strings_size);
+    void* empty_buckets = calloc(ENTITY_TABLE_SIZE, hashtable->engine == ENTITY_HT_OPEN ? sizeof(slot) : sizeof(node*));
+
+    // Check for sufficient memory
+    if (frozen == NULL || empty_buckets == NULL)
+    {
+        if (frozen != NULL)
+        {
+            frozen_ht_free(frozen);
+        }
+        else
+        {
+            free(image);
+        }
+
+        free(empty_buckets);
+        printf("Ran out of memory.\nNo memory is allocated.\n");
+        return false;
+    }
+
+    // Count the entries of each bucket, in buckets[b + 1]
+    memset(frozen->buckets, 0, (bucket_count + 1) * sizeof(uint32_t));
+
+    entity_iter_init(&iter, hashtable);
+    while ((entry = entity_iter_next(&iter)) != NULL)
+    {
+        frozen->buckets[(entry->hash & (bucket_count - 1)) + 1]++;
+    }
+
+    // Add the counts up, buckets[b] is now where bucket b starts
+    for (uint32_t i = 1; i <= bucket_count; i++)
+    {
+        frozen->buckets[i] += frozen->buckets[i - 1];
+    }
+
+    // Place every entry at the next free position of its bucket, and copy its strings
+    uint32_t string_offset = 0;
+
+    entity_iter_init(&iter, hashtable);
+    while ((entry = entity_iter_next(&iter)) != NULL)
+    {
+        frozen_entry* copy = &frozen->entries[frozen->buckets[entry->hash & (bucket_count - 1)]++];
+        copy->hash = entry->hash;
+        copy->key_len = entry->key_len;
+        copy->value_len = entry->value_len;
+
+        // Copy the key and value, null-terminated
+        copy->key_offset = string_offset;
+        memcpy(frozen->strings + string_offset, entry->entity_key, entry->key_len);
+        frozen->strings[string_offset + entry->key_len] = '\0';
+        string_offset += entry->key_len + 1;
+
+        copy->value_offset = string_offset;
+        memcpy(frozen->strings + string_offset, entry->description_value, entry->value_len);
+        frozen->strings[string_offset + entry->value_len] = '\0';
+        string_offset += entry->value_len + 1;
+    }
+
+    // buckets[b] now holds where bucket b ends (= where bucket b + 1 starts), shift them back by one
+    for (uint32_t i = bucket_count; i > 0; i--)
+    {
+        frozen->buckets[i] = frozen->buckets[i - 1];
+    }
+    frozen->buckets[0] = 0;
+
+    // Every entry is in the frozen table, empty the rest of the table
+    arena_free(&hashtable->arena);
+    free(hashtable->entries);
+    free(hashtable->slots);
+    free(hashtable->old_entries);
+    free(hashtable->old_slots);
+    frozen_ht_free(hashtable->frozen);
+
+    // The frozen table has its own copy of every string, mapped files are not needed any more
+    entity_ht_release_mappings(hashtable);
+
+    hashtable->entries = NULL;
+    hashtable->slots = NULL;
+
+    if (hashtable->engine == ENTITY_HT_OPEN)
+    {
+        hashtable->slots = empty_buckets;
+    }
+    else
+    {
+        hashtable->entries = empty_buckets;
+    }
+
+    hashtable->size = ENTITY_TABLE_SIZE;
+    hashtable->count = 0;
+    hashtable->old_entries = NULL;
+    hashtable->old_slots = NULL;
+    hashtable->old_size = 0;
+    hashtable->rehash_index = 0;
+    hashtable->frozen = frozen;
+
+    return true;
+}
+
+/*  This is a helper function that works out the size of the image of a frozen
+ *  entity hash table: its entries, then its bucket positions, then its strings.
+ *
+ *  It takes 3 arguments:
+ *      1. The number of entries.
+ *      2. The number of buckets (a power of two).
+ *      3. The size of the strings, null terminators included.
+ *
+ *  It returns the size of the image in bytes.
+ */
+size_t frozen_ht_image_size(uint32_t count, uint32_t bucket_count, uint32_t strings_size)
+{
+    return (size_t) count * sizeof(frozen_entry) + ((size_t) bucket_count + 1) * sizeof(uint32_t) + strings_size;
+}
+
+/*  Function creates a frozen entity hash table over an image laid out as
+ *  described by frozen_ht_image_size(). The image is not copied, the table just
+ *  points into it, and takes ownership of it (frozen_ht_free() frees it).
+ *
+ *  The image may hold entries already (e.g. read back from a file),
+ *  or may be filled in afterwards (e.g. by entity_ht_freeze()).
+ *
+ *  It takes 4 arguments:
+ *      1. The image, allocated with malloc().
+ *      2. The number of entries.
+ *      3. The number of buckets (a power of two).
+ *      4. The size of the strings, null terminators included.
+ *
+ *  It returns a pointer to the frozen table, or NULL if we ran out of memory
+ *  (the image is then left alone).
+ */
+frozen_ht* create_frozen_ht(void* image, uint32_t count, uint32_t bucket_count, uint32_t strings_size)
+{
+
+    // Allocate memory for the frozen table
+    frozen_ht* frozen = malloc(sizeof(frozen_ht));
+
+    // Check for sufficient memory
+    if (frozen == NULL)
+    {
+        return NULL;
+    }
+
+    // Point into the image: entries, then bucket positions, then strings
+    frozen->count = count;
+    frozen->bucket_count = bucket_count;
+    frozen->strings_size = strings_size;
+    frozen->image = image;
+    frozen->entries = (frozen_entry*) image;
+    frozen->buckets = (uint32_t*) (frozen->entries + count);
+    frozen->strings = (char*) (frozen->buckets + bucket_count + 1);
+    frozen->refs = 1;
+
+    return frozen;
+}
+
+/*  This is a helper function that gives a frozen entity hash table to an entity hash table.
+ *
+ *  If the table is empty and has never been frozen, the frozen table is simply attached
+ *  to it, as if the table had been frozen. Otherwise its entries are set in the table one
+ *  by one (replacing entries with the same key) and the frozen table is freed.
+ *
+ *  It takes 2 arguments:
+ *      1. The entity hashtable.
+ *      2. The frozen table, which the entity hashtable takes ownership of.
+ *
+ *  It returns the number of entries added, or -1 if we ran out of memory.
+ */
+int entity_ht_attach_frozen(ht* hashtable, frozen_ht* frozen)
+{
+    int pairs = frozen->count;
+
+    // Nothing to merge with, attach the frozen table as it is
+    if (hashtable->frozen == NULL && hashtable->count == 0)
+    {
+        hashtable->frozen = frozen;
+        hashtable->dirty = true;
+        return pairs;
+    }
+
+    // Else, set every frozen entry in the table
+    for (uint32_t i = 0; i < frozen->count; i++)
+    {
+        const frozen_entry* entry = &frozen->entries[i];
+
+        if (!entity_ht_insert(hashtable, frozen->strings + entry->key_offset, entry->key_len, entry->hash,
+            frozen->strings + entry->value_offset, entry->value_len, true))
+        {
+            pairs = -1;
+            break;
+        }
+    }
+
+    frozen_ht_free(frozen);
+    return pairs;
+}
+
+/*  This is a helper function that finds the entry with the given key in
+ *  a frozen entity hash table.
+ *
+ *  Only the entries of the key's bucket are looked at, and their strings
+ *  are only compared when the full hash matches.
+ *
+ *  It takes 5 arguments:
+ *      1. The frozen table.
+ *      2. The entity key.
+ *      3. The full hash of the key (from key_hash()).
+ *      4. The length of the key.
+ *      5. The words of the entity key if it is a list of words (see key_hash_words()), else NULL.
+ *
+ *  It returns the matching entry, or NULL if there is none.
+ */
+const frozen_entry* frozen_ht_find(const frozen_ht* frozen, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words)
+{
+    uint32_t bucket = full_hash & (frozen->bucket_count - 1);
+
+    // Look through the entries of the bucket, they are next to each other in the entries array
+    for (uint32_t i = frozen->buckets[bucket]; i < frozen->buckets[bucket + 1]; i++)
+    {
+        const frozen_entry* entry = &frozen->entries[i];
+
+        if (entry->hash == full_hash && entity_key_equals(frozen->strings + entry->key_offset, entry->key_len, key, key_len, words))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Takes another reference on a frozen entity hash table, it stays in memory until frozen_ht_free() is called once more
+frozen_ht* frozen_ht_hold(frozen_ht* frozen)
+{
+    frozen->refs++;
+    return frozen;
+}
+
+// Lets go of a frozen entity hash table, its memory is freed once nothing holds it (does nothing if NULL)
+void frozen_ht_free(frozen_ht* frozen)
+{
+    if (frozen == NULL || --frozen->refs > 0)
+    {
+        return;
+    }
+
+    free(frozen->image);
+    free(frozen);
+}
+
+#ifdef KB_HAVE_ATOMICS
+/*  This function creates a table for lookups without locks (see rcu_ht), over the
+ *  frozen entries of a section. The table holds a reference on them (see frozen_ht_hold()),
+ *  so they stay in memory even if the section is frozen again.
+ *
+ *  It has room for RCU_HT_MIN_ENTRIES entries set after it is created, or one
+ *  RCU_HT_FROZEN_FRACTION of the frozen entries if that is more.
+ *
+ *  It takes 1 arguments:
+ *      1. The frozen entries (may be NULL, for a section with none).
+ *
+ *  It returns the table, or NULL if we ran out of memory.
+ */
+rcu_ht* create_rcu_ht(frozen_ht* frozen)
+{
+    unsigned int max_count = RCU_HT_MIN_ENTRIES;
+
+    if (frozen != NULL && frozen->count / RCU_HT_FROZEN_FRACTION > max_count)
+    {
+        max_count = frozen->count / RCU_HT_FROZEN_FRACTION;
+    }
+
+    // One bucket per entry at most, the number of buckets is a power of two as for every entity hash table
+    unsigned int size = ENTITY_TABLE_SIZE;
+
+    while (size < max_count)
+    {
+        size *= 2;
+    }
+
+    rcu_ht* table = calloc(1, sizeof(rcu_ht));
+    _Atomic(node*)* entries = calloc(size, sizeof(_Atomic(node*)));
+
+    if (table == NULL || entries == NULL)
+    {
+        printf("Ran out of memory.\nNo memory is allocated.\n");
+        free(table);
+        free(entries);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+    {
+        atomic_init(&entries[i], NULL);
+    }
+
+    table->frozen = frozen != NULL ? frozen_ht_hold(frozen) : NULL;
+    table->entries = entries;
+    table->size = size;
+    table->max_count = max_count;
+
+    return table;
+}
+
+/*  This function sets an entry of a table for lookups without locks, while lookups
+ *  may be going on in it on other threads. Only one thread may set entries at a time.
+ *
+ *  The entry is filled in first and then published with a release store of the head
+ *  of its bucket, so a lookup that finds it also sees everything in it. An entry that
+ *  is already in the table for the key is left as it is: the new one goes in front
+ *  of it, so lookups find the new one first.
+ *
+ *  It takes 6 arguments:
+ *      1. The table.
+ *      2. The entity key.
+ *      3. The length of the key.
+ *      4. The full hash of the key (from key_hash_len()).
+ *      5. The entity description.
+ *      6. The length of the description.
+ *
+ *  It returns true if the entry was set, false if the table is full or we ran
+ *  out of memory (the table should then be replaced, see rcu_ht).
+ */
+bool rcu_ht_set(rcu_ht* table, const char* key, unsigned int key_len, unsigned int full_hash,
+    const char* value, unsigned int value_len)
+{
+
+    if (table->count >= table->max_count)
+    {
+        return false;
+    }
+
+    node* new_entry = create_entity_entry(&table->arena, key, full_hash, key_len, value, value_len, true);
+
+    if (new_entry == NULL)
+    {
+        return false;
+    }
+
+    // Only this thread changes the bucket, so its head is read without ordering
+    _Atomic(node*)* bucket = &table->entries[entity_hash(full_hash, table->size)];
+    new_entry->next = atomic_load_explicit(bucket, memory_order_relaxed);
+
+    atomic_store_explicit(bucket, new_entry, memory_order_release);
+    table->count++;
+
+    return true;
+}
+
+/*  This function looks an entity up in a table for lookups without locks. It takes
+ *  no lock and writes nothing, the head of the bucket is the only thing it loads
+ *  atomically (everything after it was written before it was published).
+ *
+ *  It takes the same 6 arguments as entity_ht_lookup(), with a table for lookups without locks.
+ *
+ *  It returns the entity description as entity_ht_get() does.
+ */
+const char* rcu_ht_lookup(const rcu_ht* table, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len)
+{
+
+    // Look for the entry in the entries set since the table was created, newest first
+    node* entry = atomic_load_explicit(&table->entries[entity_hash(full_hash, table->size)], memory_order_acquire);
+    entry = chained_ht_find(entry, key, full_hash, key_len, words);
+
+    if (entry != NULL)
+    {
+        if (value_len != NULL)
+        {
+            *value_len = entry->value_len;
+        }
+
+        return entry->description_value;
+    }
+
+    // Else, look for the entry in the frozen entries, if any
+    if (table->frozen != NULL)
+    {
+        const frozen_entry* frozen_match = frozen_ht_find(table->frozen, key, full_hash, key_len, words);
+
+        if (frozen_match != NULL)
+        {
+            if (value_len != NULL)
+            {
+                *value_len = frozen_match->value_len;
+            }
+
+            return table->frozen->strings + frozen_match->value_offset;
+        }
+    }
+
+    return NULL;
+}
+
+// Frees a table for lookups without locks, and lets go of its frozen entries (does nothing if NULL)
+void unload_rcu_ht(rcu_ht* table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+
+    frozen_ht_free(table->frozen);
+    arena_free(&table->arena);
+    free(table->entries);
+    free(table);
+}
+#endif
+
+/*  This function maps a file into memory, read only, so that its contents can be
+ *  used in place without reading or copying them.
+ *
+ *  The mapping starts with one reference, owned by the caller, and is unmapped when
+ *  every reference has been released with mapping_release().
+ *
+ *  It takes 1 arguments:
+ *      1. The name of the file.
+ *
+ *  It returns the mapping, or NULL if the file could not be mapped (it does not exist,
+ *  it is empty, or mapping files is not supported on this system).
+ */
+kb_mapping* mapping_open(const char* file_name)
+{
+#ifdef KB_HAVE_MMAP
+
+    // Open the file and find its size
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat file_stat;
+
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Map the whole file, the mapping stays valid once the file is closed
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // The file is read from start to end, let the system read ahead
+    posix_madvise(data, file_stat.st_size, POSIX_MADV_SEQUENTIAL);
+
+    // Allocate memory for the mapping
+    kb_mapping* mapping = malloc(sizeof(kb_mapping));
+
+    // Check for sufficient memory
+    if (mapping == NULL)
+    {
+        munmap(data, file_stat.st_size);
+        printf("Ran out of memory.\nNo memory is allocated.\n");
+        return NULL;
+    }
 
-        // If there is a key match, key compares case sensitively
-        if (strcmp(trav->entity_key, key) == 0)
-        {
+    mapping->data = data;
+    mapping->size = file_stat.st_size;
+    mapping->refs = 1;
 
-            // Return the entity description
-            return trav->description_value;
-        }
+    return mapping;
 
-        // Else, traverse to the next linked entry
-        trav = trav->next;
-    }
+#else
 
-    /* We reached the end of the list.
-    There is an entry, but no matching key. Return NULL. */
+    // Mapping files is not supported, the caller reads the file instead
     return NULL;
+
+#endif
 }
 
-/*  This is a helper function to display the entity hashtable
- *  for debugging purposes.
+/*  This function releases one reference on a mapped file,
+ *  and unmaps it when it was the last one.
  *
  *  It takes 1 arguments:
- *      1. The entity hashtable to be displayed.
+ *      1. The mapping.
  */
-void display_entity_ht(ht* hashtable)
+void mapping_release(kb_mapping* mapping)
 {
-
-    // Iterate through the entity hashtable
-    for (int i = 0; i < ENTITY_TABLE_SIZE; i++)
+    if (--mapping->refs > 0)
     {
-        // If there is an entry in the entity hashtable
-        if (hashtable->entries[i] != NULL)
-        {
-            printf("\thashtable[%i]: ", i);
-
-            // Set a travesal pointer to the start of the linked list at bucket
-            node* trav = hashtable->entries[i];
-
-            // While there is a linked entry in the bucket
-            while (trav != NULL)
-            {
-
-                // Print the contents
-                printf("{ %s=%s } -> ", trav->entity_key, trav->description_value);
+        return;
+    }
 
-                // Set travesal to the next linked entry in bucket
-                trav = trav->next;
-            }
+#ifdef KB_HAVE_MMAP
+    munmap((void*) mapping->data, mapping->size);
+#endif
 
-            printf("NULL\n");
-        }
-    }
+    free(mapping);
 }
 
-/*  This is a helper function to Unload entity hash table from memory
+/*  This is a helper function that makes an entity hash table hold a reference on a
+ *  mapped file, so that the file stays mapped while entries of the table point into it.
+ *  Holding the same mapping twice only keeps one reference.
  *
- *  It takes 1 arguments:
- *      1. The entity hashtable to unload.
+ *  It takes 2 arguments:
+ *      1. The entity hashtable.
+ *      2. The mapping.
+ *
+ *  It returns true if the reference is held, false if we ran out of memory.
  */
-void unload_entity_ht(ht* hashtable)
+bool entity_ht_hold_mapping(ht* hashtable, kb_mapping* mapping)
 {
 
-    // Iterate through the entity hashtable
-    for (int i = 0; i < ENTITY_TABLE_SIZE; i++)
+    // Check whether the table already holds the mapping
+    for (mapping_ref* ref = hashtable->mappings; ref != NULL; ref = ref->next)
     {
-
-        // Go through an active bucket and free the entire list
-        while (hashtable->entries[i] != NULL)
+        if (ref->mapping == mapping)
         {
+            return true;
+        }
+    }
 
-            // Set a travesal pointer to the next item of the bucket
-            node* trav = hashtable->entries[i]->next;
-
-            // Free the entity key
-            free((char *) hashtable->entries[i]->entity_key);
+    // Allocate memory for the reference
+    mapping_ref* new_ref = malloc(sizeof(mapping_ref));
 
-            // Free the description value
-            free((char *) hashtable->entries[i]->description_value);
+    // Check for sufficient memory
+    if (new_ref == NULL)
+    {
+        printf("Ran out of memory.\nNo memory is allocated.\n");
+        return false;
+    }
 
-            // Free the existing entry in the bucket
-            free(hashtable->entries[i]);
+    mapping->refs++;
+    new_ref->mapping = mapping;
+    new_ref->next = hashtable->mappings;
+    hashtable->mappings = new_ref;
 
-            // Set bucket pointer to trav
-            hashtable->entries[i] = trav;
-        }
-    }
+    return true;
+}
 
-    // Free the entries array in struct
-    free(hashtable->entries);
+/*  This is a helper function that releases every mapped file held by an entity hash table.
+ *  It must only be called once no entry of the table points into them any more.
+ *
+ *  It takes 1 arguments:
+ *      1. The entity hashtable.
+ */
+void entity_ht_release_mappings(ht* hashtable)
+{
+    while (hashtable->mappings != NULL)
+    {
+        mapping_ref* ref = hashtable->mappings;
+        hashtable->mappings = ref->next;
 
-    // Free the hashtable struct itself
-    free(hashtable);
+        mapping_release(ref->mapping);
+        free(ref);
+    }
 }
 
 /*  This function gets the entity hash table in the sections hash table
- *  with the given section key.
+ *  for the given section.
+ *
+ *  Sections are stored directly at the index of their intent_id,
+ *  so no hashing or key comparison is needed.
  *
  *  It takes 2 arguments:
  *      1. The sections hashtable.
- *      2. The section key.
+ *      2. The section (its intent_id, see section_index()).
  *
  *  It returns a ht* (an entity hash table) containing the entity description 
  *  key value pairs.
  * 
- *  If it is an entry that does not exist, NULL is returned.
+ *  If the section does not exist (or is not a valid section), NULL is returned.
  */
-ht* section_ht_get(section_node* sections[], const char* section_key)
+ht* section_ht_get(section_node* sections[], int section)
 {
 
-    // Determine bucket slot
-    unsigned int bucket = section_hash(section_key);
-
-    // Try to get an entry from the bucket
-    section_node* entry = sections[bucket];
-
-    // There is no entry, return null
-    if (entry == NULL)
+    // Check for a valid section that has been created
+    if (section < 0 || section >= SECTION_TABLE_SIZE || sections[section] == NULL)
     {
         return NULL;
     }
 
-    // There is an entry, check key
-    section_node* trav = entry;
-    while (trav != NULL)
-    {
-
-        // If there is a key match, compares case sensitively
-        if (strcmp(trav->section_key, section_key) == 0)
-        {
-
-            // Return the entity hash table
-            return trav->section_ht;
-        }
-
-        // Else, go to the next node
-        trav = trav->next;
-    }
-
-    /* We reached the end of the list.
-    There is an entry, but no matching key. Return NULL. */
-    return NULL;
+    // Return the entity hash table
+    return sections[section]->section_ht;
 }
 
-/*  This function sets the entity hash table with the given section key
- *  and the new entity hash table.
+/*  This function sets the entity hash table of the given section
+ *  to the new entity hash table.
  *
  *  It takes 3 arguments:
  *      1. The sections hashtable.
- *      2. The section key.
+ *      2. The section (its intent_id, see section_index()).
  *      3. The entity hash table as the value.
  *
  *  It returns true if it is set, false if is not.
  * 
- *  Note: This function assumes that the key and the hash table are already
+ *  Note: This function assumes that the hash table is already
  *  created OUTSIDE of this function.
  * 
  *  Example usage:
  * 
  *  Steps to create / set a new section in the sections hash table:
- *      1. Determine section key.
+ *      1. Determine section.
  * 
- *          const char* key1 = "what";
+ *          int section1 = section_index("what");
  * 
  *      2. Create a new hashtable.
  * 
@@ -1344,98 +3298,88 @@ ht* section_ht_get(section_node* sections[], const char* section_key)
  * 
  *      3. Set the entity hash table value in the sections hashtable
  *
- *          section_ht_set(sections, key1, new_hashtable1);
+ *          section_ht_set(sections, section1, new_hashtable1);
  */
-bool section_ht_set(section_node* sections[], const char* key, ht* hashtable)
+bool section_ht_set(section_node* sections[], int section, ht* hashtable)
 {
-    // Determine bucket slot
-    unsigned int bucket = section_hash(key);
 
-    // Try to get an section from the bucket
-    section_node* section = sections[bucket];
-
-    // There is no entry, create a new section and insert it into the sections hashtable
-    if (section == NULL)
+    // Check for a valid section
+    if (section < 0 || section >= SECTION_TABLE_SIZE)
     {
-
-        // create_section_entry() used to allocate memory for a section_node
-        section_node* new_section = create_section_entry(key, hashtable);
-
-        // If new_section is NULL, ran out of memory to allocate
-        if (new_section == NULL)
-        {
-            return false;
-        }
-
-        sections[bucket] = new_section;
-        return true;
+        return false;
     }
 
-    // There is an a section, check for conflicting section
-    section_node* trav = section;
-    section_node* prev = section;
-    while (trav != NULL)
+    // If the section already exists, we are replacing its entire entity hash table
+    if (sections[section] != NULL)
     {
 
-        // If there is a key match, we are replacing an entire section
-        if (strcmp(trav->section_key, key) == 0)
-        {
+        // Unload the entity hash table
+        unload_entity_ht(sections[section]->section_ht);
 
-            // Unload the entity hash table
-            unload_entity_ht(trav->section_ht);
+        // Set new entity hash table
+        sections[section]->section_ht = hashtable;
+        return true;
+    }
 
-            // Set new entity hash table
-            trav->section_ht = hashtable;
-            return true;
-        }
+    // Else, create_section_entry() used to allocate memory for a section_node
+    section_node* new_section = create_section_entry(section, hashtable);
 
-        // Else, go to the next node
-        prev = trav;
-        trav = trav->next;
+    // If new_section is NULL, ran out of memory to allocate
+    if (new_section == NULL)
+    {
+        return false;
     }
 
-    // Reached the end of the list for the bucket
-    if (trav == NULL)
-    {
-        // Create new section and insert it into the list at bucket
-        section_node* new_section = create_section_entry(key, hashtable);
+    sections[section] = new_section;
+    return true;
+}
 
-        // If new_section is NULL, ran out of memory to allocate
-        if (new_section == NULL)
-        {
-            return false;
-        }
+/*  This function finds the section for a section key (a question word such as "what").
+ *
+ *  The question words are looked up in the intent dispatch table of chatbot_main(),
+ *  which takes one hash of the key and a single comparison.
+ *
+ *  It takes 1 arguments:
+ *      1. The section key, compared case-insensitively.
+ *
+ *  It returns the section (intent_id), or -1 if the key is not a recognised question word.
+ */
+int section_index(const char* section_key)
+{
+    const intent_entry* intent = intent_lookup(section_key);
 
-        prev->next = new_section;
+    if (intent == NULL)
+    {
+        return -1;
     }
 
-    return true;
+    return intent->section;
 }
 
 /* Helper function used to allocate memory for an section in the section hashtable
  * It takes as its arguments:
- *  1. key - section key string
+ *  1. section - the section (intent_id), its question word becomes the section key
  *  2. hashtable - the new entity description hashtable
  */
-section_node* create_section_entry(const char* key, ht* hashtable)
+section_node* create_section_entry(int section, ht* hashtable)
 {
 
     // Allocate memory for the new section
-    section_node* section = malloc(sizeof(section_node));
+    section_node* section_entry = malloc(sizeof(section_node));
 
     // Check for sufficient memory.
-    if (section == NULL)
+    if (section_entry == NULL)
     {
         printf("Ran out of memory.\n No memory is allocated.\n");
         return NULL;
     }
 
     // Set section_node struct member fields
-    section->section_key = key;
-    section->section_ht = hashtable;
-    section->next = NULL;
+    section_entry->section_key = kb_intent_words[section];
+    section_entry->section_ht = hashtable;
+    section_entry->next = NULL;
 
-    return section;
+    return section_entry;
 }
 
 /*  This is a helper function to display the section hashtable
@@ -1498,9 +3442,6 @@ void unload_section_ht(section_node* section[])
             // Set trav pointer to the next section node
             trav = trav->next;
 
-            // Free the section key
-            free((char *) section[i]->section_key);
-
             // Free the entity hash table
             unload_entity_ht(section[i]->section_ht);
 
@@ -1513,29 +3454,347 @@ void unload_section_ht(section_node* section[])
     }
 }
 
+/*  This is a helper function that empties the sections hash table in constant time.
+ *
+ *  The sections are not freed here. They are moved onto the retired list of their knowledge base,
+ *  and their memory is given back later by reclaim_retired_sections(), a few arena
+ *  blocks on every chatbot turn. A reset therefore takes the same (short) time
+ *  no matter how big the knowledge base is.
+ *
+ *  It takes 2 arguments:
+ *      1. The section hashtable to empty.
+ *      2. The retired list of the knowledge base the sections belong to.
+ */
+void retire_section_ht(section_node* section[], section_node** retired)
+{
+
+    // Iterate through the sections hashtable
+    for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+    {
+
+        // If there is a section in the bucket
+        if (section[i] != NULL)
+        {
+
+            // Find the last section in the bucket's linked list
+            section_node* last = section[i];
+            while (last->next != NULL)
+            {
+                last = last->next;
+            }
+
+            // Move the whole list onto the front of the retired list
+            last->next = *retired;
+            *retired = section[i];
+            section[i] = NULL;
+        }
+    }
+}
+
+/*  This is a helper function that frees the memory of retired sections,
+ *  a limited number of arena blocks at a time.
+ *
+ *  It takes 2 arguments:
+ *      1. The retired list of a knowledge base (see retire_section_ht()).
+ *      2. The maximum number of arena blocks to free (RECLAIM_ALL_BLOCKS to free everything).
+ *
+ *  It returns true if every retired section has been freed, false if there is more left.
+ */
+bool reclaim_retired_sections(section_node** retired, unsigned int max_blocks)
+{
+
+    // While there is a retired section and we have not used up the budget
+    while (*retired != NULL)
+    {
+        section_node* section = *retired;
+
+        // Free some more of the section's entries
+        max_blocks -= arena_release(&section->section_ht->arena, max_blocks);
+
+        // If the section's arena is not empty yet, the budget is used up
+        if (section->section_ht->arena.blocks != NULL)
+        {
+            return false;
+        }
+
+        // The arena is empty, free the rest of the section
+        *retired = section->next;
+        unload_entity_ht(section->section_ht);
+        free(section);
+    }
+
+    return true;
+}
+
+/*  This function builds a minimal perfect hash over a set of keys, given their full hashes.
+ *  The hashes must all be different.
+ *
+ *  Keys are spread over count / 2 + 1 buckets by hash. Starting with the fullest bucket,
+ *  a displacement is searched for each bucket such that every key in it lands in a
+ *  slot that no other key uses yet. perfect_hash_index() then maps every key to its
+ *  own slot with one displacement lookup and no collisions.
+ *
+ *  It takes 3 arguments:
+ *      1. The perfect hash to build.
+ *      2. The full hashes of the keys, from key_hash().
+ *      3. The number of keys.
+ *
+ *  It returns true if the perfect hash was built, false if we ran out of memory
+ *  or two keys have the same hash. ph->count is 0 if the build failed.
+ */
+bool perfect_hash_build(perfect_hash* ph, const unsigned int* hashes, unsigned int count)
+{
+    ph->count = 0;
+    ph->buckets = count / 2 + 1;
+    ph->displacements = calloc(ph->buckets, sizeof(unsigned int));
+
+    // Scratch space: which slots are used, the bucket of each key, the keys sorted by bucket
+    bool* used = calloc(count + 1, sizeof(bool));
+    unsigned int* bucket_size = calloc(ph->buckets, sizeof(unsigned int));
+    unsigned int* order = malloc(sizeof(unsigned int) * (count + 1));
+    unsigned int* slots = malloc(sizeof(unsigned int) * (count + 1));
+
+    bool built = ph->displacements != NULL && used != NULL && bucket_size != NULL && order != NULL && slots != NULL;
+
+    // Count the keys in each bucket
+    for (unsigned int i = 0; built && i < count; i++)
+    {
+        bucket_size[hashes[i] % ph->buckets]++;
+    }
+
+    // Handle the buckets from the fullest to the emptiest, fuller buckets are harder to place
+    for (unsigned int size = count; built && size > 0; size--)
+    {
+        for (unsigned int b = 0; built && b < ph->buckets; b++)
+        {
+            if (bucket_size[b] != size)
+            {
+                continue;
+            }
+
+            // Collect the keys in this bucket
+            unsigned int keys = 0;
+            for (unsigned int i = 0; i < count; i++)
+            {
+                if (hashes[i] % ph->buckets == b)
+                {
+                    order[keys++] = i;
+                }
+            }
+
+            // Try displacements until every key in the bucket gets its own free slot
+            bool placed = false;
+            for (unsigned int displacement = 0; !placed && displacement < PERFECT_HASH_MAX_TRIES; displacement++)
+            {
+                placed = true;
+
+                for (unsigned int k = 0; placed && k < keys; k++)
+                {
+                    ph->displacements[b] = displacement;
+                    ph->count = count;
+                    slots[k] = perfect_hash_index(ph, hashes[order[k]]);
+                    ph->count = 0;
+
+                    // The slot must be free and not taken by another key of this bucket
+                    placed = !used[slots[k]];
+                    for (unsigned int other = 0; placed && other < k; other++)
+                    {
+                        placed = slots[other] != slots[k];
+                    }
+                }
+            }
+
+            // Two keys with the same hash can never be placed
+            if (!placed)
+            {
+                built = false;
+                break;
+            }
+
+            // Claim the slots of this bucket
+            for (unsigned int k = 0; k < keys; k++)
+            {
+                used[slots[k]] = true;
+            }
+        }
+    }
+
+    free(used);
+    free(bucket_size);
+    free(order);
+    free(slots);
+
+    if (!built)
+    {
+        perfect_hash_free(ph);
+        return false;
+    }
+
+    ph->count = count;
+    return true;
+}
+
+/*  This function finds the slot of a key in a perfect hash built by perfect_hash_build().
+ *
+ *  Only keys that the perfect hash was built with are guaranteed their own slot.
+ *  Any other key also maps to some slot, so the caller must check that the key in
+ *  that slot really is the one it is looking for.
+ *
+ *  It takes 2 arguments:
+ *      1. The perfect hash.
+ *      2. The full hash of the key, from key_hash().
+ *
+ *  It returns the slot, from 0 to ph->count - 1.
+ */
+unsigned int perfect_hash_index(const perfect_hash* ph, unsigned int full_hash)
+{
+
+    // Mix the key's hash with the displacement of its bucket
+    unsigned int hash = full_hash ^ (ph->displacements[full_hash % ph->buckets] * 0x9e3779b9);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash % ph->count;
+}
+
+// Frees the memory used by a perfect hash
+void perfect_hash_free(perfect_hash* ph)
+{
+    free(ph->displacements);
+    ph->displacements = NULL;
+    ph->count = 0;
+}
+
 // Hashes a word to a number
 unsigned int hash(const char* word, unsigned int max_table_size)
+{
+    return key_hash(word) % max_table_size;
+}
+
+// Hashes a word to a full 32-bit number, case-insensitively
+unsigned int key_hash(const char* word)
+{
+    return key_hash_len(word, strlen(word));
+}
+
+// Hashes a word of known length (not necessarily null-terminated), the same way as key_hash()
+unsigned int key_hash_len(const char* word, unsigned int word_len)
 {
     // credits goes to djb2 hash function from http://www.cse.yorku.ca/~oz/hash.html
-    unsigned long hash = 5381;
-    int c;
+    unsigned int hash = 5381;
+
+    for (unsigned int i = 0; i < word_len; i++)
+    {
+        hash = ((hash << 5) + hash) + tolower((unsigned char) word[i]); // hash * 33 + c //
+    }
+
+    return key_hash_mix(hash);
+}
+
+/* Hashes a list of words (ending with a NULL pointer) the same way as key_hash() hashes
+the words joined by single spaces, without joining them. Also gives the length they would have. */
+unsigned int key_hash_words(char* const* words, unsigned int* key_len)
+{
+    unsigned int hash = 5381;
+    unsigned int len = 0;
 
-    while ((c = *word++))
+    for (unsigned int w = 0; words[w] != NULL; w++)
     {
-        hash = ((hash << 5) + hash) + tolower(c); // hash * 33 + c //
+
+        // The space between two words
+        if (w > 0)
+        {
+            hash = ((hash << 5) + hash) + ' ';
+            len++;
+        }
+
+        for (const char* c = words[w]; *c != '\0'; c++)
+        {
+            hash = ((hash << 5) + hash) + tolower((unsigned char) *c);
+            len++;
+        }
     }
 
-    return hash %  max_table_size;
+    *key_len = len;
+    return key_hash_mix(hash);
+}
+
+/* Mixes the bits of a djb2 hash so that the low bits (used to pick a bucket) depend on every character.
+Keys that only differ in their last character otherwise land in neighbouring buckets. */
+unsigned int key_hash_mix(unsigned int hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+// Picks the bucket for a full hash within the current size of the entity hash table
+unsigned int entity_hash(unsigned int full_hash, unsigned int table_size)
+{
+    return full_hash & (table_size - 1);
 }
 
-// Hashes entity string to a number
-unsigned int entity_hash(const char* word)
+// Compares two keys of known length case-insensitively
+bool key_equals(const char* key1, unsigned int key1_len, const char* key2, unsigned int key2_len)
 {
-    return hash(word, ENTITY_TABLE_SIZE);
+    // Keys of different lengths can never match
+    if (key1_len != key2_len)
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < key1_len; i++)
+    {
+        if (tolower((unsigned char) key1[i]) != tolower((unsigned char) key2[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
 }
 
-// Hashes section string to a number
-unsigned int section_hash(const char* word)
+/* Compares a key stored in a table with an entity key being looked up, case-insensitively.
+The entity key is either key_len characters at key, or if words is not NULL, the words
+(ending with a NULL pointer) joined by single spaces, key_len characters long in all. */
+bool entity_key_equals(const char* stored, unsigned int stored_len, const char* key, unsigned int key_len, char* const* words)
 {
-    return hash(word, SECTION_TABLE_SIZE);
+    if (words == NULL)
+    {
+        return key_equals(stored, stored_len, key, key_len);
+    }
+
+    // Keys of different lengths can never match
+    if (stored_len != key_len)
+    {
+        return false;
+    }
+
+    // Walk through the stored key and the words side by side, with a space between words
+    unsigned int i = 0;
+
+    for (unsigned int w = 0; words[w] != NULL; w++)
+    {
+        if (w > 0 && stored[i++] != ' ')
+        {
+            return false;
+        }
+
+        for (const char* c = words[w]; *c != '\0'; c++, i++)
+        {
+            if (tolower((unsigned char) stored[i]) != tolower((unsigned char) *c))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
 }
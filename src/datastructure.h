@@ -1,65 +1,398 @@
 #ifndef _DATASTRUCTURE_H
 #define _DATASTRUCTURE_H
 
-// Maximum hash table size for sections hash table
+#include <stddef.h>
+#include <stdint.h>
+#include "chat1002.h"
+
+// Tables for lookups without locks (rcu_ht) use C11 atomics, where the compiler has them
+#ifndef __STDC_NO_ATOMICS__
+#include <stdatomic.h>
+#define KB_HAVE_ATOMICS 1
+#endif
+
+// Size of sections hash table
+// There is one slot per intent in KB_INTENTS, and a section is found directly by its intent_id
+#define SECTION_TABLE_SIZE KB_INTENT_COUNT
+
+// Initial hash table size for entity hash table
+// Value can be easily changed depending on user needs, but must be a power of two
+// since the table doubles in size every time it grows
+#define ENTITY_TABLE_SIZE 256
+
+// Maximum load factor (average number of entries per bucket) for entity hash table
+// Once the number of entries exceeds size * ENTITY_TABLE_MAX_LOAD, the table doubles in size
+#define ENTITY_TABLE_MAX_LOAD 1
+
+// Maximum load factor for open addressing entity hash tables, as a percentage of slots in use
+// Once more than ENTITY_OPEN_MAX_LOAD_PERCENT of the slots are used, the table doubles in size
+#define ENTITY_OPEN_MAX_LOAD_PERCENT 75
+
+// Number of old buckets moved over on every get / set while an entity hash table is growing
+// Growing is spread out over many operations so that no single operation pays for the whole resize
+#define ENTITY_REHASH_STEP 4
+
+// Entity hash table engines
+// ENTITY_HT_CHAINED: separate chaining, every bucket is a linked list of entries
+// ENTITY_HT_OPEN: open addressing (Robin Hood hashing), entries sit in one flat array of slots
+#define ENTITY_HT_CHAINED 0
+#define ENTITY_HT_OPEN    1
+
+// Engine used for the entity hash tables of the knowledge base
 // Value can be easily changed depending on user needs
-#define SECTION_TABLE_SIZE 4
+#define ENTITY_HT_ENGINE ENTITY_HT_OPEN
+
+// Smallest number of entries that a table for lookups without locks (rcu_ht) takes before it is
+// replaced by a new one, and the fraction of its frozen entries that it takes if that is more
+// Once it is full, the section is frozen again and a new, empty one is published in its place
+#define RCU_HT_MIN_ENTRIES 1024
+#define RCU_HT_FROZEN_FRACTION 8
 
-// Maximum hash table size for entity hash table
+// Maximum number of arena blocks of reset (retired) sections freed on every chatbot turn
+// Reset only retires the sections, their memory is given back a bit at a time afterwards
+#define RECLAIM_BLOCKS_PER_TURN 64
+
+// Block budget meaning "free everything", for arena_release() and reclaim_retired_sections()
+#define RECLAIM_ALL_BLOCKS ((unsigned int) -1)
+
+// Size of each block of memory that an arena allocates from the system
 // Value can be easily changed depending on user needs
-#define ENTITY_TABLE_SIZE 256
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+// Represents a block of memory owned by an arena
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} arena_block;
+
+// Represents an arena, which hands out memory from big blocks and frees it all at once
+// Every entry and string of an entity hash table lives in the table's arena
+typedef struct arena {
+    arena_block* blocks;
+} arena;
 
 // Represents a node in an entity hash table
+// The full (case-insensitive) hash and length of the key are worked out once when the
+// entry is inserted, so lookups and resizes never need to hash the key string again
+// The key and value are not always null-terminated (they may point into a mapped file),
+// always use key_len and value_len with them
 typedef struct node {
     const char* entity_key;
-    char* description_value;
+    const char* description_value;
+    unsigned int hash;
+    unsigned int key_len;
+    unsigned int value_len;
     struct node* next;
 } node;
 
+// Represents a file mapped into memory (read only) by mapping_open()
+// Entries loaded from the file point straight into it. Every entity hash table with such
+// entries holds a reference, the file is unmapped when the last reference is released.
+typedef struct kb_mapping {
+    const char* data;
+    size_t size;
+    unsigned int refs;
+} kb_mapping;
+
+// Represents one reference held by an entity hash table on a mapped file
+typedef struct mapping_ref {
+    kb_mapping* mapping;
+    struct mapping_ref* next;
+} mapping_ref;
+
+// Represents a slot in an open addressing entity hash table
+// The full hash and key length are kept in the slot itself so that most
+// non-matching slots can be skipped without reading the entity key string
+typedef struct slot {
+    unsigned int hash;
+    unsigned int key_len;
+    node* entry;
+} slot;
+
+// Represents an entry of a frozen entity hash table
+// Keys and descriptions are not pointed to, they are found at 32-bit offsets into the table's strings
+typedef struct frozen_entry {
+    uint32_t hash;
+    uint32_t key_len;
+    uint32_t key_offset;
+    uint32_t value_offset;
+    uint32_t value_len;
+} frozen_entry;
+
+// Represents a frozen entity hash table: an immutable, read-only copy of the entries of a table
+// made by entity_ht_freeze(). Everything lives in one contiguous block of memory (image):
+//  - entries, grouped by bucket (hash & (bucket_count - 1))
+//  - buckets, bucket_count + 1 positions in entries: bucket b holds entries buckets[b] .. buckets[b + 1] - 1
+//  - strings, every entity key and description value packed together, each with its null terminator
+typedef struct frozen_ht {
+    uint32_t count;
+    uint32_t bucket_count;
+    uint32_t strings_size;
+    frozen_entry* entries;
+    uint32_t* buckets;
+    char* strings;
+    void* image;
+
+    // Number of owners: the table it belongs to, plus any background save writing it out (see frozen_ht_hold())
+    // or table for lookups without locks. It is only freed when the last one lets go of it with frozen_ht_free()
+#ifdef KB_HAVE_ATOMICS
+    atomic_uint refs;
+#else
+    unsigned int refs;
+#endif
+} frozen_ht;
+
 // Represents a hashtable that has an array of entries
+// Chained tables use entries (array of linked lists), open addressing tables use slots
 typedef struct ht
 {
+    int engine;
     node** entries;
+    slot* slots;
+    unsigned int size;
+    unsigned int count;
+
+    // While the table is growing, entries that have not been moved yet stay in the old bucket array
+    // Old buckets below rehash_index have already been moved. old_size is 0 when not growing.
+    node** old_entries;
+    slot* old_slots;
+    unsigned int old_size;
+    unsigned int rehash_index;
+
+    // Owns the memory of every entry, entity key and description value in the table
+    arena arena;
+
+    // Entries frozen by entity_ht_freeze(), NULL if the table was never frozen
+    // The rest of the table is then a small overlay of entries set after the freeze, which take priority
+    frozen_ht* frozen;
+
+    // Mapped files that entries of the table point into, NULL if none
+    mapping_ref* mappings;
+
+    // Set whenever an entry is set, cleared when knowledge_save() takes the snapshot of the table it writes to a file
+    // Sections that are not dirty are copied from the last file saved instead of being written again
+    bool dirty;
 } ht;
 
+// Represents an entity hash table that lookups read without taking any lock (see kb_set_concurrent())
+// It is the frozen table of a section, plus the entries set since in buckets of linked lists.
+// An entry is never changed or removed once it is in a bucket: it is published by a release store
+// of the bucket's head, and setting the same key again puts a newer entry in front of it.
+// Only one thread sets entries at a time. Once max_count entries are set the table is full,
+// and is replaced as a whole by a new one (the old one is freed after a grace period).
+#ifdef KB_HAVE_ATOMICS
+typedef struct rcu_ht {
+    frozen_ht* frozen;
+    _Atomic(node*)* entries;
+    unsigned int size;
+    unsigned int count;
+    unsigned int max_count;
+
+    // Owns the memory of every entry, entity key and description value set in the table
+    arena arena;
+} rcu_ht;
+#endif
+
+// Used to visit every entry of an entity hash table, whatever its engine
+// Frozen entries are visited last, through frozen_node, which holds the current one
+typedef struct entity_iter {
+    ht* hashtable;
+    bool old;
+    unsigned int index;
+    node* next;
+    bool frozen;
+    uint32_t frozen_index;
+    node frozen_node;
+} entity_iter;
+
+// Maximum number of displacements tried per bucket when building a perfect hash
+#define PERFECT_HASH_MAX_TRIES 1000000
+
+// Represents a minimal perfect hash over a fixed set of keys
+// Every key maps to its own slot in 0 .. count - 1, with no collisions to resolve.
+// Keys are spread over buckets by hash, and each bucket has a displacement that
+// was searched for when the perfect hash was built so that its keys land in free slots.
+typedef struct perfect_hash {
+    unsigned int count;
+    unsigned int buckets;
+    unsigned int* displacements;
+} perfect_hash;
+
 // Represents a node in a section hash table
+// next is only used to link sections on the retired_sections list
 typedef struct section_node {
     const char* section_key;
     ht* section_ht;
     struct section_node* next;
 } section_node;
 
-// sections[] is initialized in chatbot.c
-/* extern is used here so that other c source files in project gets access 
-to this variable if this header file is included in that c source file. */
-extern section_node* sections[SECTION_TABLE_SIZE];
+// Where a section was written in the last .ini file saved by kb_save()
+// The checksum is the CRC-32 of the section's bytes, checked when they are copied to the next file
+typedef struct kb_saved_section {
+    bool saved;
+    long offset;
+    long size;
+    uint32_t checksum;
+} kb_saved_section;
+
+// Represents a knowledge base (see kb_create() in knowledge.c): its sections, and what is kept
+// about the files it is loaded from and saved to. The kb_*() functions only use the knowledge base
+// they are given, so knowledge bases can be used from different threads at the same time.
+// The knowledge_*() functions all use the default one (see knowledge_default()).
+struct knowledge_base {
+
+    // The entity hash table of each question word, by its intent_id
+    section_node* sections[SECTION_TABLE_SIZE];
+
+    // Linked list of sections removed from sections[] by a reset, waiting to be freed
+    section_node* retired_sections;
+
+    // The journal that learned answers are written to, NULL if there is none (see kb_journal_open())
+    FILE* journal;
+
+    // The names of the journal and of the knowledge base file it belongs to (written into by kb_journal_checkpoint())
+    char* journal_name;
+    char* journal_base_name;
+
+    // The number of records in the journal and its size in bytes, to know when to checkpoint it
+    unsigned long journal_records;
+    long journal_size;
+
+    // Records of learned answers waiting for kb_journal_commit()
+    char* journal_pending;
+    size_t journal_pending_size;
+    size_t journal_pending_capacity;
+    unsigned long journal_pending_records;
+
+    // The last .ini file saved by kb_save(), where each section is in it, and its size
+    char* saved_file_name;
+    kb_saved_section saved_sections[SECTION_TABLE_SIZE];
+    long saved_file_size;
+
+    // The questions it could not answer, kept instead of asking for the answers, NULL if not kept (see kb_pending_open())
+    struct kb_pending_queue* pending_questions;
+
+    // The save being written in the background, and the last one to finish until kb_save_poll() reports it
+    struct kb_save_job* background_save;
+    struct kb_save_job* finished_save;
+
+    // The locks used in concurrent mode, NULL if the knowledge base is not in it (see kb_set_concurrent())
+    struct kb_locks* locks;
+
+    // The tables that lookups read without locks, NULL unless in KB_CONCURRENT_RCU mode
+    struct kb_rcu* rcu;
+};
 
 /* Data structure implementation and functions defined in chatbot.c */
 ht* create_entity_ht(void);
-char* section_entity_ht_get(section_node* sections[], const char* section_key, const char* entity_key);
-bool section_entity_ht_set(section_node* sections[], const char* section_key, const char* entity_key, char* value);
-ht* section_ht_get(section_node* sections[], const char* section_key);
-bool section_ht_set(section_node* sections[], const char* key, ht* hashtable);
+ht* create_entity_ht_engine(int engine);
+const char* section_entity_ht_get(section_node* sections[], int section, const char* entity_key, unsigned int* value_len);
+bool section_entity_ht_set(section_node* sections[], int section, const char* entity_key, char* value);
+ht* section_ht_get(section_node* sections[], int section);
+bool section_ht_set(section_node* sections[], int section, ht* hashtable);
+int section_index(const char* section_key);
 void display_section_ht(section_node* section[]);
 void unload_section_ht(section_node* section[]);
+void retire_section_ht(section_node* section[], section_node** retired);
+bool reclaim_retired_sections(section_node** retired, unsigned int max_blocks);
 
 /* Data structure hash functions */
 unsigned int hash(const char* word, unsigned int max_table_size);
-unsigned int entity_hash(const char* word);
-unsigned int section_hash(const char* word);
+unsigned int key_hash(const char* word);
+unsigned int key_hash_len(const char* word, unsigned int word_len);
+unsigned int key_hash_words(char* const* words, unsigned int* key_len);
+unsigned int key_hash_mix(unsigned int hash);
+unsigned int entity_hash(unsigned int full_hash, unsigned int table_size);
+bool key_equals(const char* key1, unsigned int key1_len, const char* key2, unsigned int key2_len);
+bool entity_key_equals(const char* stored, unsigned int stored_len, const char* key, unsigned int key_len, char* const* words);
 
 /* 
 The following contain functions NOT meant to be used directly.
 */
 
 /* Entity Hashtable Helper functions defined in chatbot.c */
-char* entity_ht_get(ht* hashtable, const char* key);
+const char* entity_ht_get(ht* hashtable, const char* key, unsigned int* value_len);
+const char* entity_ht_get_len(ht* hashtable, const char* key, unsigned int key_len, unsigned int* value_len);
+const char* entity_ht_get_words(ht* hashtable, char* const* words, unsigned int* value_len);
+const char* entity_ht_lookup(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len);
+const char* entity_ht_peek(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len);
 bool entity_ht_set(ht* hashtable, const char* key, char* value);
-node* create_entity_entry(const char* key, char* value);
+bool entity_ht_set_view(ht* hashtable, const char* key, unsigned int key_len, const char* value, unsigned int value_len);
+bool entity_ht_insert(ht* hashtable, const char* key, unsigned int key_len, unsigned int full_hash,
+    const char* value, unsigned int value_len, bool copy);
+node* create_entity_entry(arena* arena, const char* key, unsigned int full_hash, unsigned int key_len,
+    const char* value, unsigned int value_len, bool copy);
+node* entity_ht_find(ht* hashtable, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words);
+node* chained_ht_find(node* entry, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words);
+bool entity_ht_resize(ht* hashtable, unsigned int new_size);
+void entity_ht_rehash_step(ht* hashtable, unsigned int steps);
 void display_entity_ht(ht* hashtable);
+void display_entity_bucket(node* entry);
 void unload_entity_ht(ht* hashtable);
+void entity_iter_init(entity_iter* iter, ht* hashtable);
+node* entity_iter_next(entity_iter* iter);
+
+/* Frozen Entity Hashtable Helper functions defined in chatbot.c */
+bool entity_ht_freeze(ht* hashtable);
+int entity_ht_attach_frozen(ht* hashtable, frozen_ht* frozen);
+frozen_ht* create_frozen_ht(void* image, uint32_t count, uint32_t bucket_count, uint32_t strings_size);
+size_t frozen_ht_image_size(uint32_t count, uint32_t bucket_count, uint32_t strings_size);
+const frozen_entry* frozen_ht_find(const frozen_ht* frozen, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words);
+node* frozen_iter_next(entity_iter* iter);
+frozen_ht* frozen_ht_hold(frozen_ht* frozen);
+void frozen_ht_free(frozen_ht* frozen);
+void display_frozen_ht(frozen_ht* frozen);
+
+/* Lock-free lookup Entity Hashtable Helper functions defined in chatbot.c */
+#ifdef KB_HAVE_ATOMICS
+rcu_ht* create_rcu_ht(frozen_ht* frozen);
+bool rcu_ht_set(rcu_ht* table, const char* key, unsigned int key_len, unsigned int full_hash,
+    const char* value, unsigned int value_len);
+const char* rcu_ht_lookup(const rcu_ht* table, const char* key, unsigned int key_len, unsigned int full_hash,
+    char* const* words, unsigned int* value_len);
+void unload_rcu_ht(rcu_ht* table);
+#endif
+
+/* Arena Helper functions defined in chatbot.c */
+void* arena_alloc(arena* arena, size_t size);
+char* arena_strndup(arena* arena, const char* string, size_t length);
+void arena_free(arena* arena);
+unsigned int arena_release(arena* arena, unsigned int max_blocks);
+
+/* Mapped file functions defined in chatbot.c */
+kb_mapping* mapping_open(const char* file_name);
+void mapping_release(kb_mapping* mapping);
+bool entity_ht_hold_mapping(ht* hashtable, kb_mapping* mapping);
+void entity_ht_release_mappings(ht* hashtable);
+
+/* Perfect hash functions defined in chatbot.c */
+bool perfect_hash_build(perfect_hash* ph, const unsigned int* hashes, unsigned int count);
+unsigned int perfect_hash_index(const perfect_hash* ph, unsigned int full_hash);
+void perfect_hash_free(perfect_hash* ph);
+
+/* Open addressing Entity Hashtable Helper functions defined in chatbot.c */
+node* open_ht_find(slot* slots, unsigned int size, const char* key, unsigned int full_hash, unsigned int key_len, char* const* words);
+void open_ht_insert(slot* slots, unsigned int size, slot new_slot);
+
+// Line scanning engines, see scan_line_using()
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+
+/* Line scanning functions defined in scanner.c */
+const char* scan_line(const char* data, const char* end, const char** equals);
+const char* scan_line_using(int engine, const char* data, const char* end, const char** equals);
+int scan_best_engine(void);
+const char* scan_engine_name(int engine);
 
 /* Section Hashtable Helper functions defined in chatbot.c */
-section_node* create_section_entry(const char* key, ht* hashtable);
+section_node* create_section_entry(int section, ht* hashtable);
+
+/* Knowledge base writing functions defined in knowledge.c */
+int knowledge_write_frozen(FILE* f, frozen_ht* const* tables, unsigned int threads);
 
 #endif
@@ -3,397 +3,5098 @@
  *
  * This file implements the chatbot's knowledge base.
  *
+ * A knowledge base is created by kb_create() and freed by kb_destroy(). Every kb_*() function works
+ * on the knowledge base it is given as its first argument, the knowledge_*() function of the same
+ * name does the same on the default knowledge base that the chatbot uses (knowledge_default()).
+ *
  * knowledge_get() retrieves the response to a question.
+ * knowledge_get_view() does the same without copying it.
+ * knowledge_get_words() does the same for an entity given as a list of words.
  * knowledge_put() inserts a new response to a question.
  * knowledge_read() reads the knowledge base from a file.
+ * knowledge_read_mapped() reads the knowledge base from a file mapped into memory, without copying it.
+ * knowledge_read_parallel() does the same using several threads.
  * knowledge_reset() erases all of the knowledge.
+ * knowledge_freeze() compacts the knowledge base for fast, read-only lookups.
+ * kb_set_concurrent() lets several threads look in and add to a knowledge base at the same time,
+ * with lookups sharing a lock on each section or taking no lock at all (kb_rcu_register() and the like).
  * knowledge_write() saves the knowledge base in a file.
+ * knowledge_write_frozen() does the same from the frozen tables of the sections, formatting them on several threads.
+ * knowledge_save() does the same, writing again only the sections that changed since the last save.
+ * knowledge_save_background() does the same on a thread of its own, knowledge_save_poll() reports how it went.
+ * knowledge_read_binary() and knowledge_write_binary() do the same with a binary snapshot file.
+ * knowledge_journal_open(), knowledge_journal_commit() and knowledge_journal_close() keep a journal of learned answers.
+ * knowledge_journal_checkpoint() writes them into the file the journal belongs to.
+ * knowledge_pending_open() keeps the questions it cannot answer in a file instead of asking for them,
+ * knowledge_pending_answer() learns their answers from a file all at once.
+ * knowledge_unload() frees all of the knowledge (kb_destroy() also frees the knowledge base itself).
  *
  * You may add helper functions as necessary.
  */
 
+// Loading with several threads (knowledge_read_parallel()) uses POSIX threads, where they are available
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define KB_HAVE_THREADS 1
+#define KB_HAVE_FSYNC 1
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 #include "chat1002.h"
 
+#ifdef KB_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(KB_HAVE_THREADS) || defined(KB_HAVE_FSYNC)
+#include <unistd.h>
+#endif
+
 // Contains struct declarations for data structure and its function prototypes
 #include "datastructure.h"
 
-// Maximum line for an entity description as specified in the project specs
-// LINE_MAX = 64 (MAX_ENTITY) + 1 (for '=' char) + 256 (MAX_RESPONSE) + 1 (for '\n' char) 
-#define LINE_MAX MAX_ENTITY + MAX_RESPONSE + 2
-
- /*
-  * Get the response to a question.
-  *
-  * Input:
-  *   intent   - the question word
-  *   entity   - the entity
-  *   response - a buffer to receive the response
-  *   n        - the maximum number of characters to write to the response buffer
-  *
-  * Returns:
-  *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
-  *   KB_NOTFOUND, if no response could be found
-  *   KB_INVALID, if 'intent' is not a recognised question word
-  */
-int knowledge_get(const char* intent, const char* entity, char* response, int n)
-{
+// Size of the blocks that knowledge_read() reads a file in (lines longer than this are still read whole)
+#define KB_READ_BLOCK (64 * 1024)
 
-	// Checks if a response exist in the section
+// Identifies a binary knowledge base snapshot file (written by knowledge_write_binary())
+#define KB_BINARY_MAGIC "ZEUS-KB\n"
 
-	// Check to see if section exists
-	ht* section = section_ht_get(sections, intent);
+// Version of the binary snapshot layout
+// Must be increased whenever the frozen table layout or key_hash() changes, since the hashes are stored in the file
+#define KB_BINARY_VERSION 2
 
-	// If section does not exists, return KB_INVALID
-	if (section == NULL)
-	{
-		return KB_INVALID;
-	}
+// Written as a 32-bit number, reads back differently on a machine with another byte order
+#define KB_BINARY_BYTE_ORDER 0x01020304
 
-	// Else, try to get the description value in the section with the entity key
-	char* description_value = section_entity_ht_get(sections, intent, entity);
+// Start of a binary snapshot file
+// The checksum is the CRC-32 of everything in the file after the header
+typedef struct kb_binary_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t section_count;
+	uint32_t checksum;
+} kb_binary_header;
 
-	// If there is a valid entry
-	if (description_value != NULL)
-	{
+// Identifies a journal of learned answers (see knowledge_journal_open())
+#define KB_JOURNAL_MAGIC "ZEUS-WAL"
 
-		// Copy the contents of the description into the response buffer
-		strcpy(response, description_value);
-		return KB_OK;
-	}
+// Version of the journal layout
+#define KB_JOURNAL_VERSION 1
 
-	// Else, there is no key match with the given entity key, return KB_NOTFOUND
-	return KB_NOTFOUND;
-}
+// Added to the name of a knowledge base file to get the name of its journal
+#define KB_JOURNAL_SUFFIX ".journal"
+
+// Added to the name of a file while a new one is written to replace it (see temp_file_open())
+#define KB_TEMP_SUFFIX ".tmp"
+
+// Size of the buffer that knowledge_write() and knowledge_save() write files through
+#define KB_WRITE_BLOCK (1024 * 1024)
+
+// Bytes of .ini lines each thread of write_frozen_section() formats at a time, before they are written out in order
+#define KB_SAVE_CHUNK (4 * 1024 * 1024)
+
+// Starting size of the buffer that learned answers wait in until they are written to the journal
+#define KB_JOURNAL_BUFFER 4096
+
+// Largest record accepted when replaying a journal (question word, entity and response together)
+#define KB_JOURNAL_MAX_RECORD (64 * 1024 * 1024)
+
+// Starting number of slots in the index of the pending questions, it doubles as it fills up (a power of two)
+#define KB_PENDING_INDEX_SIZE 256
+
+// Longest line read from a file of pending questions or of answers to them (longer ones are skipped)
+#define KB_PENDING_LINE (MAX_INPUT + MAX_RESPONSE + 32)
+
+// Start of a journal file, the byte order is KB_BINARY_BYTE_ORDER as in a binary snapshot
+typedef struct kb_journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+} kb_journal_header;
+
+// A learned answer in the journal, followed by its question word, entity and response (not null-terminated)
+// The checksum is the CRC-32 of the rest of the record, so that a record cut short by a crash is recognised
+typedef struct kb_journal_record {
+	uint32_t checksum;
+	uint32_t intent_len;
+	uint32_t key_len;
+	uint32_t value_len;
+} kb_journal_record;
+
+// Writes to a file through a buffer of KB_WRITE_BLOCK bytes, keeping track of the position in the file
+// and of the CRC-32 of what has been written (which can be reset, e.g. for each section)
+typedef struct kb_writer {
+	FILE* f;
+	char* buffer;
+	size_t used;
+	long offset;
+	uint32_t checksum;
+	bool failed;
+} kb_writer;
+
+// Represents the entries of a frozen table formatted by one thread of write_frozen_section(), into a buffer of its own
+typedef struct save_chunk {
+	const frozen_ht* table;
+	uint32_t first;
+	uint32_t end;
+	char* buffer;
+	size_t capacity;
+	size_t size;
+} save_chunk;
+
+// A snapshot of the knowledge base being saved by knowledge_save() or knowledge_save_background()
+// (or a checkpoint of the journal, see knowledge_journal_checkpoint(), which for a .ini file holds no tables)
+// It holds on to the frozen table of every section (see frozen_ht_hold()), which never change, so the file
+// can be written on a thread of its own while knowledge_put() carries on setting entries outside of them
+typedef struct kb_save_job {
+	char* file_name;
+	bool binary;
+	frozen_ht* tables[SECTION_TABLE_SIZE];
+	bool dirty[SECTION_TABLE_SIZE];
+
+	// Where each section is in the file saved last, if that is the file being saved again
+	bool copy_old;
+	kb_saved_section old_sections[SECTION_TABLE_SIZE];
+	long old_size;
+
+	// Number of threads that format the sections that are written again
+	unsigned int threads;
+
+	// Where each section was written, how many were written rather than copied, and KB_OK or the error
+	kb_saved_section saved[SECTION_TABLE_SIZE];
+	int rewritten;
+	int result;
+
+	// For a checkpoint of the journal (see knowledge_journal_checkpoint()): how much of the journal goes into
+	// the file, and for a .ini file, the journal to read the records from and the size of the file written
+	bool checkpoint;
+	long journal_mark;
+	unsigned long journal_mark_records;
+	char* journal_name;
+	long file_size;
+
+#ifdef KB_HAVE_THREADS
+	pthread_t thread;
+	pthread_mutex_t lock;
+	bool done;
+#endif
+} kb_save_job;
+
+// The locks of a knowledge base in concurrent mode (see kb_set_concurrent())
+#ifdef KB_HAVE_THREADS
+typedef struct kb_locks {
+	pthread_rwlock_t sections[SECTION_TABLE_SIZE];
+	pthread_mutex_t journal;
+} kb_locks;
+#endif
+
+// Lock-free lookups (KB_CONCURRENT_RCU) need both threads and atomics
+#if defined(KB_HAVE_THREADS) && defined(KB_HAVE_ATOMICS)
+#define KB_HAVE_RCU 1
+
+// Most threads registered at once to look things up without locks (see kb_rcu_register())
+#define KB_RCU_MAX_READERS 64
+
+// A table for lookups without locks that has been replaced, freed once every reader has moved past it
+typedef struct kb_rcu_retired {
+	rcu_ht* table;
+	unsigned long generation;
+	struct kb_rcu_retired* next;
+} kb_rcu_retired;
+
+// A thread registered to look things up without locks: the generation it last saw (0 if the slot is free)
+// Each one is kept apart from the others, so that readers never write to the same cache line
+typedef struct kb_rcu_reader {
+	atomic_ulong seen;
+	char padding[64];
+} kb_rcu_reader;
+
+// The state of KB_CONCURRENT_RCU mode (see kb_set_concurrent())
+typedef struct kb_rcu {
+	// The table of each section that lookups read, NULL if the section does not exist
+	_Atomic(rcu_ht*) tables[SECTION_TABLE_SIZE];
+
+	// The tables replaced in each section, changed only with the section write locked
+	kb_rcu_retired* retired[SECTION_TABLE_SIZE];
+
+	// Counts the tables retired so far, starting at 1
+	atomic_ulong generation;
+
+	// The registered readers, registered and looked through with readers_lock held
+	kb_rcu_reader readers[KB_RCU_MAX_READERS];
+	pthread_mutex_t readers_lock;
+} kb_rcu;
+#endif
+
+// A question that the knowledge base could not answer, in the pending questions (see kb_pending_open())
+// A question answered since is kept with no hits, and is not written to the file any more
+typedef struct kb_pending_question {
+	int section_id;
+	unsigned int hash;
+	unsigned int entity_len;
+	unsigned long hits;
+	char* entity;
+} kb_pending_question;
+
+// A write of the file of pending questions, on a thread of its own (see kb_pending_flush())
+typedef struct kb_pending_job {
+	char* file_name;
+	char* text;
+	size_t size;
+	int result;
+
+#ifdef KB_HAVE_THREADS
+	pthread_t thread;
+	pthread_mutex_t lock;
+	bool done;
+#endif
+} kb_pending_job;
+
+// The pending questions of a knowledge base, in the order they were first asked
+typedef struct kb_pending_queue {
+	char* file_name;
+	kb_pending_question* questions;
+	unsigned int count;
+	unsigned int capacity;
+
+	// Open addressing index of the questions: position in questions + 1, 0 for an empty slot
+	unsigned int* index;
+	unsigned int index_size;
+
+	// Set when the questions change, cleared once they are handed to a write of the file
+	bool changed;
+
+	// The write of the file still going on, NULL if none, and how the last one went
+	kb_pending_job* write;
+	int write_result;
+} kb_pending_queue;
+
+// Start of each section in a binary snapshot file
+// It is followed by the image of the section's frozen table (see frozen_ht_image_size())
+typedef struct kb_binary_section {
+	char section_key[MAX_INTENT];
+	uint32_t count;
+	uint32_t bucket_count;
+	uint32_t strings_size;
+	uint32_t reserved;
+} kb_binary_section;
+
+// Kinds of line in a .ini file, see parse_ini_line()
+#define INI_LINE_OTHER   0
+#define INI_LINE_SECTION 1
+#define INI_LINE_ENTRY   2
+
+// Represents a line of a .ini file, as found by parse_ini_line()
+// For a section, section_id is its intent_id (-1 if it is not a recognised question word)
+// For an entry, key and value point at the entity and description in the line (not null-terminated)
+typedef struct ini_line {
+	int kind;
+	int section_id;
+	const char* key;
+	unsigned int key_len;
+	const char* value;
+	unsigned int value_len;
+} ini_line;
+
+// Maximum number of threads knowledge_read_parallel() loads a file with
+#define LOAD_MAX_THREADS 64
+
+// Minimum number of bytes of the file for each thread of knowledge_read_parallel()
+// Smaller files are loaded by fewer threads, or just the one
+#define LOAD_MIN_CHUNK_SIZE (1024 * 1024)
+
+// Section of the entries of a chunk that come before its first [section]
+// They belong to the section that the previous chunk ends in
+#define LOAD_SECTION_INHERITED -2
+
+// Represents an entry found by knowledge_read_parallel(), waiting to be added to its section
+typedef struct load_entry {
+	const char* key;
+	const char* value;
+	unsigned int key_len;
+	unsigned int value_len;
+	unsigned int hash;
+	int section_id;
+} load_entry;
+
+// Represents the part of the file parsed by one thread of knowledge_read_parallel(), and what was found in it
+typedef struct load_chunk {
+	const char* start;
+	const char* end;
+	load_entry* entries;
+	size_t count;
+	size_t capacity;
+	int first_section;
+	int last_section;
+	bool seen[SECTION_TABLE_SIZE];
+	bool out_of_memory;
+} load_chunk;
+
+// Represents the work of one thread of knowledge_read_parallel() adding the entries of one section
+typedef struct load_merge {
+	ht* section;
+	int section_id;
+	load_chunk* chunks;
+	unsigned int chunk_count;
+	int pairs;
+	bool out_of_memory;
+} load_merge;
+
+// Helper functions for reading mapped files
+static const char* parse_ini_line(const char* data, const char* end, ini_line* line);
+static int read_mapping(knowledge_base* kb, kb_mapping* mapping);
+static void* load_parse_chunk(void* arg);
+static void* load_merge_section(void* arg);
+static void load_run_threads(void* (*function)(void*), void* args, size_t arg_size, unsigned int count);
+static unsigned int load_processor_count(void);
+
+// Helper functions for the binary snapshot checksum
+static uint32_t crc32_table[8][256];
+static bool crc32_initialized = false;
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t size);
+static bool binary_table_valid(const frozen_ht* table);
+static bool binary_string_valid(const frozen_ht* table, uint32_t offset, uint32_t len);
+
+static kb_save_job* save_job_create(knowledge_base* kb, const char* file_name);
+static kb_save_job* save_job_alloc(const char* file_name);
+static void save_job_start(knowledge_base* kb, kb_save_job* job);
+static void* save_job_run(void* arg);
+static int save_job_finish(knowledge_base* kb, kb_save_job* job);
+static void save_job_done(knowledge_base* kb, kb_save_job* job);
+static void save_job_free(kb_save_job* job);
+static void background_save_join(knowledge_base* kb, bool wait);
+static int save_sections(FILE* f, FILE* old, kb_save_job* job);
+static int write_binary_tables(FILE* f, frozen_ht* const* tables);
+static void write_section(kb_writer* writer, int section_id, ht* section);
+static void write_frozen_section(kb_writer* writer, int section_id, const frozen_ht* table, unsigned int threads);
+static void* save_format_chunk(void* arg);
+static unsigned int save_thread_count(unsigned int threads);
+static bool writer_open(kb_writer* writer, FILE* f);
+static void writer_put(kb_writer* writer, const char* data, size_t size);
+static void writer_write(kb_writer* writer, const char* data, size_t size);
+static void writer_flush(kb_writer* writer);
+static void writer_close(kb_writer* writer);
+static FILE* temp_file_open(const char* file_name, const char* mode, char** temp_name);
+static int temp_file_commit(FILE* f, char* temp_name, const char* file_name, int result);
+
+static int journal_append(knowledge_base* kb, const char* intent, const char* entity, size_t entity_len, const char* value, size_t value_len);
+static int journal_replay(knowledge_base* kb, FILE* f);
+static int journal_write_header(FILE* f);
+
+static kb_pending_question* pending_find(kb_pending_queue* queue, int section_id, const char* entity, unsigned int entity_len, bool add);
+static bool pending_index_grow(kb_pending_queue* queue);
+static unsigned int pending_slot(const kb_pending_queue* queue, int section_id, unsigned int hash);
+static unsigned int pending_waiting(const kb_pending_queue* queue);
+static char* pending_format(const kb_pending_queue* queue, size_t* size);
+static int pending_compare(const void* a, const void* b);
+static bool pending_read_line(FILE* f, char* line, char** fields, int max_fields, int* field_count);
+static int pending_write_finish(kb_pending_queue* queue, bool wait);
+static void* pending_write_run(void* arg);
+static bool journal_checkpoint_due(knowledge_base* kb);
+static int journal_write(knowledge_base* kb);
+static int journal_fold(FILE* f, kb_save_job* job);
+static void journal_checkpoint_finish(knowledge_base* kb, kb_save_job* job);
+
+static void unload_knowledge_base(knowledge_base* kb);
+
+static int lookup_section(knowledge_base* kb, int section_id, const char* key, unsigned int key_len,
+	unsigned int full_hash, char* const* words, kb_view* response, char* copy, int n);
+static void copy_response(char* copy, int n, const char* value, unsigned int value_len);
+static void section_read_lock(knowledge_base* kb, int section_id);
+static void section_write_lock(knowledge_base* kb, int section_id);
+static void section_unlock(knowledge_base* kb, int section_id);
+static void journal_lock(knowledge_base* kb);
+static void journal_unlock(knowledge_base* kb);
+#ifdef KB_HAVE_RCU
+static int rcu_start(knowledge_base* kb);
+static void rcu_stop(knowledge_base* kb);
+static bool rcu_publish(knowledge_base* kb, int section_id, ht* section);
+static bool rcu_replace(knowledge_base* kb, int section_id, rcu_ht* table);
+static bool rcu_put(knowledge_base* kb, int section_id, ht* section, const char* entity, const char* response);
+static void rcu_reclaim(knowledge_base* kb, int section_id);
+#endif
+
+// The knowledge base used by the knowledge_*() functions, empty to begin with
+static knowledge_base default_knowledge;
+
+// Tables shared by every knowledge base, built the first time they are needed (see build_shared_tables())
+#ifdef KB_HAVE_THREADS
+static pthread_once_t shared_tables_once = PTHREAD_ONCE_INIT;
+#endif
+static void build_shared_tables(void);
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
- *
- * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ * Create a new, empty knowledge base.
  *
- * Returns:
- *   KB_FOUND, if successful
- *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
+ * Returns: the knowledge base, to be freed with kb_destroy(), or NULL if there was a memory allocation failure
  */
-int knowledge_put(const char* intent, const char* entity, const char* response)
+knowledge_base* kb_create()
 {
-	// Check to see if section exists
-	ht *section = section_ht_get(sections, intent);
 
-	// If section retrieval fails, return KB_INVALID 
-	if (section == NULL) 
+	knowledge_base* kb = calloc(1, sizeof(knowledge_base));
+
+	if (kb == NULL)
 	{
-		return KB_INVALID;
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return NULL;
 	}
-	else
+
+	// Knowledge bases used on different threads must never build the shared tables at the same time
+#ifdef KB_HAVE_THREADS
+	pthread_once(&shared_tables_once, build_shared_tables);
+#else
+	build_shared_tables();
+#endif
+
+	return kb;
+}
+
+/*
+ * Build the tables that every knowledge base shares, which are otherwise built the first time
+ * they are used: the checksum tables and the question word lookup (see section_index()).
+ * They are only read from then on.
+ */
+static void build_shared_tables(void)
+{
+	crc32_update(0, NULL, 0);
+	section_index(kb_intent_words[0]);
+}
+
+/*
+ * Free a knowledge base created by kb_create(), with everything in it. A save still being
+ * written in the background is finished first, and what is left for its journal is written.
+ *
+ * Input:
+ *   kb - the knowledge base (nothing is done if NULL)
+ */
+void kb_destroy(knowledge_base* kb)
+{
+	if (kb == NULL)
 	{
-		// Insert new response and overwrite if it exists to be added to the knowledge base
-		// This is accounted in section_entity_ht_set()
-		// If set operation is successful, return KB_FOUND
-		if (section_entity_ht_set(sections, intent, entity, (char*) response))
-		{
-			return KB_FOUND;
-		}
-		
-		return KB_NOMEM;
+		return;
 	}
+
+	unload_knowledge_base(kb);
+	free(kb);
+}
+
+// Gets the default knowledge base, the one the knowledge_*() functions and the chatbot use
+knowledge_base* knowledge_default()
+{
+	return &default_knowledge;
 }
 
 /*
- * Read a knowledge base from a file.
+ * Free everything in a knowledge base, leaving it empty, for kb_destroy() and knowledge_unload().
  *
  * Input:
- *   f - the file
- *
- * Returns: the number of entity/response pairs successful read from the file
+ *   kb - the knowledge base
  */
-int knowledge_read(FILE* f)
+static void unload_knowledge_base(knowledge_base* kb)
 {
 
-	// Initialize pairs counter
-	unsigned int pairs = 0;
-
-	// Declare buffer to read line from file
-	char input_buffer[LINE_MAX] = { 0 };
+	// Let a save still being written finish, there is no one left to tell how it went
+	background_save_join(kb, true);
 
-	// Declare variables for use later (explanation provided further down)
-	unsigned int i = 0, j = 0, k = 0;
-	bool entry_flag = false;
-	bool section_flag = false;
-	bool valid_section = false;
-	bool is_section_exist = false;
-	char *recognized_intents[3] = {"what", "where", "who"};
+	// Free the locks and the tables published for lookups without locks, if any
+	kb_set_concurrent(kb, KB_CONCURRENT_OFF);
+	save_job_free(kb->finished_save);
+	kb->finished_save = NULL;
 
-	// Initialize buffers for use
-	char section_key_buffer[LINE_MAX] = { 0 };
-	char entity_key_buffer[MAX_ENTITY] = { 0 };
-	char description_value_buffer[MAX_RESPONSE] = { 0 };
+	// Write whatever is left for the journal and close it, and the pending questions too
+	kb_journal_close(kb);
+	kb_pending_close(kb);
 
-	// Read the file line by line
-	while ((fgets(input_buffer, LINE_MAX, f)) != NULL)
-	{
-		
-		/* If the line is a section, this indicates the start of a new section.
-		buffer[0] is used to check for '[' to determine start of section. */
-		if (input_buffer[0] == '[')
-		{
+	// Free the sections, and whatever is left of sections removed by earlier resets
+	unload_section_ht(kb->sections);
+	reclaim_retired_sections(&kb->retired_sections, RECLAIM_ALL_BLOCKS);
 
-			section_flag = true;
+	free(kb->saved_file_name);
+	kb->saved_file_name = NULL;
+	kb->saved_file_size = 0;
+}
 
-			/* i index used to track the closing bracket.
-			According to project specs, once a section is found, 
-			it starts with a '[' char and it is guaranteed to have a ']' char. 
-			But we must ignore all chars after the closing ']' char.
-			*/
-			i = 1;
-			while (input_buffer[i] != ']')
-			{
-				i++;
-			}
+/*
+ * Get the response to a question.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is copied to the response
+ *          buffer, cut short if it is longer than n - 1 characters; knowledge_get_view() does not copy it)
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int kb_get(knowledge_base* kb, const char* intent, const char* entity, char* response, int n)
+{
 
-			// Check for empty section "[]"
-			if (i == 1)
-			{
-				section_flag = false;
-			}
+	kb_view view;
+	unsigned int entity_len = (unsigned int) strlen(entity);
 
-			if (section_flag)
-			{
-				// Copy input buffer over to section key buffer
-				for (unsigned int q = 0; q < i - 1; q++)
-				{
-					section_key_buffer[q] = tolower(input_buffer[1 + q]);
-				}
+	// The response is copied before the section is unlocked (in concurrent mode)
+	return lookup_section(kb, section_index(intent), entity, entity_len, key_hash_len(entity, entity_len), NULL,
+		&view, response, n);
+}
 
-				// Set the NULL terminator in string
-				section_key_buffer[i - 1] = '\0';
+/*
+ * Get the response to a question without copying it.
+ *
+ * The response is left where it is stored in the knowledge base, so it can be of any length.
+ * It stays valid until the knowledge base is next changed (a put, load or reset).
+ *
+ * Input:
+ *   intent     - the question word
+ *   entity     - the entity (does not have to be null-terminated)
+ *   entity_len - the length of the entity
+ *   response   - receives the response (not null-terminated, see kb_view)
+ *
+ * Returns: as knowledge_get()
+ */
+int kb_get_view(knowledge_base* kb, const char* intent, const char* entity, size_t entity_len, kb_view* response)
+{
 
-				// Check to see if intent is recognized by our chatbot
-				valid_section = false;
-				for (int q = 0; q < 3; q++)
-				{
-					if (strcmp(section_key_buffer, recognized_intents[q]) == 0 )
-					{
-						valid_section = true;
-						break;
-					}
-				}
+	// Find the section for the question word, -1 if it is not a recognised question word
+	int section_id = section_index(intent);
 
-				// Set the section key and entity hashtable insert it into sections hash table
-				// If valid section is determined
-				if (valid_section)
-				{
+	return lookup_section(kb, section_id, entity, (unsigned int) entity_len,
+		key_hash_len(entity, (unsigned int) entity_len), NULL, response, NULL, 0);
+}
 
-					// Try to get the section from the sections hash table
-					ht* section = section_ht_get(sections, section_key_buffer);
+/*
+ * Get the response to a question whose entity is given as a list of words, without copying it.
+ *
+ * The words stand for the entity they make up when joined by single spaces, e.g. the words
+ * of the question after the question word. They are looked up where they are, without being
+ * joined into one string, so a response that is found costs no copying at all.
+ *
+ * Input:
+ *   intent   - the question word
+ *   words    - the words of the entity, ending with a NULL pointer (e.g. part of inv[])
+ *   response - receives the response (not null-terminated, see kb_view)
+ *
+ * Returns: as knowledge_get()
+ */
+int kb_get_words(knowledge_base* kb, const char* intent, char* const* words, kb_view* response)
+{
 
-					// Section does not exist in the hash table
-					if (section == NULL)
-					{
+	// Find the section for the question word, -1 if it is not a recognised question word
+	int section_id = section_index(intent);
 
-						// Create the entity hash table (a new section)
-						ht* new_section = create_entity_ht();
+	// The words are hashed as if they were joined by single spaces
+	unsigned int key_len = 0;
+	unsigned int full_hash = key_hash_words(words, &key_len);
 
-						if (new_section == NULL)
-						{
-							printf("Ran out of memory.\nNo memory is allocated.\n");
-        					return -1;
-						}
+	return lookup_section(kb, section_id, NULL, key_len, full_hash, words, response, NULL, 0);
+}
 
-						// Allocate memory for the section key
-						char* section_key = malloc(strlen(section_key_buffer) + 1);
+/*
+ * Look an entity up in a section, for kb_get_view() and kb_get_words().
+ *
+ * In KB_CONCURRENT_LOCKED mode the section is read locked while it is looked in, and the lookup does
+ * none of the section's pending resize work (see entity_ht_peek()), so that lookups from other threads
+ * can go on at the same time. Puts do the resize work instead. In KB_CONCURRENT_RCU mode the table
+ * the section has published is looked in without any lock.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   section_id - the section (its intent_id), -1 if the question word is not recognised
+ *   key        - the entity (unused if it is a list of words)
+ *   key_len    - the length of the entity
+ *   full_hash  - the hash of the entity, from key_hash_len() or key_hash_words()
+ *   words      - the words of the entity if it is a list of words, else NULL
+ *   response   - receives the response (not null-terminated, see kb_view)
+ *   copy       - a buffer to copy the response to as well (cut short to n - 1 characters), NULL for none
+ *   n          - the size of the copy buffer
+ *
+ * Returns: as knowledge_get()
+ */
+static int lookup_section(knowledge_base* kb, int section_id, const char* key, unsigned int key_len,
+	unsigned int full_hash, char* const* words, kb_view* response, char* copy, int n)
+{
 
-						// Check for sufficient memory.
-						if (section_key == NULL)
-						{
-							free(new_section);
-							printf("Ran out of memory.\nNo memory is allocated.\n");
-        					return -1;
-						}
+	const char* description_value = NULL;
+	unsigned int value_len = 0;
+	bool section_exists;
 
-						// Copy the contents of buffer over to the section key
-						strcpy(section_key, section_key_buffer);
+#ifdef KB_HAVE_RCU
+	// Without locks, the table the section has published is looked in instead (see kb_set_concurrent())
+	if (kb->rcu != NULL)
+	{
+		const rcu_ht* table = section_id >= 0 && section_id < SECTION_TABLE_SIZE
+			? atomic_load_explicit(&kb->rcu->tables[section_id], memory_order_acquire) : NULL;
 
-						// Add section to section hash table
-						section_ht_set(sections, section_key, new_section);
-					}
+		section_exists = table != NULL;
 
-					/* Else if the section exists in hash table
-					The entry is inserted in the next step */
-				}
-			}
+		if (table != NULL)
+		{
+			description_value = rcu_ht_lookup(table, key, key_len, full_hash, words, &value_len);
 		}
 
-		// Else if is a blank line, continue
-		else if (input_buffer[0] == '\n')
+		copy_response(copy, n, description_value, value_len);
+	}
+	else
+#endif
+	{
+		section_read_lock(kb, section_id);
+
+		// Check to see if section exists
+		ht* section = section_ht_get(kb->sections, section_id);
+		section_exists = section != NULL;
+
+		// If it does, try to get the description value in the section with the entity
+		if (section != NULL)
 		{
-			section_flag = false;
-			continue;
+			description_value = kb->locks != NULL
+				? entity_ht_peek(section, key, key_len, full_hash, words, &value_len)
+				: entity_ht_lookup(section, key, key_len, full_hash, words, &value_len);
 		}
 
-		// Else, check if it is an entry in a section
-		else
-		{
+		// The response is copied before another thread can change the section
+		copy_response(copy, n, description_value, value_len);
+		section_unlock(kb, section_id);
+	}
 
-			if (valid_section)
-			{
-				
-				// i index used to write entity_key from buffer
-				// j index used to track if there is a valid entry in line
-				// k index used to write description_value from buffer
-				i = 0, j = 0; k = 0;
+	// If section does not exists, return KB_INVALID
+	if (!section_exists)
+	{
+		return KB_INVALID;
+	}
 
-				// Flag check to determine if line parsed in file is an entry
-				entry_flag = false;
+	// If there is no key match with the given entity, return KB_NOTFOUND
+	if (description_value == NULL)
+	{
+		return KB_NOTFOUND;
+	}
 
-				// Use j index to seek up to '=' to determine an entry
-				do
-				{
+	response->text = description_value;
+	response->len = value_len;
 
-					// Check for empty entry "="
-					if (input_buffer[0] == '=')
-					{
-						break;
-					}
+	return KB_OK;
+}
 
-					/* Stop when either an entry is determined
-					or a newline is found (newline signifies end of line) */
-					if (input_buffer[j] == '=')
-					{
-						entry_flag = true;
-						break;
-					}
+// Copy a response that was found into a buffer, null-terminated and cut short to n - 1 characters
+// (nothing is done if the buffer or the response is NULL)
+static void copy_response(char* copy, int n, const char* value, unsigned int value_len)
+{
+	if (copy == NULL || value == NULL || n <= 0)
+	{
+		return;
+	}
 
-					else if (input_buffer[j] == '\n')
-					{
-						break;
-					}
+	size_t len = value_len < (size_t) n - 1 ? value_len : (size_t) n - 1;
 
-					j++;
-				} while (j < LINE_MAX);
+	memcpy(copy, value, len);
+	copy[len] = '\0';
+}
 
-				// If there is a valid entry
-				if (entry_flag)
-				{
-					// Use i index to seek up to j
-					while (i != j)
-					{
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_FOUND, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ */
+int kb_put(knowledge_base* kb, const char* intent, const char* entity, const char* response)
+{
+	// Find the section for the question word, -1 if it is not a recognised question word
+	int section_id = section_index(intent);
 
-						// Set entity_key
-						entity_key_buffer[i] = input_buffer[i];
-						i++;
-					}
+	// Other threads may be looking in the section, it is write locked while the response is set
+	section_write_lock(kb, section_id);
 
-					// Set NULL terminator in string
-					entity_key_buffer[i] = '\0';
+	// Check to see if section exists
+	ht *section = section_ht_get(kb->sections, section_id);
+	bool set = false;
 
-					// Move i index pass '=' char
-					i++;
+	// Insert new response and overwrite if it exists to be added to the knowledge base
+	// This is accounted in section_entity_ht_set()
+	if (section != NULL)
+	{
+		set = section_entity_ht_set(kb->sections, section_id, entity, (char*) response);
+	}
 
-					// Seek up to the end of the line excluding the '\n' character
-					while (i != strlen(input_buffer) - 1)
-					{
+#ifdef KB_HAVE_RCU
+	// Lookups without locks find it once it is in the section's published table too
+	if (set && kb->rcu != NULL)
+	{
+		set = rcu_put(kb, section_id, section, entity, response);
+	}
+#endif
 
-						// Set description_value
-						description_value_buffer[k] = input_buffer[i];
-						k++;
-						i++;
-					}
+	section_unlock(kb, section_id);
 
-					// Set NULL terminator in string
-					description_value_buffer[k] = '\0';
-					
-					/* If there is a value, we are replacing the description value.
-					Else, value is updated in entity hash table. Function returns true if set,
-					false otherwise. Either ran out of memory, invalid inserts (section does not exist).
-					. */
-					if (section_entity_ht_set(sections, section_key_buffer, entity_key_buffer, description_value_buffer))
-					{
-						// Increment pair counter
-						pairs++;
-					};
-				}
-			}
-		}
+	// If section retrieval fails, return KB_INVALID
+	if (section == NULL)
+	{
+		return KB_INVALID;
 	}
 
-	return pairs;
-}
+	// If set operation is successful, return KB_FOUND
+	if (set)
+	{
+		// Remember the answer in the journal too, it is written at the end of the chatbot turn
+		// (the journal is only opened and closed with the knowledge base to itself, so it is checked without the lock)
+		if (kb->journal != NULL)
+		{
+			journal_lock(kb);
+			journal_append(kb, kb_intent_words[section_id], entity, strlen(entity), response, strlen(response));
+			journal_unlock(kb);
+		}
 
-/*
- * Reset the knowledge base, removing all known entities from all intents.
- */
-void knowledge_reset()
-{
+		return KB_FOUND;
+	}
 
-	/* Unload section hashtables. Memory allocated is freed.
-	All pointers in sections hash table are initialize to NULL. */
-    unload_section_ht(sections);
+	return KB_NOMEM;
 }
 
 /*
- * Write the knowledge base to a file.
+ * Change the concurrent mode of a knowledge base.
+ *
+ * In KB_CONCURRENT_LOCKED and KB_CONCURRENT_RCU modes, kb_get(), kb_get_view(), kb_get_words(),
+ * kb_put(), kb_freeze(), kb_reset() and kb_journal_commit() may be called from several threads at
+ * the same time. Every section has a reader-writer lock, a put (or a freeze or reset) has the section
+ * to itself. Learned answers are added to the journal under a lock of their own, after the section
+ * is unlocked, so lookups never wait on the journal.
+ *
+ * In KB_CONCURRENT_LOCKED mode, lookups share the section's lock, so any number of them go on at once.
+ * kb_get() copies the response before the section is unlocked; a view from kb_get_view() or
+ * kb_get_words() stays valid until the next freeze, reset or load, the same as with the mode off.
+ *
+ * In KB_CONCURRENT_RCU mode, lookups take no lock and write nothing: every section is frozen and
+ * published as a table that is only ever added to (see rcu_ht), and puts add to it as well as to the
+ * section. Once it is full, or the section is frozen or reset, a new table is published in its place
+ * and the old one is retired. It is freed after a grace period, once every thread that looks things
+ * up has said that it holds nothing from it any more. Each of those threads must register with
+ * kb_rcu_register() before its first lookup, call kb_rcu_quiescent() every now and then (views it got
+ * stay valid until then), and kb_rcu_unregister() when it is done.
+ *
+ * Loading, writing, saving and destroying the knowledge base, and changing the mode, still need the
+ * knowledge base to themselves. The tables read by lock-free lookups are only published when the mode
+ * is changed, so the mode is turned off before loading, and on again afterwards.
  *
  * Input:
- *   f - the file
+ *   kb   - the knowledge base
+ *   mode - KB_CONCURRENT_OFF, KB_CONCURRENT_LOCKED or KB_CONCURRENT_RCU
+ *
+ * Returns:
+ *   KB_OK, if the mode was changed (or already was the one asked for)
+ *   KB_NOMEM, if there was a memory allocation failure (the mode is then off)
+ *   KB_INVALID, if the mode is not available on this system (threads or atomics are missing)
  */
-void knowledge_write(FILE* f)
+int kb_set_concurrent(knowledge_base* kb, int mode)
 {
-	// To hold each section hashtable [who] [what] [where]
-	ht *temp = NULL;
-
-    // Iterate through sections hashtable
-    for (int i = 0; i < SECTION_TABLE_SIZE; i++)
-    {
-        // While there is a section in the bucket
-        if (sections[i] != NULL)
-        {
-            // Set a travesal pointer to the head of the list for the index / bucket
-            section_node* trav = sections[i];
-
-            // While the end of the list is not reached for the current index
-            while (trav != NULL)
-            {
-				// Add the section key [who] etc to the file stream
-				fprintf(f, "[%s]\n", trav->section_key);
-
-				// Hold the temp value of each traversal entity
-				temp = trav->section_ht;
-
-				// Iterate through the entity hashtable
-				for (int i = 0; i < ENTITY_TABLE_SIZE; i++)
-				{
-					// If there is an entry in the entity hashtable
-					if (temp->entries[i] != NULL)
-					{
-						// Set a travesal pointer to the start of the bucket
-						node* trav = temp->entries[i];
 
-						// While there is a linked entry in the bucket
-						while (trav != NULL)
-						{
-							// Add the entity key and description value to filestream
-							fprintf(f, "%s=%s\n", trav->entity_key, trav->description_value);
+#ifdef KB_HAVE_RCU
+	// Lookups without locks stop first, the tables they read are freed
+	if (kb->rcu != NULL && mode != KB_CONCURRENT_RCU)
+	{
+		rcu_stop(kb);
+	}
+#else
+	if (mode == KB_CONCURRENT_RCU)
+	{
+		return KB_INVALID;
+	}
+#endif
 
-							// Set travesal to the next linked entry in bucket
-							trav = trav->next;
+#ifdef KB_HAVE_THREADS
+	if (mode != KB_CONCURRENT_OFF && kb->locks == NULL)
+	{
+		kb_locks* locks = malloc(sizeof(kb_locks));
+
+		if (locks == NULL)
+		{
+			printf("Ran out of memory.\nNo memory is allocated.\n");
+			return KB_NOMEM;
+		}
+
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			pthread_rwlock_init(&locks->sections[i], NULL);
+		}
+
+		pthread_mutex_init(&locks->journal, NULL);
+		kb->locks = locks;
+	}
+	else if (mode == KB_CONCURRENT_OFF && kb->locks != NULL)
+	{
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			pthread_rwlock_destroy(&kb->locks->sections[i]);
+		}
+
+		pthread_mutex_destroy(&kb->locks->journal);
+		free(kb->locks);
+		kb->locks = NULL;
+	}
+
+#ifdef KB_HAVE_RCU
+	// Writers still lock each section, so the locks are there before the tables are published
+	if (mode == KB_CONCURRENT_RCU && kb->rcu == NULL && rcu_start(kb) != KB_OK)
+	{
+		kb_set_concurrent(kb, KB_CONCURRENT_OFF);
+		return KB_NOMEM;
+	}
+#endif
+
+	return KB_OK;
+#else
+	return mode != KB_CONCURRENT_OFF ? KB_INVALID : KB_OK;
+#endif
+}
+
+/*
+ * Register the calling thread to look things up in KB_CONCURRENT_RCU mode (see kb_set_concurrent()).
+ *
+ * Returns: the reader's number, for kb_rcu_quiescent() and kb_rcu_unregister(),
+ *   or KB_INVALID if the knowledge base is not in KB_CONCURRENT_RCU mode or KB_RCU_MAX_READERS are registered already
+ */
+int kb_rcu_register(knowledge_base* kb)
+{
+
+#ifdef KB_HAVE_RCU
+	if (kb->rcu == NULL)
+	{
+		return KB_INVALID;
+	}
+
+	int reader = KB_INVALID;
+
+	// A table retired before this is not held by the new reader, one retired after it waits for it
+	pthread_mutex_lock(&kb->rcu->readers_lock);
+
+	for (int i = 0; i < KB_RCU_MAX_READERS && reader == KB_INVALID; i++)
+	{
+		if (atomic_load(&kb->rcu->readers[i].seen) == 0)
+		{
+			atomic_store(&kb->rcu->readers[i].seen, atomic_load(&kb->rcu->generation));
+			reader = i;
+		}
+	}
+
+	pthread_mutex_unlock(&kb->rcu->readers_lock);
+
+	return reader;
+#else
+	return KB_INVALID;
+#endif
+}
+
+/*
+ * Say that a reader registered with kb_rcu_register() holds nothing it looked up before now
+ * (views and responses it still needs must have been copied), so that the tables replaced
+ * since it last said so can be freed. It takes no lock and only writes to the reader's own slot.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   reader - the reader's number from kb_rcu_register()
+ */
+void kb_rcu_quiescent(knowledge_base* kb, int reader)
+{
+
+#ifdef KB_HAVE_RCU
+	if (kb->rcu != NULL && reader >= 0 && reader < KB_RCU_MAX_READERS)
+	{
+		atomic_store(&kb->rcu->readers[reader].seen, atomic_load(&kb->rcu->generation));
+	}
+#endif
+}
+
+/*
+ * Unregister a reader registered with kb_rcu_register(), it holds nothing it looked up any more.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   reader - the reader's number from kb_rcu_register()
+ */
+void kb_rcu_unregister(knowledge_base* kb, int reader)
+{
+
+#ifdef KB_HAVE_RCU
+	if (kb->rcu != NULL && reader >= 0 && reader < KB_RCU_MAX_READERS)
+	{
+		pthread_mutex_lock(&kb->rcu->readers_lock);
+		atomic_store(&kb->rcu->readers[reader].seen, 0);
+		pthread_mutex_unlock(&kb->rcu->readers_lock);
+	}
+#endif
+}
+
+#ifdef KB_HAVE_RCU
+/*
+ * Start KB_CONCURRENT_RCU mode: freeze every section and publish it for lookups without locks.
+ *
+ * Returns:
+ *   KB_OK, if every section was published
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is published)
+ */
+static int rcu_start(knowledge_base* kb)
+{
+
+	kb_rcu* rcu = malloc(sizeof(kb_rcu));
+
+	if (rcu == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return KB_NOMEM;
+	}
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		atomic_init(&rcu->tables[i], NULL);
+		rcu->retired[i] = NULL;
+	}
+
+	for (int i = 0; i < KB_RCU_MAX_READERS; i++)
+	{
+		atomic_init(&rcu->readers[i].seen, 0);
+	}
+
+	atomic_init(&rcu->generation, 1);
+	pthread_mutex_init(&rcu->readers_lock, NULL);
+	kb->rcu = rcu;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section != NULL && !rcu_publish(kb, i, section))
+		{
+			rcu_stop(kb);
+			return KB_NOMEM;
+		}
+	}
+
+	return KB_OK;
+}
+
+// Stop KB_CONCURRENT_RCU mode, freeing every table published and retired (no lookups may be going on)
+static void rcu_stop(knowledge_base* kb)
+{
+
+	kb_rcu* rcu = kb->rcu;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		unload_rcu_ht(atomic_load(&rcu->tables[i]));
+
+		while (rcu->retired[i] != NULL)
+		{
+			kb_rcu_retired* retired = rcu->retired[i];
+			rcu->retired[i] = retired->next;
+
+			unload_rcu_ht(retired->table);
+			free(retired);
+		}
+	}
+
+	pthread_mutex_destroy(&rcu->readers_lock);
+	free(rcu);
+	kb->rcu = NULL;
+}
+
+/*
+ * Freeze a section and publish a new table of it for lookups without locks, in place of the
+ * one there was (see rcu_replace()). The section must be write locked.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   section_id - the section
+ *   section    - its entity hash table
+ *
+ * Returns: true if the table was published, false if we ran out of memory (the old one stays)
+ */
+static bool rcu_publish(knowledge_base* kb, int section_id, ht* section)
+{
+
+	if (!entity_ht_freeze(section))
+	{
+		return false;
+	}
+
+	rcu_ht* table = create_rcu_ht(section->frozen);
+
+	if (table == NULL)
+	{
+		return false;
+	}
+
+	if (!rcu_replace(kb, section_id, table))
+	{
+		unload_rcu_ht(table);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Publish a table of a section for lookups without locks, in place of the one there was. The old
+ * one is retired, and the tables of the section that no reader can still be in are freed.
+ * The section must be write locked.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   section_id - the section
+ *   table      - the new table, NULL if the section no longer exists
+ *
+ * Returns: true if the table was published, false if we ran out of memory (the old one stays)
+ */
+static bool rcu_replace(knowledge_base* kb, int section_id, rcu_ht* table)
+{
+
+	// Made before the tables are swapped, so that the old one can always be retired
+	kb_rcu_retired* retired = malloc(sizeof(kb_rcu_retired));
+
+	if (retired == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return false;
+	}
+
+	// Everything in the new table is written before a lookup can find it
+	rcu_ht* old = atomic_exchange_explicit(&kb->rcu->tables[section_id], table, memory_order_acq_rel);
+
+	if (old != NULL)
+	{
+		/* A reader that has seen this generation has been quiescent since the table was
+		replaced, so it can only find the new one */
+		retired->table = old;
+		retired->generation = atomic_fetch_add(&kb->rcu->generation, 1) + 1;
+		retired->next = kb->rcu->retired[section_id];
+		kb->rcu->retired[section_id] = retired;
+	}
+	else
+	{
+		free(retired);
+	}
+
+	rcu_reclaim(kb, section_id);
+	return true;
+}
+
+/*
+ * Add a response just set in a section to the table it has published for lookups without locks.
+ * Once that table is full, the section is published again instead, with the response in it.
+ * The section must be write locked.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   section_id - the section
+ *   section    - its entity hash table
+ *   entity     - the entity
+ *   response   - the response
+ *
+ * Returns: true if lookups find the response from now on, false if we ran out of memory
+ */
+static bool rcu_put(knowledge_base* kb, int section_id, ht* section, const char* entity, const char* response)
+{
+
+	// Only threads holding the section's write lock change it, so it is read without ordering
+	rcu_ht* table = atomic_load_explicit(&kb->rcu->tables[section_id], memory_order_relaxed);
+	unsigned int entity_len = (unsigned int) strlen(entity);
+
+	if (table != NULL && rcu_ht_set(table, entity, entity_len, key_hash_len(entity, entity_len),
+		response, (unsigned int) strlen(response)))
+	{
+		return true;
+	}
+
+	return rcu_publish(kb, section_id, section);
+}
+
+// Free the retired tables of a section that every registered reader has moved past (the section must be write locked)
+static void rcu_reclaim(knowledge_base* kb, int section_id)
+{
+
+	kb_rcu* rcu = kb->rcu;
+
+	if (rcu->retired[section_id] == NULL)
+	{
+		return;
+	}
+
+	// The oldest generation that a reader may still be in
+	unsigned long oldest = atomic_load(&rcu->generation);
+
+	pthread_mutex_lock(&rcu->readers_lock);
+
+	for (int i = 0; i < KB_RCU_MAX_READERS; i++)
+	{
+		unsigned long seen = atomic_load(&rcu->readers[i].seen);
+
+		if (seen != 0 && seen < oldest)
+		{
+			oldest = seen;
+		}
+	}
+
+	pthread_mutex_unlock(&rcu->readers_lock);
+
+	kb_rcu_retired** link = &rcu->retired[section_id];
+
+	while (*link != NULL)
+	{
+		kb_rcu_retired* retired = *link;
+
+		if (retired->generation <= oldest)
+		{
+			*link = retired->next;
+			unload_rcu_ht(retired->table);
+			free(retired);
+		}
+		else
+		{
+			link = &retired->next;
+		}
+	}
+}
+#endif
+
+// Read lock a section in concurrent mode, nothing is done otherwise or if the section is not recognised
+static void section_read_lock(knowledge_base* kb, int section_id)
+{
+#ifdef KB_HAVE_THREADS
+	if (kb->locks != NULL && section_id >= 0 && section_id < SECTION_TABLE_SIZE)
+	{
+		pthread_rwlock_rdlock(&kb->locks->sections[section_id]);
+	}
+#endif
+}
+
+// Write lock a section in concurrent mode, nothing is done otherwise or if the section is not recognised
+static void section_write_lock(knowledge_base* kb, int section_id)
+{
+#ifdef KB_HAVE_THREADS
+	if (kb->locks != NULL && section_id >= 0 && section_id < SECTION_TABLE_SIZE)
+	{
+		pthread_rwlock_wrlock(&kb->locks->sections[section_id]);
+	}
+#endif
+}
+
+// Unlock a section locked by section_read_lock() or section_write_lock()
+static void section_unlock(knowledge_base* kb, int section_id)
+{
+#ifdef KB_HAVE_THREADS
+	if (kb->locks != NULL && section_id >= 0 && section_id < SECTION_TABLE_SIZE)
+	{
+		pthread_rwlock_unlock(&kb->locks->sections[section_id]);
+	}
+#endif
+}
+
+// Lock the journal's buffer in concurrent mode, it is always locked before any section
+static void journal_lock(knowledge_base* kb)
+{
+#ifdef KB_HAVE_THREADS
+	if (kb->locks != NULL)
+	{
+		pthread_mutex_lock(&kb->locks->journal);
+	}
+#endif
+}
+
+// Unlock the journal's buffer locked by journal_lock()
+static void journal_unlock(knowledge_base* kb)
+{
+#ifdef KB_HAVE_THREADS
+	if (kb->locks != NULL)
+	{
+		pthread_mutex_unlock(&kb->locks->journal);
+	}
+#endif
+}
+
+/*
+ * Read a knowledge base from a file.
+ *
+ * The file is read in blocks of KB_READ_BLOCK bytes and every complete line in a block is
+ * parsed where it is, the same way as knowledge_read_mapped() does; only the entity and the
+ * description are copied, straight into their section. A line that does not fit in a block
+ * makes the buffer grow, so there is no limit on the length of entities and descriptions.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns:
+ *   the number of entity/response pairs successful read from the file
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_read(knowledge_base* kb, FILE* f)
+{
+
+	// Initialize pairs counter
+	int pairs = 0;
+
+	// The section that entries are added to, NULL if the current section is not a valid one
+	ht* section = NULL;
+
+	// Buffer holding the part of the file that is being parsed, grows to fit lines longer than a block
+	size_t capacity = KB_READ_BLOCK;
+	size_t used = 0;
+	char* buffer = malloc(capacity);
+
+	if (buffer == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return KB_NOMEM;
+	}
+
+	bool end_of_file = false;
+
+	while (!end_of_file)
+	{
+
+		// Make room for another block if the buffer is full of a line that has not ended yet
+		if (used == capacity)
+		{
+			char* bigger = realloc(buffer, capacity * 2);
+
+			if (bigger == NULL)
+			{
+				printf("Ran out of memory.\nNo memory is allocated.\n");
+				free(buffer);
+				return KB_NOMEM;
+			}
+
+			buffer = bigger;
+			capacity *= 2;
+		}
+
+		// Read the next block after what is left of the last one
+		size_t got = fread(buffer + used, 1, capacity - used, f);
+		used += got;
+		end_of_file = got == 0;
+
+		/* Only parse up to the end of the last complete line, the rest of it is still to be read.
+		At the end of the file, the last line does not need to end with a newline. */
+		const char* data = buffer;
+		const char* end = buffer + used;
+
+		if (!end_of_file)
+		{
+			while (end > data && end[-1] != '\n')
+			{
+				end--;
+			}
+		}
+
+		ini_line line;
+
+		while (data < end)
+		{
+			data = parse_ini_line(data, end, &line);
+
+			// The start of a new section
+			if (line.kind == INI_LINE_SECTION)
+			{
+
+				// Entries of sections that are not recognised are skipped
+				section = NULL;
+
+				if (line.section_id < 0)
+				{
+					continue;
+				}
+
+				// Create the section if it does not exist yet
+				section = section_ht_get(kb->sections, line.section_id);
+
+				if (section == NULL)
+				{
+					section = create_entity_ht();
+
+					if (section == NULL || !section_ht_set(kb->sections, line.section_id, section))
+					{
+						if (section != NULL)
+						{
+							unload_entity_ht(section);
 						}
+
+						printf("Ran out of memory.\nNo memory is allocated.\n");
+						free(buffer);
+						return KB_NOMEM;
 					}
 				}
+			}
 
-				trav = trav->next;
-				fprintf(f, "\n");
-            }
-        }
-    }
+			// An entry in a valid section, copy the entity and description into it
+			else if (line.kind == INI_LINE_ENTRY && section != NULL)
+			{
+				if (entity_ht_insert(section, line.key, line.key_len, key_hash_len(line.key, line.key_len),
+					line.value, line.value_len, true))
+				{
+					// Increment pair counter
+					pairs++;
+				}
+			}
+		}
+
+		// Move the line that has not ended yet to the start of the buffer
+		used = buffer + used - end;
+		memmove(buffer, end, used);
+	}
+
+	free(buffer);
+
+	return pairs;
+}
+
+/*
+ * Read a knowledge base from a file by mapping it into memory, without copying it.
+ *
+ * The file is parsed in place, the same way as knowledge_read() does, but the entity keys
+ * and descriptions are not copied: the entries point straight at them in the mapped file,
+ * which stays mapped for as long as any entry points into it. A description is only
+ * copied if it is replaced later on (e.g. by knowledge_put()).
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns:
+ *   the number of entity/response pairs successful read from the file
+ *   KB_INVALID, if the file could not be mapped (knowledge_read() can be used instead)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_read_mapped(knowledge_base* kb, const char* file_name)
+{
+
+	// Map the file into memory
+	kb_mapping* mapping = mapping_open(file_name);
+
+	if (mapping == NULL)
+	{
+		return KB_INVALID;
+	}
+
+	int pairs = read_mapping(kb, mapping);
+
+	// The sections hold their own references on the file, let go of ours
+	mapping_release(mapping);
+
+	return pairs;
+}
+
+/*
+ * Read a knowledge base from a file using several threads.
+ *
+ * The file is mapped into memory (see knowledge_read_mapped()) and split at line
+ * boundaries into one chunk per thread. Each thread parses its chunk into a list of
+ * entries, noting for each one the section it belongs to (entries before the first
+ * [section] of a chunk belong to the section that the previous chunk ended in).
+ * Then one thread per section adds that section's entries, chunk after chunk in file
+ * order, so that a later entry replaces an earlier one with the same key, just like
+ * when the file is read line by line.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   threads   - the number of threads to use (0 for one per processor), set to the number used
+ *
+ * Returns:
+ *   the number of entity/response pairs successful read from the file
+ *   KB_INVALID, if the file could not be mapped (knowledge_read() can be used instead)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_read_parallel(knowledge_base* kb, const char* file_name, unsigned int* threads)
+{
+
+	// Map the file into memory
+	kb_mapping* mapping = mapping_open(file_name);
+
+	if (mapping == NULL)
+	{
+		return KB_INVALID;
+	}
+
+	// One thread per processor unless told otherwise, but no more than there is work for
+	unsigned int chunk_count = *threads != 0 ? *threads : load_processor_count();
+
+	if (chunk_count > LOAD_MAX_THREADS)
+	{
+		chunk_count = LOAD_MAX_THREADS;
+	}
+
+	if (chunk_count > mapping->size / LOAD_MIN_CHUNK_SIZE + 1)
+	{
+		chunk_count = mapping->size / LOAD_MIN_CHUNK_SIZE + 1;
+	}
+
+	*threads = chunk_count;
+
+	// Not worth splitting up, read the file in this thread
+	if (chunk_count <= 1)
+	{
+		int pairs = read_mapping(kb, mapping);
+		mapping_release(mapping);
+		return pairs;
+	}
+
+	load_chunk* chunks = calloc(chunk_count, sizeof(load_chunk));
+
+	if (chunks == NULL)
+	{
+		mapping_release(mapping);
+		return KB_NOMEM;
+	}
+
+	// Split the file into chunks of about the same size, each ending just after a newline
+	const char* data = mapping->data;
+	const char* end = data + mapping->size;
+	const char* start = data;
+
+	for (unsigned int i = 0; i < chunk_count; i++)
+	{
+		const char* chunk_end = end;
+
+		if (i < chunk_count - 1)
+		{
+			const char* target = data + mapping->size / chunk_count * (i + 1);
+			const char* newline = target >= start ? memchr(target, '\n', end - target) : NULL;
+
+			chunk_end = newline != NULL ? newline + 1 : (target >= start ? end : start);
+		}
+
+		chunks[i].start = start;
+		chunks[i].end = chunk_end;
+		start = chunk_end;
+	}
+
+	// The workers look up section names, make sure the intent dispatch table is built first
+	section_index(kb_intent_words[0]);
+
+	// Parse every chunk at the same time
+	load_run_threads(load_parse_chunk, chunks, sizeof(load_chunk), chunk_count);
+
+	int result = 0;
+
+	// Work out the section in force at the start of each chunk, from the chunks before it
+	int section_id = -1;
+
+	for (unsigned int i = 0; i < chunk_count; i++)
+	{
+		chunks[i].first_section = section_id;
+
+		if (chunks[i].last_section != LOAD_SECTION_INHERITED)
+		{
+			section_id = chunks[i].last_section;
+		}
+
+		if (chunks[i].out_of_memory)
+		{
+			result = KB_NOMEM;
+		}
+	}
+
+	// Set up one merge per section that has entries in the file
+	load_merge merges[SECTION_TABLE_SIZE];
+	unsigned int merge_count = 0;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE && result == 0; i++)
+	{
+		bool seen = false;
+
+		for (unsigned int j = 0; j < chunk_count; j++)
+		{
+			seen = seen || chunks[j].seen[i];
+		}
+
+		if (!seen)
+		{
+			continue;
+		}
+
+		// Create the section if it does not exist yet
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section == NULL)
+		{
+			section = create_entity_ht();
+
+			if (section == NULL || !section_ht_set(kb->sections, i, section))
+			{
+				if (section != NULL)
+				{
+					unload_entity_ht(section);
+				}
+
+				result = KB_NOMEM;
+				break;
+			}
+		}
+
+		// The section's entries will point into the file, keep it mapped for as long as the section
+		if (!entity_ht_hold_mapping(section, mapping))
+		{
+			result = KB_NOMEM;
+			break;
+		}
+
+		merges[merge_count].section = section;
+		merges[merge_count].section_id = i;
+		merges[merge_count].chunks = chunks;
+		merges[merge_count].chunk_count = chunk_count;
+		merges[merge_count].pairs = 0;
+		merges[merge_count].out_of_memory = false;
+		merge_count++;
+	}
+
+	// Add the entries of every section at the same time, each section is a separate table
+	if (result == 0)
+	{
+		load_run_threads(load_merge_section, merges, sizeof(load_merge), merge_count);
+
+		for (unsigned int i = 0; i < merge_count; i++)
+		{
+			result += merges[i].pairs;
+		}
+
+		for (unsigned int i = 0; i < merge_count; i++)
+		{
+			if (merges[i].out_of_memory)
+			{
+				result = KB_NOMEM;
+			}
+		}
+	}
+
+	// Free the lists of entries, the entries themselves are in the sections now
+	for (unsigned int i = 0; i < chunk_count; i++)
+	{
+		free(chunks[i].entries);
+	}
+
+	free(chunks);
+
+	// The sections hold their own references on the file, let go of ours
+	mapping_release(mapping);
+
+	return result;
+}
+
+/*
+ * Parse the next line of a .ini file.
+ *
+ * Input:
+ *   data - the start of the line
+ *   end  - the end of the file (or of the part of it being parsed)
+ *   line - receives what the line holds (see ini_line)
+ *
+ * Returns: the start of the following line
+ */
+static const char* parse_ini_line(const char* data, const char* end, ini_line* line)
+{
+
+	// Find the end of the line (the last line may not end with a newline) and its first '=', in one pass
+	const char* equals = NULL;
+	const char* line_end = scan_line(data, end, &equals);
+
+	const char* next = line_end < end ? line_end + 1 : end;
+
+	// Ignore the carriage return of Windows line endings
+	if (line_end > data && line_end[-1] == '\r')
+	{
+		line_end--;
+	}
+
+	line->kind = INI_LINE_OTHER;
+
+	// If the line is a section, this indicates the start of a new section
+	if (data < line_end && data[0] == '[')
+	{
+		const char* close = memchr(data, ']', line_end - data);
+
+		// Ignore empty sections "[]" (and lines without a closing bracket)
+		if (close == NULL || close == data + 1)
+		{
+			return next;
+		}
+
+		// Copy the section key so that it can be looked up, too long to be a question word otherwise
+		char section_key_buffer[MAX_INTENT];
+		size_t section_key_len = close - data - 1;
+
+		line->kind = INI_LINE_SECTION;
+		line->section_id = -1;
+
+		if (section_key_len < MAX_INTENT)
+		{
+			memcpy(section_key_buffer, data + 1, section_key_len);
+			section_key_buffer[section_key_len] = '\0';
+
+			// Check to see if intent is recognized by our chatbot (one of KB_INTENTS)
+			line->section_id = section_index(section_key_buffer);
+		}
+
+		return next;
+	}
+
+	// Else, check if it is an entry "entity=description"
+	// Blank lines, lines without '=' and empty entries "=" are not entries
+	if (equals == NULL || equals == data)
+	{
+		return next;
+	}
+
+	line->kind = INI_LINE_ENTRY;
+	line->key = data;
+	line->key_len = equals - data;
+	line->value = equals + 1;
+	line->value_len = line_end - equals - 1;
+
+	return next;
+}
+
+/*
+ * Read a knowledge base from a mapped file, in this thread.
+ * This does the work of knowledge_read_mapped().
+ *
+ * Input:
+ *   mapping - the mapped file
+ *
+ * Returns: as knowledge_read_mapped()
+ */
+static int read_mapping(knowledge_base* kb, kb_mapping* mapping)
+{
+
+	// Initialize pairs counter
+	int pairs = 0;
+
+	// The section that entries are added to, NULL if the current section is not a valid one
+	ht* section = NULL;
+
+	// Walk through the file line by line
+	const char* data = mapping->data;
+	const char* end = data + mapping->size;
+	ini_line line;
+
+	while (data < end)
+	{
+		data = parse_ini_line(data, end, &line);
+
+		// The start of a new section
+		if (line.kind == INI_LINE_SECTION)
+		{
+
+			// Entries of sections that are not recognised are skipped
+			section = NULL;
+
+			if (line.section_id < 0)
+			{
+				continue;
+			}
+
+			// Create the section if it does not exist yet
+			section = section_ht_get(kb->sections, line.section_id);
+
+			if (section == NULL)
+			{
+				section = create_entity_ht();
+
+				if (section == NULL || !section_ht_set(kb->sections, line.section_id, section))
+				{
+					if (section != NULL)
+					{
+						unload_entity_ht(section);
+					}
+
+					return KB_NOMEM;
+				}
+			}
+
+			// The section's entries will point into the file, keep it mapped for as long as the section
+			if (!entity_ht_hold_mapping(section, mapping))
+			{
+				return KB_NOMEM;
+			}
+		}
+
+		// An entry in a valid section, point it at the entity and description in the file
+		else if (line.kind == INI_LINE_ENTRY && section != NULL)
+		{
+			if (entity_ht_set_view(section, line.key, line.key_len, line.value, line.value_len))
+			{
+				// Increment pair counter
+				pairs++;
+			}
+		}
+	}
+
+	return pairs;
+}
+
+/*
+ * Parse one chunk of a file for knowledge_read_parallel(), run on a thread of its own.
+ * The entries found are added to the chunk's list of entries, with their hashes worked out.
+ *
+ * Input:
+ *   arg - the chunk (load_chunk)
+ *
+ * Returns: NULL
+ */
+static void* load_parse_chunk(void* arg)
+{
+	load_chunk* chunk = arg;
+
+	// Until the first [section] of the chunk, entries belong to the section the previous chunk ended in
+	int section_id = LOAD_SECTION_INHERITED;
+
+	const char* data = chunk->start;
+	ini_line line;
+
+	while (data < chunk->end)
+	{
+		data = parse_ini_line(data, chunk->end, &line);
+
+		// The start of a new section (-1 if not recognised, its entries are skipped)
+		if (line.kind == INI_LINE_SECTION)
+		{
+			section_id = line.section_id;
+
+			if (section_id >= 0)
+			{
+				chunk->seen[section_id] = true;
+			}
+		}
+
+		// An entry, unless it is in a section that is not recognised
+		else if (line.kind == INI_LINE_ENTRY && section_id != -1)
+		{
+
+			// Make room in the list of entries, doubling its size when full
+			if (chunk->count == chunk->capacity)
+			{
+				size_t capacity = chunk->capacity == 0 ? 1024 : chunk->capacity * 2;
+				load_entry* entries = realloc(chunk->entries, capacity * sizeof(load_entry));
+
+				if (entries == NULL)
+				{
+					chunk->out_of_memory = true;
+					break;
+				}
+
+				chunk->entries = entries;
+				chunk->capacity = capacity;
+			}
+
+			load_entry* entry = &chunk->entries[chunk->count++];
+			entry->key = line.key;
+			entry->key_len = line.key_len;
+			entry->value = line.value;
+			entry->value_len = line.value_len;
+			entry->hash = key_hash_len(line.key, line.key_len);
+			entry->section_id = section_id;
+		}
+	}
+
+	chunk->last_section = section_id;
+	return NULL;
+}
+
+/*
+ * Add the entries of one section to it for knowledge_read_parallel(), run on a thread of its own.
+ * Entries are added in file order, so later ones replace earlier ones with the same key.
+ *
+ * Input:
+ *   arg - the section and the chunks to take its entries from (load_merge)
+ *
+ * Returns: NULL
+ */
+static void* load_merge_section(void* arg)
+{
+	load_merge* merge = arg;
+
+	for (unsigned int i = 0; i < merge->chunk_count; i++)
+	{
+		load_chunk* chunk = &merge->chunks[i];
+
+		for (size_t j = 0; j < chunk->count; j++)
+		{
+			load_entry* entry = &chunk->entries[j];
+			int section_id = entry->section_id == LOAD_SECTION_INHERITED ? chunk->first_section : entry->section_id;
+
+			// Only this section's entries
+			if (section_id != merge->section_id)
+			{
+				continue;
+			}
+
+			// Point the entry at the entity and description in the file, the hash is already known
+			if (entity_ht_insert(merge->section, entry->key, entry->key_len, entry->hash,
+				entry->value, entry->value_len, false))
+			{
+				merge->pairs++;
+			}
+			else
+			{
+				merge->out_of_memory = true;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Run a function on several threads at once, each with its own argument, and wait for them all.
+ * Where threads are not available (or cannot be started), the function is run in this thread instead.
+ *
+ * Input:
+ *   function - the function to run
+ *   args     - an array of arguments, one per thread
+ *   arg_size - the size of each argument in the array
+ *   count    - the number of threads
+ */
+static void load_run_threads(void* (*function)(void*), void* args, size_t arg_size, unsigned int count)
+{
+	char* arg = args;
+
+#ifdef KB_HAVE_THREADS
+	pthread_t threads[LOAD_MAX_THREADS];
+	bool started[LOAD_MAX_THREADS];
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		started[i] = pthread_create(&threads[i], NULL, function, arg + i * arg_size) == 0;
+
+		// Could not start a thread, do its work here
+		if (!started[i])
+		{
+			function(arg + i * arg_size);
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (started[i])
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+#else
+	for (unsigned int i = 0; i < count; i++)
+	{
+		function(arg + i * arg_size);
+	}
+#endif
+}
+
+/*
+ * Get the number of processors, i.e. the number of threads worth loading a file with.
+ *
+ * Returns: the number of processors online, or 1 if it is not known
+ */
+static unsigned int load_processor_count(void)
+{
+#ifdef KB_HAVE_THREADS
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (processors > 0)
+	{
+		return (unsigned int) processors;
+	}
+#endif
+
+	return 1;
+}
+
+/*
+ * Reset the knowledge base, removing all known entities from all intents.
+ */
+void kb_reset(knowledge_base* kb)
+{
+
+	// Learned answers no longer belong to the file that was loaded
+	kb_journal_close(kb);
+
+	/* Retire section hashtables. All pointers in sections hash table are set to NULL
+	straight away, the memory allocated is freed bit by bit on the following chatbot turns. */
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		section_write_lock(kb, i);
+	}
+
+	retire_section_ht(kb->sections, &kb->retired_sections);
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+#ifdef KB_HAVE_RCU
+		// Lookups without locks no longer find the sections either
+		if (kb->rcu != NULL)
+		{
+			rcu_replace(kb, i, NULL);
+		}
+#endif
+
+		section_unlock(kb, i);
+	}
+}
+
+/*
+ * Determine whether a knowledge base has no responses at all, e.g. before a file is loaded
+ * into it, to tell whether the file will be all that it holds.
+ *
+ * Returns:
+ *   1, if no section has any responses
+ *   0, otherwise
+ */
+int kb_is_empty(knowledge_base* kb)
+{
+	int empty = 1;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE && empty; i++)
+	{
+		section_read_lock(kb, i);
+
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section != NULL && (section->count > 0 || (section->frozen != NULL && section->frozen->count > 0)))
+		{
+			empty = 0;
+		}
+
+		section_unlock(kb, i);
+	}
+
+	return empty;
+}
+
+/*
+ * Freeze the knowledge base: compact every section into an immutable, read-optimized
+ * copy (see entity_ht_freeze()). knowledge_get() keeps working as before, and
+ * knowledge_put() still works too, its responses are kept aside until the next freeze.
+ *
+ * Returns:
+ *   KB_OK, if every section was frozen
+ *   KB_NOMEM, if there was a memory allocation failure (unfrozen sections still work as before)
+ */
+int kb_freeze(knowledge_base* kb)
+{
+	int result = KB_OK;
+
+	// Freeze every section that exists
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		section_write_lock(kb, i);
+
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section != NULL && !entity_ht_freeze(section))
+		{
+			result = KB_NOMEM;
+		}
+
+#ifdef KB_HAVE_RCU
+		// The frozen entries replace the published table, which is then empty again
+		if (section != NULL && kb->rcu != NULL && !rcu_publish(kb, i, section))
+		{
+			result = KB_NOMEM;
+		}
+#endif
+
+		section_unlock(kb, i);
+	}
+
+	return result;
+}
+
+/*
+ * Read a knowledge base from a binary snapshot file written by knowledge_write_binary().
+ *
+ * Every section is read with a single fread() straight into the memory of its frozen table,
+ * pointers are then set up into it. Nothing is parsed, hashed or allocated per entry.
+ * If a section already has entries, the entries from the file are added to it instead
+ * (replacing entries with the same key), which is slower.
+ *
+ * Input:
+ *   f - the file, opened in binary mode
+ *
+ * Returns:
+ *   the number of entity/response pairs read from the file,
+ *   KB_INVALID, if the file is not a valid snapshot (wrong version, truncated, or damaged)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_read_binary(knowledge_base* kb, FILE* f)
+{
+	kb_binary_header header;
+
+	// Check that this is a snapshot file that we can read
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, KB_BINARY_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != KB_BINARY_VERSION || header.byte_order != KB_BINARY_BYTE_ORDER)
+	{
+		return KB_INVALID;
+	}
+
+	// Allocate room to keep the sections until the checksum has been verified
+	kb_binary_section* records = calloc(header.section_count, sizeof(kb_binary_section));
+	frozen_ht** tables = calloc(header.section_count, sizeof(frozen_ht*));
+
+	if ((records == NULL || tables == NULL) && header.section_count != 0)
+	{
+		free(records);
+		free(tables);
+		return KB_NOMEM;
+	}
+
+	int result = 0;
+	uint32_t crc = 0;
+	uint32_t loaded = 0;
+
+	// Read every section
+	for (; loaded < header.section_count; loaded++)
+	{
+		kb_binary_section* record = &records[loaded];
+
+		if (fread(record, sizeof(kb_binary_section), 1, f) != 1)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		crc = crc32_update(crc, record, sizeof(kb_binary_section));
+
+		// The number of buckets must be a power of two
+		if (record->bucket_count == 0 || (record->bucket_count & (record->bucket_count - 1)) != 0)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		// Read the whole image of the frozen table at once
+		size_t image_size = frozen_ht_image_size(record->count, record->bucket_count, record->strings_size);
+		void* image = malloc(image_size);
+
+		if (image == NULL)
+		{
+			result = KB_NOMEM;
+			break;
+		}
+
+		if (fread(image, 1, image_size, f) != image_size)
+		{
+			free(image);
+			result = KB_INVALID;
+			break;
+		}
+
+		crc = crc32_update(crc, image, image_size);
+
+		// Point the frozen table into the image
+		tables[loaded] = create_frozen_ht(image, record->count, record->bucket_count, record->strings_size);
+
+		if (tables[loaded] == NULL)
+		{
+			free(image);
+			result = KB_NOMEM;
+			break;
+		}
+
+		/* The checksum only catches accidental damage, a file made to match it can still point anywhere.
+		Check every bucket position and string before the table is used. */
+		if (!binary_table_valid(tables[loaded]))
+		{
+			loaded++;
+			result = KB_INVALID;
+			break;
+		}
+	}
+
+	// The file must not have been changed since it was written
+	if (result == 0 && crc != header.checksum)
+	{
+		result = KB_INVALID;
+	}
+
+	// Add every section to the knowledge base
+	for (uint32_t i = 0; i < loaded; i++)
+	{
+
+		// Make sure the section key is terminated, and find its section
+		records[i].section_key[MAX_INTENT - 1] = '\0';
+		int section_id = section_index(records[i].section_key);
+
+		// Skip the section if something went wrong, or it is not a recognised question word
+		if (result < 0 || section_id < 0)
+		{
+			frozen_ht_free(tables[i]);
+			continue;
+		}
+
+		// Create the section if it does not exist yet
+		ht* section = section_ht_get(kb->sections, section_id);
+
+		if (section == NULL)
+		{
+			section = create_entity_ht();
+
+			if (section == NULL || !section_ht_set(kb->sections, section_id, section))
+			{
+				if (section != NULL)
+				{
+					unload_entity_ht(section);
+				}
+
+				frozen_ht_free(tables[i]);
+				result = KB_NOMEM;
+				continue;
+			}
+		}
+
+		// Give the frozen table to the section
+		int pairs = entity_ht_attach_frozen(section, tables[i]);
+
+		if (pairs < 0)
+		{
+			result = KB_NOMEM;
+			continue;
+		}
+
+		result += pairs;
+	}
+
+	free(records);
+	free(tables);
+
+	return result;
+}
+
+/*
+ * Write the knowledge base to a binary snapshot file, which knowledge_read_binary()
+ * can load much faster than a .ini file.
+ *
+ * The knowledge base is frozen first, then the image of each section's frozen table
+ * (hashes, bucket positions and packed strings) is written out as it is in memory.
+ *
+ * Input:
+ *   f - the file, opened in binary mode
+ *
+ * Returns:
+ *   KB_OK, if the file was written
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the file could not be written
+ */
+int kb_write_binary(knowledge_base* kb, FILE* f)
+{
+
+	// The snapshot holds the frozen tables, freeze whatever was set since the last freeze
+	if (kb_freeze(kb) != KB_OK)
+	{
+		return KB_NOMEM;
+	}
+
+	frozen_ht* tables[SECTION_TABLE_SIZE];
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		ht* section = section_ht_get(kb->sections, i);
+		tables[i] = section != NULL ? section->frozen : NULL;
+	}
+
+	return write_binary_tables(f, tables);
+}
+
+/*
+ * Write a binary snapshot file for knowledge_write_binary() from the frozen tables of the sections.
+ *
+ * Input:
+ *   f      - the file, opened in binary mode
+ *   tables - the frozen table of each section (by intent_id), NULL for sections that do not exist
+ *
+ * Returns:
+ *   KB_OK, if the file was written
+ *   KB_INVALID, if the file could not be written
+ */
+static int write_binary_tables(FILE* f, frozen_ht* const* tables)
+{
+
+	kb_binary_header header = { 0 };
+	kb_binary_section records[SECTION_TABLE_SIZE];
+	const frozen_ht* written[SECTION_TABLE_SIZE];
+
+	memcpy(header.magic, KB_BINARY_MAGIC, sizeof(header.magic));
+	header.version = KB_BINARY_VERSION;
+	header.byte_order = KB_BINARY_BYTE_ORDER;
+
+	// Describe every section, and work out the checksum
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		const frozen_ht* table = tables[i];
+
+		if (table == NULL)
+		{
+			continue;
+		}
+
+		kb_binary_section* record = &records[header.section_count];
+
+		memset(record, 0, sizeof(kb_binary_section));
+		strcpy(record->section_key, kb_intent_words[i]);
+		record->count = table->count;
+		record->bucket_count = table->bucket_count;
+		record->strings_size = table->strings_size;
+
+		header.checksum = crc32_update(header.checksum, record, sizeof(kb_binary_section));
+		header.checksum = crc32_update(header.checksum, table->image,
+			frozen_ht_image_size(table->count, table->bucket_count, table->strings_size));
+
+		written[header.section_count++] = table;
+	}
+
+	// Write the header, then each section followed by its image
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (uint32_t i = 0; i < header.section_count; i++)
+	{
+		fwrite(&records[i], sizeof(kb_binary_section), 1, f);
+		fwrite(written[i]->image, 1, frozen_ht_image_size(written[i]->count, written[i]->bucket_count,
+			written[i]->strings_size), f);
+	}
+
+	if (ferror(f))
+	{
+		return KB_INVALID;
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Work out the CRC-32 (as used by zip and PNG) of a block of memory, carrying on from
+ * the CRC of the blocks before it (start with 0). Eight bytes are handled per step
+ * using eight lookup tables, which are built on the first call.
+ *
+ * Input:
+ *   crc  - the CRC so far
+ *   data - the block of memory
+ *   size - the size of the block in bytes
+ *
+ * Returns: the CRC including the block
+ */
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t size)
+{
+
+	// Build the lookup tables the first time round
+	if (!crc32_initialized)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+
+			crc32_table[0][i] = c;
+		}
+
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			for (int t = 1; t < 8; t++)
+			{
+				crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xFF];
+			}
+		}
+
+		crc32_initialized = true;
+	}
+
+	const unsigned char* bytes = data;
+	crc = ~crc;
+
+	// Eight bytes at a time
+	while (size >= 8)
+	{
+		uint32_t low = crc ^ (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24));
+		uint32_t high = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t) bytes[7] << 24);
+
+		crc = crc32_table[7][low & 0xFF] ^ crc32_table[6][(low >> 8) & 0xFF]
+			^ crc32_table[5][(low >> 16) & 0xFF] ^ crc32_table[4][low >> 24]
+			^ crc32_table[3][high & 0xFF] ^ crc32_table[2][(high >> 8) & 0xFF]
+			^ crc32_table[1][(high >> 16) & 0xFF] ^ crc32_table[0][high >> 24];
+
+		bytes += 8;
+		size -= 8;
+	}
+
+	// Then the bytes left over
+	while (size > 0)
+	{
+		crc = crc32_table[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+
+	return ~crc;
+}
+
+/*
+ * Check that a frozen table read from a binary snapshot only points inside itself: the bucket
+ * positions go up from 0 to the number of entries, and the key and value of every entry lie within
+ * the strings, each followed by its null terminator.
+ *
+ * Returns: true if the table is safe to use, false if not
+ */
+static bool binary_table_valid(const frozen_ht* table)
+{
+
+	if (table->buckets[0] != 0 || table->buckets[table->bucket_count] != table->count)
+	{
+		return false;
+	}
+
+	for (uint32_t b = 0; b < table->bucket_count; b++)
+	{
+		if (table->buckets[b] > table->buckets[b + 1])
+		{
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < table->count; i++)
+	{
+		const frozen_entry* entry = &table->entries[i];
+
+		if (!binary_string_valid(table, entry->key_offset, entry->key_len)
+			|| !binary_string_valid(table, entry->value_offset, entry->value_len))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Check that a string of a frozen table read from a binary snapshot, len bytes from offset in its
+ * strings, lies within them and is followed by a null terminator.
+ */
+static bool binary_string_valid(const frozen_ht* table, uint32_t offset, uint32_t len)
+{
+	return (uint64_t) offset + len < table->strings_size && table->strings[(uint64_t) offset + len] == '\0';
+}
+
+/*
+ * Write the knowledge base to a file.
+ *
+ * The knowledge base is frozen first, then written by knowledge_write_frozen().
+ *
+ * Input:
+ *   f - the file
+ */
+void kb_write(knowledge_base* kb, FILE* f)
+{
+
+	frozen_ht* tables[SECTION_TABLE_SIZE];
+
+	if (kb_freeze(kb) == KB_OK)
+	{
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			ht* section = section_ht_get(kb->sections, i);
+			tables[i] = section != NULL ? section->frozen : NULL;
+		}
+
+		knowledge_write_frozen(f, tables, 0);
+		return;
+	}
+
+	// Could not freeze, write each entry as it is found instead
+	kb_writer writer;
+
+	if (!writer_open(&writer, f))
+	{
+		return;
+	}
+
+	// Write each section [who] [what] [where] with its entries
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section != NULL)
+		{
+			write_section(&writer, i, section);
+		}
+	}
+
+	writer_flush(&writer);
+	writer_close(&writer);
+}
+
+/*
+ * Write frozen tables to a file in .ini format, one section per table.
+ *
+ * The lines of each section are formatted on several threads at once, each copying the keys and
+ * descriptions of a run of entries into a buffer of its own (KB_SAVE_CHUNK bytes at a time). The
+ * buffers are then written to the file in order, so the file is the same whatever the number of threads.
+ *
+ * Input:
+ *   f       - the file
+ *   tables  - the frozen table of each section (by intent_id), NULL for sections that do not exist
+ *   threads - the number of threads to format with, 0 for KB_SAVE_THREADS
+ *
+ * Returns:
+ *   KB_OK, if the file was written
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_write_frozen(FILE* f, frozen_ht* const* tables, unsigned int threads)
+{
+
+	kb_writer writer;
+
+	if (!writer_open(&writer, f))
+	{
+		return KB_NOMEM;
+	}
+
+	threads = save_thread_count(threads);
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		if (tables[i] != NULL)
+		{
+			write_frozen_section(&writer, i, tables[i], threads);
+		}
+	}
+
+	writer_flush(&writer);
+	writer_close(&writer);
+
+	return writer.failed ? KB_INVALID : KB_OK;
+}
+
+/*
+ * Save the knowledge base to a file: a binary snapshot (see knowledge_write_binary()) if its
+ * name ends with .bin, else a .ini file, writing again only the sections that have changed.
+ *
+ * The file is written under a temporary name that is then renamed over the old file, so it is
+ * never left half written. Where each section of a .ini file was written is remembered (see
+ * kb_saved_section). Saving to the same file again then copies the bytes of every section that
+ * has not been set since (see ht.dirty) from the old file as they are, and only formats the
+ * sections that have changed. If the old file has been changed by something else in the meantime
+ * (its size or a section's checksum do not match), every section is written again instead.
+ *
+ * Waits for a save started by knowledge_save_background() to finish first.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   rewritten - receives the number of sections that were written again rather than copied (may be NULL)
+ *
+ * Returns:
+ *   KB_OK, if the knowledge base was saved
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_save(knowledge_base* kb, const char* file_name, int* rewritten)
+{
+
+	background_save_join(kb, true);
+
+	kb_save_job* job = save_job_create(kb, file_name);
+
+	if (job == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	save_job_run(job);
+
+	int result = save_job_finish(kb, job);
+
+	if (result == KB_OK && rewritten != NULL)
+	{
+		*rewritten = job->rewritten;
+	}
+
+	save_job_free(job);
+	return result;
+}
+
+/*
+ * Start saving the knowledge base to a file in the same way as knowledge_save(), on a thread
+ * of its own, and return straight away.
+ *
+ * What is saved is the knowledge base as it is now: every section is frozen (see knowledge_freeze())
+ * and the thread writes out the frozen tables, which are never changed. Anything set while it is
+ * writing goes outside of them, and is left for the next save. Only one save is written at a time,
+ * a save that is still running is waited for first.
+ *
+ * Where threads are not available, the file is written before returning. Either way, how the save
+ * went is found out with knowledge_save_poll().
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns:
+ *   KB_OK, if the save was started
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is saved)
+ */
+int kb_save_background(knowledge_base* kb, const char* file_name)
+{
+
+	background_save_join(kb, true);
+
+	kb_save_job* job = save_job_create(kb, file_name);
+
+	if (job == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	save_job_start(kb, job);
+	return KB_OK;
+}
+
+/*
+ * Find out whether a save started by knowledge_save_background() has finished.
+ *
+ * Input:
+ *   wait      - true to wait for a save that is still running to finish
+ *   file_name - a buffer to receive the name of the file that was saved
+ *   n         - the size of the file name buffer
+ *   rewritten - receives the number of sections that were written rather than copied (may be NULL)
+ *
+ * Returns:
+ *   KB_NOTFOUND, if no save has finished since the last call (none was started, or it is still running)
+ *   (call it again until it returns KB_NOTFOUND to hear about every save that has finished)
+ *   KB_OK, if the knowledge base was saved
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_save_poll(knowledge_base* kb, int wait, char* file_name, int n, int* rewritten)
+{
+
+	// A save that finished earlier is reported before the one running now
+	if (kb->finished_save == NULL)
+	{
+		background_save_join(kb, wait);
+	}
+
+	if (kb->finished_save == NULL)
+	{
+		return KB_NOTFOUND;
+	}
+
+	snprintf(file_name, n, "%s", kb->finished_save->file_name);
+
+	if (rewritten != NULL)
+	{
+		*rewritten = kb->finished_save->rewritten;
+	}
+
+	int result = kb->finished_save->result;
+
+	save_job_free(kb->finished_save);
+	kb->finished_save = NULL;
+
+	return result;
+}
+
+/*
+ * Take a snapshot of the knowledge base to be saved to a file by save_job_run().
+ *
+ * Every section is frozen, and its frozen table held on to until save_job_finish(). The sections
+ * are marked as not dirty, since the file will hold them as they are now.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns: the snapshot, or NULL if there was a memory allocation failure
+ */
+static kb_save_job* save_job_create(knowledge_base* kb, const char* file_name)
+{
+
+	// Everything set so far goes into the frozen tables, anything set from now on is kept outside of them
+	if (kb_freeze(kb) != KB_OK)
+	{
+		return NULL;
+	}
+
+	kb_save_job* job = save_job_alloc(file_name);
+
+	if (job == NULL)
+	{
+		return NULL;
+	}
+
+	// Sections can only be copied from the .ini file saved last
+	if (!job->binary && kb->saved_file_name != NULL && strcmp(kb->saved_file_name, file_name) == 0)
+	{
+		job->copy_old = true;
+		memcpy(job->old_sections, kb->saved_sections, sizeof(kb->saved_sections));
+		job->old_size = kb->saved_file_size;
+	}
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		ht* section = section_ht_get(kb->sections, i);
+
+		if (section == NULL)
+		{
+			continue;
+		}
+
+		job->tables[i] = frozen_ht_hold(section->frozen);
+
+		// The dirty flags tell what has changed since the last .ini file, which this will be
+		if (!job->binary)
+		{
+			job->dirty[i] = section->dirty;
+			section->dirty = false;
+		}
+	}
+
+	return job;
+}
+
+/*
+ * Allocate a job for save_job_run() that writes a file, with nothing in it to write yet.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns: the job, or NULL if there was a memory allocation failure
+ */
+static kb_save_job* save_job_alloc(const char* file_name)
+{
+
+	kb_save_job* job = calloc(1, sizeof(kb_save_job));
+
+	if (job != NULL)
+	{
+		job->file_name = malloc(strlen(file_name) + 1);
+	}
+
+	if (job == NULL || job->file_name == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		free(job);
+		return NULL;
+	}
+
+	strcpy(job->file_name, file_name);
+
+	const char* extension = strrchr(file_name, '.');
+
+	job->binary = extension != NULL && compare_token(extension, ".bin") == 0;
+	job->threads = save_thread_count(0);
+	job->result = KB_INVALID;
+
+	// Build the checksum tables now, rather than on the thread writing the file
+	crc32_update(0, NULL, 0);
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_init(&job->lock, NULL);
+#endif
+
+	return job;
+}
+
+/*
+ * Start writing the file of a job on a thread of its own, as the save running in the background
+ * (see background_save_join()). Where threads are not available, it is written now instead.
+ *
+ * Input:
+ *   job - the job, which must be the only one running
+ */
+static void save_job_start(knowledge_base* kb, kb_save_job* job)
+{
+
+#ifdef KB_HAVE_THREADS
+	if (pthread_create(&job->thread, NULL, save_job_run, job) == 0)
+	{
+		kb->background_save = job;
+		return;
+	}
+#endif
+
+	// No thread to write it on, write it now instead
+	save_job_run(job);
+	save_job_done(kb, job);
+}
+
+/*
+ * Write a snapshot taken by save_job_create() to its file. It only reads the snapshot, so it may
+ * run on a thread of its own (see knowledge_save_background()).
+ *
+ * Input:
+ *   arg - the snapshot (kb_save_job), whose result is set
+ *
+ * Returns: NULL
+ */
+static void* save_job_run(void* arg)
+{
+
+	kb_save_job* job = arg;
+	char* temp_name = NULL;
+	FILE* f = temp_file_open(job->file_name, "wb", &temp_name);
+	int result = KB_INVALID;
+
+	if (f != NULL && job->journal_name != NULL)
+	{
+		result = journal_fold(f, job);
+	}
+
+	else if (f != NULL && job->binary)
+	{
+		result = write_binary_tables(f, job->tables);
+
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			job->rewritten += job->tables[i] != NULL;
+		}
+	}
+
+	else if (f != NULL)
+	{
+
+		// Sections can only be copied from the file saved last, if nothing else has changed its size since
+		FILE* old = job->copy_old ? fopen(job->file_name, "rb") : NULL;
+
+		if (old != NULL && (fseek(old, 0, SEEK_END) != 0 || ftell(old) != job->old_size))
+		{
+			fclose(old);
+			old = NULL;
+		}
+
+		result = save_sections(f, old, job);
+
+		// A section of the old file did not match, start again without copying anything from it
+		if (result == KB_NOTFOUND)
+		{
+			fclose(old);
+			old = NULL;
+
+			f = freopen(temp_name, "wb", f);
+			result = f != NULL ? save_sections(f, NULL, job) : KB_INVALID;
+
+			if (f == NULL)
+			{
+				remove(temp_name);
+				free(temp_name);
+			}
+		}
+
+		if (old != NULL)
+		{
+			fclose(old);
+		}
+	}
+
+	if (f != NULL)
+	{
+		result = temp_file_commit(f, temp_name, job->file_name, result);
+	}
+
+	job->result = result;
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	pthread_mutex_unlock(&job->lock);
+#endif
+
+	return NULL;
+}
+
+/*
+ * Finish a snapshot once save_job_run() has written it: let go of its frozen tables, and remember
+ * where the sections of a .ini file were written. If the file could not be written, the sections
+ * that had changed are marked as dirty again.
+ *
+ * Input:
+ *   job - the snapshot
+ *
+ * Returns: the result of the save (as for knowledge_save())
+ */
+static int save_job_finish(knowledge_base* kb, kb_save_job* job)
+{
+
+	for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+	{
+		frozen_ht_free(job->tables[i]);
+		job->tables[i] = NULL;
+	}
+
+	if (job->binary)
+	{
+		return job->result;
+	}
+
+	// A checkpoint of the journal only added lines to the end of the .ini file, its sections are where they were
+	if (job->journal_name != NULL)
+	{
+		if (job->result == KB_OK && kb->saved_file_name != NULL && strcmp(kb->saved_file_name, job->file_name) == 0)
+		{
+			kb->saved_file_size = job->file_size;
+		}
+
+		return job->result;
+	}
+
+	if (job->result != KB_OK)
+	{
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			ht* section = section_ht_get(kb->sections, i);
+
+			if (section != NULL && job->dirty[i])
+			{
+				section->dirty = true;
+			}
+		}
+
+		return job->result;
+	}
+
+	// Remember where the sections are in the file
+	char* name_copy = malloc(strlen(job->file_name) + 1);
+
+	free(kb->saved_file_name);
+	kb->saved_file_name = name_copy;
+
+	if (name_copy != NULL)
+	{
+		strcpy(name_copy, job->file_name);
+		memcpy(kb->saved_sections, job->saved, sizeof(kb->saved_sections));
+		kb->saved_file_size = 0;
+
+		for (int i = 0; i < SECTION_TABLE_SIZE; i++)
+		{
+			if (job->saved[i].saved)
+			{
+				kb->saved_file_size = job->saved[i].offset + job->saved[i].size;
+			}
+		}
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Finish a job that was written in the background: a save is kept for knowledge_save_poll() to
+ * report, and a checkpoint of the journal empties the journal (see journal_checkpoint_finish()).
+ *
+ * Input:
+ *   job - the job, which has been written (freed here, or kept as kb->finished_save)
+ */
+static void save_job_done(knowledge_base* kb, kb_save_job* job)
+{
+
+	save_job_finish(kb, job);
+
+	if (job->checkpoint)
+	{
+		journal_checkpoint_finish(kb, job);
+		save_job_free(job);
+		return;
+	}
+
+	save_job_free(kb->finished_save);
+	kb->finished_save = job;
+}
+
+// Frees a snapshot after save_job_finish() (does nothing if NULL)
+static void save_job_free(kb_save_job* job)
+{
+	if (job == NULL)
+	{
+		return;
+	}
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_destroy(&job->lock);
+#endif
+
+	free(job->file_name);
+	free(job->journal_name);
+	free(job);
+}
+
+/*
+ * Finish the save started by knowledge_save_background() (or the checkpoint started by
+ * knowledge_journal_checkpoint()), if it has been written, so that knowledge_save_poll() can report it.
+ *
+ * Input:
+ *   wait - true to wait for it if it is still being written
+ */
+static void background_save_join(knowledge_base* kb, bool wait)
+{
+
+#ifdef KB_HAVE_THREADS
+	kb_save_job* job = kb->background_save;
+
+	if (job == NULL)
+	{
+		return;
+	}
+
+	if (!wait)
+	{
+		pthread_mutex_lock(&job->lock);
+		bool done = job->done;
+		pthread_mutex_unlock(&job->lock);
+
+		if (!done)
+		{
+			return;
+		}
+	}
+
+	// It is no longer running once joined, finishing it may close the journal (which joins it)
+	kb->background_save = NULL;
+
+	pthread_join(job->thread, NULL);
+	save_job_done(kb, job);
+#endif
+}
+
+/*
+ * Write every section to a new .ini file for save_job_run(), copying the ones that have not
+ * changed from the old file.
+ *
+ * Input:
+ *   f   - the new file, at its start
+ *   old - the file saved last (saved_file_name), NULL to write every section
+ *   job - the snapshot, which receives where each section was written and how many were written rather than copied
+ *
+ * Returns:
+ *   KB_OK, if every section was written
+ *   KB_NOTFOUND, if a section copied from the old file did not match its checksum
+ *   KB_INVALID, if the file could not be written (or the old file could not be read)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int save_sections(FILE* f, FILE* old, kb_save_job* job)
+{
+
+	kb_writer writer;
+
+	if (!writer_open(&writer, f))
+	{
+		return KB_NOMEM;
+	}
+
+	kb_saved_section* saved = job->saved;
+	const kb_saved_section* old_sections = job->old_sections;
+
+	job->rewritten = 0;
+	int result = KB_OK;
+
+	for (int i = 0; i < SECTION_TABLE_SIZE && result == KB_OK; i++)
+	{
+		const frozen_ht* table = job->tables[i];
+
+		saved[i].saved = table != NULL;
+
+		if (table == NULL)
+		{
+			continue;
+		}
+
+		saved[i].offset = writer.offset;
+		writer.checksum = 0;
+
+		// Copy a section that has not changed from the old file
+		if (old != NULL && !job->dirty[i] && old_sections[i].saved)
+		{
+			if (fseek(old, old_sections[i].offset, SEEK_SET) != 0)
+			{
+				result = KB_INVALID;
+				break;
+			}
+
+			long left = old_sections[i].size;
+
+			while (left > 0 && !writer.failed)
+			{
+				size_t block = left < KB_WRITE_BLOCK ? (size_t) left : KB_WRITE_BLOCK;
+
+				if (writer.used + block > KB_WRITE_BLOCK)
+				{
+					writer_flush(&writer);
+				}
+
+				if (fread(writer.buffer + writer.used, 1, block, old) != block)
+				{
+					result = KB_NOTFOUND;
+					break;
+				}
+
+				// The bytes are already in the buffer, only the checksum and the position need updating
+				writer.checksum = crc32_update(writer.checksum, writer.buffer + writer.used, block);
+				writer.used += block;
+				writer.offset += (long) block;
+				left -= (long) block;
+			}
+
+			if (result == KB_OK && writer.checksum != old_sections[i].checksum)
+			{
+				result = KB_NOTFOUND;
+			}
+		}
+
+		// Else, write the section out again
+		else
+		{
+			write_frozen_section(&writer, i, table, job->threads);
+			job->rewritten++;
+		}
+
+		saved[i].size = writer.offset - saved[i].offset;
+		saved[i].checksum = writer.checksum;
+	}
+
+	writer_flush(&writer);
+
+	if (result == KB_OK && writer.failed)
+	{
+		result = KB_INVALID;
+	}
+
+	writer_close(&writer);
+	return result;
+}
+
+/*
+ * Write a section in .ini format: its [section] line, each entry on a line of its own, then a blank line.
+ *
+ * Input:
+ *   writer     - where to write it
+ *   section_id - the section (its intent_id)
+ *   section    - the section's entity hash table
+ */
+static void write_section(kb_writer* writer, int section_id, ht* section)
+{
+
+	// Add the section key [who] etc to the file
+	writer_put(writer, "[", 1);
+	writer_put(writer, kb_intent_words[section_id], strlen(kb_intent_words[section_id]));
+	writer_put(writer, "]\n", 2);
+
+	// Iterate through the entity hashtable
+	entity_iter iter;
+	entity_iter_init(&iter, section);
+
+	node* entry;
+	while ((entry = entity_iter_next(&iter)) != NULL)
+	{
+		// Add the entity key and description value to the file
+		writer_put(writer, entry->entity_key, entry->key_len);
+		writer_put(writer, "=", 1);
+		writer_put(writer, entry->description_value, entry->value_len);
+		writer_put(writer, "\n", 1);
+	}
+
+	writer_put(writer, "\n", 1);
+}
+
+/*
+ * Write a section in .ini format from its frozen table, as write_section() does.
+ *
+ * The entries are split into runs of about KB_SAVE_CHUNK bytes of lines. Each round, one run per
+ * thread is formatted into the thread's buffer (see save_format_chunk()), then the buffers are
+ * written in order.
+ *
+ * Input:
+ *   writer     - where to write it
+ *   section_id - the section (its intent_id)
+ *   table      - the section's frozen table
+ *   threads    - the number of threads to format with
+ */
+static void write_frozen_section(kb_writer* writer, int section_id, const frozen_ht* table, unsigned int threads)
+{
+
+	writer_put(writer, "[", 1);
+	writer_put(writer, kb_intent_words[section_id], strlen(kb_intent_words[section_id]));
+	writer_put(writer, "]\n", 2);
+
+	save_chunk chunks[LOAD_MAX_THREADS];
+	memset(chunks, 0, sizeof(chunks));
+
+	uint32_t next = 0;
+
+	while (next < table->count && !writer->failed)
+	{
+
+		// Give each thread the next run of entries, and make sure its buffer fits their lines
+		unsigned int used = 0;
+
+		while (used < threads && next < table->count)
+		{
+			save_chunk* chunk = &chunks[used++];
+			size_t size = 0;
+
+			chunk->table = table;
+			chunk->first = next;
+
+			do
+			{
+				size += (size_t) table->entries[next].key_len + table->entries[next].value_len + 2;
+				next++;
+			} while (next < table->count && size + table->entries[next].key_len
+				+ table->entries[next].value_len + 2 <= KB_SAVE_CHUNK);
+
+			chunk->end = next;
+			chunk->size = size;
+
+			if (size > chunk->capacity)
+			{
+				char* buffer = realloc(chunk->buffer, size);
+
+				if (buffer == NULL)
+				{
+					printf("Ran out of memory.\nNo memory is allocated.\n");
+					writer->failed = true;
+					break;
+				}
+
+				chunk->buffer = buffer;
+				chunk->capacity = size;
+			}
+		}
+
+		if (writer->failed)
+		{
+			break;
+		}
+
+		// Only start threads when there is more than one run to format
+		if (used == 1)
+		{
+			save_format_chunk(&chunks[0]);
+		}
+		else
+		{
+			load_run_threads(save_format_chunk, chunks, sizeof(save_chunk), used);
+		}
+
+		for (unsigned int i = 0; i < used; i++)
+		{
+			writer_write(writer, chunks[i].buffer, chunks[i].size);
+		}
+	}
+
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		free(chunks[i].buffer);
+	}
+
+	writer_put(writer, "\n", 1);
+}
+
+/*
+ * Format a run of entries of a frozen table as .ini lines for write_frozen_section(), by
+ * copying each key and description into the chunk's buffer (which is big enough for them).
+ *
+ * Input:
+ *   arg - the chunk (save_chunk)
+ *
+ * Returns: NULL
+ */
+static void* save_format_chunk(void* arg)
+{
+
+	save_chunk* chunk = arg;
+	const frozen_ht* table = chunk->table;
+	char* out = chunk->buffer;
+
+	for (uint32_t i = chunk->first; i < chunk->end; i++)
+	{
+		const frozen_entry* entry = &table->entries[i];
+
+		memcpy(out, table->strings + entry->key_offset, entry->key_len);
+		out += entry->key_len;
+		*out++ = '=';
+
+		memcpy(out, table->strings + entry->value_offset, entry->value_len);
+		out += entry->value_len;
+		*out++ = '\n';
+	}
+
+	return NULL;
+}
+
+/*
+ * Work out the number of threads to format a file with.
+ *
+ * Input:
+ *   threads - the number asked for, 0 for KB_SAVE_THREADS (which is 0 for one per processor)
+ *
+ * Returns: the number of threads, from 1 to LOAD_MAX_THREADS
+ */
+static unsigned int save_thread_count(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		threads = KB_SAVE_THREADS != 0 ? KB_SAVE_THREADS : load_processor_count();
+	}
+
+	return threads > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : threads;
+}
+
+/*
+ * Start writing to a file through a kb_writer.
+ *
+ * Input:
+ *   writer - the writer
+ *   f      - the file
+ *
+ * Returns: true, or false if there was a memory allocation failure
+ */
+static bool writer_open(kb_writer* writer, FILE* f)
+{
+	writer->f = f;
+	writer->buffer = malloc(KB_WRITE_BLOCK);
+	writer->used = 0;
+	writer->offset = 0;
+	writer->checksum = 0;
+	writer->failed = false;
+
+	if (writer->buffer == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Add bytes to a file through a kb_writer. They are written once the buffer is full.
+ *
+ * Input:
+ *   writer - the writer
+ *   data   - the bytes to write
+ *   size   - the number of bytes
+ */
+static void writer_put(kb_writer* writer, const char* data, size_t size)
+{
+	writer->checksum = crc32_update(writer->checksum, data, size);
+	writer->offset += (long) size;
+
+	while (size > 0)
+	{
+		if (writer->used == KB_WRITE_BLOCK)
+		{
+			writer_flush(writer);
+		}
+
+		size_t part = KB_WRITE_BLOCK - writer->used;
+
+		if (part > size)
+		{
+			part = size;
+		}
+
+		memcpy(writer->buffer + writer->used, data, part);
+		writer->used += part;
+		data += part;
+		size -= part;
+	}
+}
+
+/*
+ * Write a block of bytes to a file through a kb_writer, straight from where they are rather than
+ * copying them into its buffer first (what is already in the buffer is written before them).
+ *
+ * Input:
+ *   writer - the writer
+ *   data   - the bytes to write
+ *   size   - the number of bytes
+ */
+static void writer_write(kb_writer* writer, const char* data, size_t size)
+{
+	writer_flush(writer);
+
+	writer->checksum = crc32_update(writer->checksum, data, size);
+	writer->offset += (long) size;
+
+	if (size > 0 && fwrite(data, 1, size, writer->f) != size)
+	{
+		writer->failed = true;
+	}
+}
+
+// Writes whatever is in the buffer of a kb_writer to its file
+static void writer_flush(kb_writer* writer)
+{
+	if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->f) != writer->used)
+	{
+		writer->failed = true;
+	}
+
+	writer->used = 0;
+}
+
+// Frees the buffer of a kb_writer (flush it first, the file is left open)
+static void writer_close(kb_writer* writer)
+{
+	free(writer->buffer);
+	writer->buffer = NULL;
+}
+
+/*
+ * Open a file to replace another one with, under a temporary name (the file name followed by
+ * KB_TEMP_SUFFIX). It takes the other file's place in temp_file_commit().
+ *
+ * Input:
+ *   file_name - the name of the file to be replaced
+ *   mode      - the mode to open the file in (as for fopen())
+ *   temp_name - receives the temporary name, to be given to temp_file_commit()
+ *
+ * Returns: the file, or NULL if it could not be opened (nothing needs to be freed then)
+ */
+static FILE* temp_file_open(const char* file_name, const char* mode, char** temp_name)
+{
+	*temp_name = malloc(strlen(file_name) + sizeof(KB_TEMP_SUFFIX));
+
+	if (*temp_name == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return NULL;
+	}
+
+	sprintf(*temp_name, "%s%s", file_name, KB_TEMP_SUFFIX);
+
+	FILE* f = fopen(*temp_name, mode);
+
+	if (f == NULL)
+	{
+		free(*temp_name);
+		*temp_name = NULL;
+	}
+
+	return f;
+}
+
+/*
+ * Finish a file opened by temp_file_open(): make sure it is on the disk, close it, and rename it
+ * over the file it replaces. The old file is left as it was if anything fails.
+ *
+ * Input:
+ *   f         - the file
+ *   temp_name - its temporary name (freed here)
+ *   file_name - the name of the file it replaces
+ *   result    - KB_OK if everything was written to the file, else the error to return
+ *
+ * Returns: KB_OK if the file was replaced, else result or KB_INVALID
+ */
+static int temp_file_commit(FILE* f, char* temp_name, const char* file_name, int result)
+{
+	if (fflush(f) != 0 || ferror(f))
+	{
+		result = result == KB_OK ? KB_INVALID : result;
+	}
+
+#ifdef KB_HAVE_FSYNC
+	// The new file must be on the disk before it takes the old one's place
+	if (result == KB_OK && fsync(fileno(f)) != 0)
+	{
+		result = KB_INVALID;
+	}
+#endif
+
+	if (fclose(f) != 0 && result == KB_OK)
+	{
+		result = KB_INVALID;
+	}
+
+#ifndef KB_HAVE_FSYNC
+	// rename() only replaces an existing file on POSIX systems
+	if (result == KB_OK)
+	{
+		remove(file_name);
+	}
+#endif
+
+	if (result == KB_OK && rename(temp_name, file_name) != 0)
+	{
+		result = KB_INVALID;
+	}
+
+	if (result != KB_OK)
+	{
+		remove(temp_name);
+	}
+
+	free(temp_name);
+	return result;
+}
+
+/*
+ * Start writing learned answers to the journal of a knowledge base file, after replaying it.
+ *
+ * The file must be all that the knowledge base holds (it was empty before the file was loaded,
+ * see kb_is_empty()): a checkpoint writes the whole knowledge base over the file, so responses from
+ * any other file would end up in it.
+ *
+ * The journal of a file is the file name followed by KB_JOURNAL_SUFFIX. Every response that
+ * knowledge_put() adds from then on is written to it as a small record (see kb_journal_record),
+ * and the records of a chatbot turn are written together by knowledge_journal_commit(). Loading
+ * the same file again replays those records over it, so learned answers survive a crash or an
+ * exit without saving, without rewriting the whole file after each one.
+ *
+ * A record that was only partly written (e.g. the chatbot was killed while writing it) fails its
+ * checksum; it and anything after it are dropped from the journal.
+ *
+ * Input:
+ *   file_name - the name of the knowledge base file that has just been loaded
+ *
+ * Returns:
+ *   the number of learned responses replayed from the journal
+ *   KB_INVALID, if the journal could not be opened or is not a journal file (nothing is written to it)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_journal_open(knowledge_base* kb, const char* file_name)
+{
+
+	// Finish with the journal of any file loaded before
+	kb_journal_close(kb);
+
+	kb->journal_base_name = malloc(strlen(file_name) + 1);
+	kb->journal_name = malloc(strlen(file_name) + sizeof(KB_JOURNAL_SUFFIX));
+
+	if (kb->journal_base_name == NULL || kb->journal_name == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		kb_journal_close(kb);
+		return KB_NOMEM;
+	}
+
+	strcpy(kb->journal_base_name, file_name);
+	sprintf(kb->journal_name, "%s%s", file_name, KB_JOURNAL_SUFFIX);
+
+	// Open the journal if there is one already, else start a new one
+	FILE* f = fopen(kb->journal_name, "r+b");
+
+	if (f == NULL)
+	{
+		f = fopen(kb->journal_name, "w+b");
+	}
+
+	if (f == NULL)
+	{
+		kb_journal_close(kb);
+		return KB_INVALID;
+	}
+
+	int replayed = journal_replay(kb, f);
+
+	if (replayed < 0)
+	{
+		fclose(f);
+		kb_journal_close(kb);
+		return replayed;
+	}
+
+	kb->journal = f;
+
+	// A journal left long by an earlier run is folded into the file straight away
+	if (journal_checkpoint_due(kb))
+	{
+		kb_journal_checkpoint(kb);
+	}
+
+	return replayed;
+}
+
+/*
+ * Write the learned answers of this chatbot turn to the journal (group commit).
+ *
+ * knowledge_put() only adds its record to a buffer; this writes all of them in one go and
+ * waits for them to reach the disk, once per chatbot turn instead of once per answer.
+ *
+ * If they cannot all be written, the journal is cut back to where it ended before, so that no
+ * part of a record is left in it for later records to follow (replaying stops at the first
+ * damaged record). The records stay in the buffer, and are written again by the next commit.
+ *
+ * Returns:
+ *   KB_OK, if the records were written (or there was nothing to write)
+ *   KB_INVALID, if they could not be written (they are kept for the next commit)
+ */
+int kb_journal_commit(knowledge_base* kb)
+{
+
+	int result = journal_write(kb);
+
+	// Finish a checkpoint that has been written, it leaves the journal short again
+	background_save_join(kb, false);
+
+	// Once the journal is long enough, fold it into the file so that replaying it stays quick
+	if (result == KB_OK && journal_checkpoint_due(kb))
+	{
+		return kb_journal_checkpoint(kb);
+	}
+
+	return result == KB_NOTFOUND ? KB_OK : result;
+}
+
+/*
+ * Write the records waiting in the buffer to the journal, for knowledge_journal_commit() (which
+ * describes how) and knowledge_journal_close(). The journal is never checkpointed here.
+ *
+ * Returns:
+ *   KB_OK, if the records were written
+ *   KB_NOTFOUND, if there were none to write (or there is no journal)
+ *   KB_INVALID, if they could not be written (they are kept for the next commit)
+ */
+static int journal_write(knowledge_base* kb)
+{
+
+	// Puts on other threads wait to add their records until these are written (in concurrent mode)
+	journal_lock(kb);
+
+	if (kb->journal == NULL || kb->journal_pending_size == 0)
+	{
+		journal_unlock(kb);
+		return KB_NOTFOUND;
+	}
+
+	size_t size = kb->journal_pending_size;
+	bool written = fwrite(kb->journal_pending, 1, size, kb->journal) == size && fflush(kb->journal) == 0;
+
+#ifdef KB_HAVE_FSYNC
+	// Make sure the records are on the disk, not only in the system's cache
+	written = written && fsync(fileno(kb->journal)) == 0;
+#endif
+
+	if (!written)
+	{
+		// Take back whatever part of the records did get written, they are written again next time
+		clearerr(kb->journal);
+#ifdef KB_HAVE_FSYNC
+		fflush(kb->journal);
+		if (ftruncate(fileno(kb->journal), kb->journal_size) != 0)
+		{
+			// Still safe: the same records, at least as long, are written over the partial one next time
+			clearerr(kb->journal);
+		}
+#endif
+		fseek(kb->journal, kb->journal_size, SEEK_SET);
+
+		journal_unlock(kb);
+		printf("Could not write learned answers to the journal, they will be written again after the next input.\n");
+		return KB_INVALID;
+	}
+
+	kb->journal_records += kb->journal_pending_records;
+	kb->journal_size += (long) size;
+	kb->journal_pending_size = 0;
+	kb->journal_pending_records = 0;
+	journal_unlock(kb);
+
+	return KB_OK;
+}
+
+/*
+ * Start checkpointing the journal: write the learned answers in it into the file the journal
+ * belongs to, on a thread of its own (as knowledge_save_background() does), and empty the journal
+ * once that is done (see journal_checkpoint_finish()).
+ *
+ * This is done by knowledge_journal_commit() once the journal holds KB_JOURNAL_CHECKPOINT_RECORDS
+ * records or KB_JOURNAL_CHECKPOINT_BYTES bytes, so that loading the file never has more than that
+ * to replay. A .ini file is copied with the records added to its end as lines (see journal_fold()),
+ * so nothing is frozen and sections mapped by knowledge_read_mapped() stay mapped; a .bin file is
+ * written again from a snapshot, as knowledge_save() does. Either way the file is written under a
+ * temporary name and renamed over the old one, so it is never left half written. If the chatbot
+ * stops before the journal is emptied, the records are replayed over a file that already has them,
+ * which changes nothing.
+ *
+ * Only the records in the journal now are checkpointed; records written while the file is being
+ * written are kept in the journal. Only one file is written at a time: if a save or a checkpoint
+ * is still running, nothing is started, and the checkpoint is tried again after the next commit.
+ *
+ * Returns:
+ *   KB_OK, if the checkpoint was started (or there is no journal, or another file is being written)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_journal_checkpoint(knowledge_base* kb)
+{
+
+	// Finish a save or checkpoint that has been written since the last call
+	background_save_join(kb, false);
+
+	if (kb->journal == NULL || kb->background_save != NULL)
+	{
+		return KB_OK;
+	}
+
+	// Puts on other threads (in concurrent mode) may be writing records, only the ones written so far go in
+	journal_lock(kb);
+	long mark = kb->journal_size;
+	unsigned long mark_records = kb->journal_records;
+	journal_unlock(kb);
+
+	const char* extension = strrchr(kb->journal_base_name, '.');
+	kb_save_job* job;
+
+	// A .bin file can only be written whole, from frozen tables (its sections were frozen when it was read)
+	if (extension != NULL && compare_token(extension, ".bin") == 0)
+	{
+		job = save_job_create(kb, kb->journal_base_name);
+	}
+
+	// A .ini file has the records added to it, reading them from the journal
+	else
+	{
+		job = save_job_alloc(kb->journal_base_name);
+
+		if (job != NULL)
+		{
+			job->journal_name = malloc(strlen(kb->journal_name) + 1);
+
+			if (job->journal_name == NULL)
+			{
+				printf("Ran out of memory.\nNo memory is allocated.\n");
+				save_job_free(job);
+				job = NULL;
+			}
+			else
+			{
+				strcpy(job->journal_name, kb->journal_name);
+			}
+		}
+	}
+
+	if (job == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	job->checkpoint = true;
+	job->journal_mark = mark;
+	job->journal_mark_records = mark_records;
+
+	save_job_start(kb, job);
+	return KB_OK;
+}
+
+/*
+ * Write a .ini file for a checkpoint of the journal (see knowledge_journal_checkpoint()): a copy of
+ * the file as it is, followed by the records of the journal up to job->journal_mark as lines, each
+ * under a [section] line of its own intent. A section that appears again in a .ini file adds to it,
+ * and a later line replaces an earlier one with the same entity, so loading the file gives the
+ * answers the records hold. It only reads the files, so it may run on a thread of its own.
+ *
+ * Input:
+ *   f   - the new file, at its start
+ *   job - the checkpoint, which receives the size of the new file
+ *
+ * Returns:
+ *   KB_OK, if the file was written
+ *   KB_INVALID, if the file could not be written, or the file or the journal could not be read
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int journal_fold(FILE* f, kb_save_job* job)
+{
+
+	FILE* old = fopen(job->file_name, "rb");
+	FILE* journal = fopen(job->journal_name, "rb");
+	kb_writer writer;
+	int result = KB_OK;
+
+	if (old == NULL || journal == NULL || fseek(journal, (long) sizeof(kb_journal_header), SEEK_SET) != 0)
+	{
+		result = KB_INVALID;
+	}
+	else if (!writer_open(&writer, f))
+	{
+		result = KB_NOMEM;
+	}
+
+	if (result != KB_OK)
+	{
+		if (old != NULL)
+		{
+			fclose(old);
+		}
+
+		if (journal != NULL)
+		{
+			fclose(journal);
+		}
+
+		return result;
+	}
+
+	// Copy the file as it is
+	char last = '\n';
+	size_t got;
+
+	while (!writer.failed && (got = fread(writer.buffer, 1, KB_WRITE_BLOCK, old)) > 0)
+	{
+		last = writer.buffer[got - 1];
+		writer.used = got;
+		writer.offset += (long) got;
+		writer_flush(&writer);
+	}
+
+	if (ferror(old))
+	{
+		result = KB_INVALID;
+	}
+
+	// The records must start on a line of their own
+	if (last != '\n')
+	{
+		writer_put(&writer, "\n", 1);
+	}
+
+	char* strings = NULL;
+	size_t strings_capacity = 0;
+	char intent[MAX_INTENT] = "";
+	long position = (long) sizeof(kb_journal_header);
+
+	while (result == KB_OK && !writer.failed && position < job->journal_mark)
+	{
+		kb_journal_record record;
+
+		if (fread(&record, sizeof(record), 1, journal) != 1)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		// The records were checked when they were written or replayed, a damaged one means the journal has changed
+		size_t strings_size = (size_t) record.intent_len + record.key_len + record.value_len;
+
+		if (record.intent_len >= MAX_INTENT || strings_size > KB_JOURNAL_MAX_RECORD)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		if (strings_size > strings_capacity)
+		{
+			char* bigger = realloc(strings, strings_size);
+
+			if (bigger == NULL)
+			{
+				printf("Ran out of memory.\nNo memory is allocated.\n");
+				result = KB_NOMEM;
+				break;
+			}
+
+			strings = bigger;
+			strings_capacity = strings_size;
+		}
+
+		if (fread(strings, 1, strings_size, journal) != strings_size)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		uint32_t checksum = crc32_update(0, &record.intent_len, sizeof(record) - sizeof(record.checksum));
+
+		if (crc32_update(checksum, strings, strings_size) != record.checksum)
+		{
+			result = KB_INVALID;
+			break;
+		}
+
+		position += (long) (sizeof(record) + strings_size);
+
+		// Start a section when the question word changes
+		if (strlen(intent) != record.intent_len || memcmp(intent, strings, record.intent_len) != 0)
+		{
+			memcpy(intent, strings, record.intent_len);
+			intent[record.intent_len] = '\0';
+
+			writer_put(&writer, "[", 1);
+			writer_put(&writer, intent, record.intent_len);
+			writer_put(&writer, "]\n", 2);
+		}
+
+		writer_put(&writer, strings + record.intent_len, record.key_len);
+		writer_put(&writer, "=", 1);
+		writer_put(&writer, strings + record.intent_len + record.key_len, record.value_len);
+		writer_put(&writer, "\n", 1);
+	}
+
+	free(strings);
+	fclose(old);
+	fclose(journal);
+
+	writer_flush(&writer);
+
+	if (result == KB_OK && writer.failed)
+	{
+		result = KB_INVALID;
+	}
+
+	job->file_size = writer.offset;
+	writer_close(&writer);
+
+	return result;
+}
+
+/*
+ * Finish a checkpoint of the journal once its file has been written (see knowledge_journal_checkpoint()):
+ * replace the journal with one that only holds the records written after the checkpoint started.
+ * The new journal is written under a temporary name and renamed over the old one. If that fails,
+ * the old journal is kept, and is checkpointed again after the next commit.
+ *
+ * Input:
+ *   job - the checkpoint
+ */
+static void journal_checkpoint_finish(knowledge_base* kb, kb_save_job* job)
+{
+
+	if (job->result != KB_OK)
+	{
+		printf("Could not checkpoint the journal to %s.\n", job->file_name);
+		return;
+	}
+
+	journal_lock(kb);
+
+	if (kb->journal == NULL)
+	{
+		journal_unlock(kb);
+		return;
+	}
+
+	// Read the records written since the checkpoint started, they go into the new journal
+	size_t tail_size = (size_t) (kb->journal_size - job->journal_mark);
+	char* tail = malloc(tail_size > 0 ? tail_size : 1);
+	int result = KB_OK;
+
+	if (tail == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		result = KB_NOMEM;
+	}
+	else if (fseek(kb->journal, job->journal_mark, SEEK_SET) != 0 || fread(tail, 1, tail_size, kb->journal) != tail_size)
+	{
+		result = KB_INVALID;
+	}
+
+	char* temp_name = NULL;
+	FILE* f = result == KB_OK ? temp_file_open(kb->journal_name, "wb", &temp_name) : NULL;
+
+	if (f != NULL)
+	{
+		if (journal_write_header(f) != KB_OK || (tail_size > 0 && fwrite(tail, 1, tail_size, f) != tail_size))
+		{
+			result = KB_INVALID;
+		}
+
+		// The old journal is closed first, it cannot be replaced while it is open on every system
+		fclose(kb->journal);
+		kb->journal = NULL;
+
+		result = temp_file_commit(f, temp_name, kb->journal_name, result);
+		kb->journal = fopen(kb->journal_name, "r+b");
+	}
+	else if (result == KB_OK)
+	{
+		result = KB_INVALID;
+	}
+
+	free(tail);
+
+	if (kb->journal == NULL)
+	{
+		// Whatever the journal held is in the file now, carry on without a journal
+		journal_unlock(kb);
+		kb_journal_close(kb);
+		printf("Could not open the journal again after checkpointing it.\n");
+		return;
+	}
+
+	if (result == KB_OK)
+	{
+		kb->journal_records -= job->journal_mark_records;
+		kb->journal_size = (long) (sizeof(kb_journal_header) + tail_size);
+	}
+
+	// New records are written at the end of the journal, whichever one it is
+	if (fseek(kb->journal, kb->journal_size, SEEK_SET) != 0)
+	{
+		result = KB_INVALID;
+	}
+
+	journal_unlock(kb);
+
+	if (result != KB_OK)
+	{
+		printf("Could not empty the journal, it will be checkpointed again.\n");
+	}
+}
+
+/*
+ * Check whether the journal is long enough to be checkpointed (see knowledge_journal_checkpoint()).
+ */
+static bool journal_checkpoint_due(knowledge_base* kb)
+{
+	return kb->journal_records >= KB_JOURNAL_CHECKPOINT_RECORDS || kb->journal_size >= KB_JOURNAL_CHECKPOINT_BYTES;
+}
+
+/*
+ * Write any learned answers still buffered to the journal and close it.
+ * Learned answers are not written anywhere after this until knowledge_journal_open() is called again.
+ */
+void kb_journal_close(knowledge_base* kb)
+{
+
+	// Let a checkpoint that is still being written finish, it needs the journal
+	if (kb->background_save != NULL && kb->background_save->checkpoint)
+	{
+		background_save_join(kb, true);
+	}
+
+	// Only write what is left: a checkpoint that failed would close the journal from under this
+	journal_write(kb);
+
+	if (kb->journal != NULL)
+	{
+		fclose(kb->journal);
+		kb->journal = NULL;
+	}
+
+	free(kb->journal_pending);
+	kb->journal_pending = NULL;
+	kb->journal_pending_size = 0;
+	kb->journal_pending_capacity = 0;
+	kb->journal_pending_records = 0;
+
+	free(kb->journal_name);
+	free(kb->journal_base_name);
+	kb->journal_name = NULL;
+	kb->journal_base_name = NULL;
+	kb->journal_records = 0;
+	kb->journal_size = 0;
+}
+
+/*
+ * Add the record of a learned answer to the ones waiting for knowledge_journal_commit().
+ * Nothing is done if there is no journal open.
+ *
+ * Input:
+ *   intent     - the question word
+ *   entity     - the entity
+ *   entity_len - the length of the entity
+ *   value      - the response
+ *   value_len  - the length of the response
+ *
+ * Returns:
+ *   KB_OK, if the record was added
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int journal_append(knowledge_base* kb, const char* intent, const char* entity, size_t entity_len, const char* value, size_t value_len)
+{
+
+	if (kb->journal == NULL)
+	{
+		return KB_OK;
+	}
+
+	kb_journal_record record;
+	record.intent_len = (uint32_t) strlen(intent);
+	record.key_len = (uint32_t) entity_len;
+	record.value_len = (uint32_t) value_len;
+
+	size_t record_size = sizeof(record) + record.intent_len + record.key_len + record.value_len;
+
+	// Make room for the record in the buffer
+	if (kb->journal_pending_size + record_size > kb->journal_pending_capacity)
+	{
+		size_t capacity = kb->journal_pending_capacity > 0 ? kb->journal_pending_capacity : KB_JOURNAL_BUFFER;
+
+		while (capacity < kb->journal_pending_size + record_size)
+		{
+			capacity *= 2;
+		}
+
+		char* bigger = realloc(kb->journal_pending, capacity);
+
+		if (bigger == NULL)
+		{
+			printf("Ran out of memory.\nNo memory is allocated.\n");
+			return KB_NOMEM;
+		}
+
+		kb->journal_pending = bigger;
+		kb->journal_pending_capacity = capacity;
+	}
+
+	// The strings follow the record, the checksum covers everything after itself
+	char* data = kb->journal_pending + kb->journal_pending_size;
+	char* strings = data + sizeof(record);
+
+	memcpy(strings, intent, record.intent_len);
+	memcpy(strings + record.intent_len, entity, record.key_len);
+	memcpy(strings + record.intent_len + record.key_len, value, record.value_len);
+
+	record.checksum = crc32_update(0, &record.intent_len, sizeof(record) - sizeof(record.checksum));
+	record.checksum = crc32_update(record.checksum, strings, record_size - sizeof(record));
+
+	memcpy(data, &record, sizeof(record));
+	kb->journal_pending_size += record_size;
+	kb->journal_pending_records++;
+
+	return KB_OK;
+}
+
+/*
+ * Replay the records of a journal that has just been opened, and leave it ready for new records.
+ * A new (empty) journal is given its header.
+ *
+ * Input:
+ *   f - the journal, at its start
+ *
+ * Returns: as knowledge_journal_open()
+ */
+static int journal_replay(knowledge_base* kb, FILE* f)
+{
+
+	kb_journal_header header;
+	size_t header_read = fread(&header, 1, sizeof(header), f);
+
+	/* An empty file is a new journal, so is one cut short while its header was being written (it holds no records).
+	A short file that does not start like a journal is left alone below. */
+	size_t magic_read = header_read < sizeof(header.magic) ? header_read : sizeof(header.magic);
+
+	if (header_read < sizeof(header) && memcmp(header.magic, KB_JOURNAL_MAGIC, magic_read) == 0)
+	{
+		rewind(f);
+
+		if (journal_write_header(f) != KB_OK)
+		{
+			return KB_INVALID;
+		}
+
+		kb->journal_size = (long) sizeof(header);
+		return 0;
+	}
+
+	// Never write to a file that is not a journal this version of the chatbot understands
+	if (header_read < sizeof(header) || memcmp(header.magic, KB_JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != KB_JOURNAL_VERSION || header.byte_order != KB_BINARY_BYTE_ORDER)
+	{
+		return KB_INVALID;
+	}
+
+	int replayed = 0;
+	long good_end = (long) sizeof(header);
+	char* strings = NULL;
+	size_t strings_capacity = 0;
+
+	kb_journal_record record;
+
+	while (fread(&record, sizeof(record), 1, f) == 1)
+	{
+
+		// An entity or response this long can only come from a damaged record
+		size_t strings_size = (size_t) record.intent_len + record.key_len + record.value_len;
+
+		if (record.intent_len >= MAX_INTENT || strings_size > KB_JOURNAL_MAX_RECORD)
+		{
+			break;
+		}
+
+		if (strings_size > strings_capacity)
+		{
+			char* bigger = realloc(strings, strings_size);
+
+			if (bigger == NULL)
+			{
+				printf("Ran out of memory.\nNo memory is allocated.\n");
+				free(strings);
+				return KB_NOMEM;
+			}
+
+			strings = bigger;
+			strings_capacity = strings_size;
+		}
+
+		// Stop at a record that was only partly written
+		if (fread(strings, 1, strings_size, f) != strings_size)
+		{
+			break;
+		}
+
+		uint32_t checksum = crc32_update(0, &record.intent_len, sizeof(record) - sizeof(record.checksum));
+		checksum = crc32_update(checksum, strings, strings_size);
+
+		if (checksum != record.checksum)
+		{
+			break;
+		}
+
+		good_end += (long) (sizeof(record) + strings_size);
+		kb->journal_records++;
+
+		// Find the section for the question word
+		char intent[MAX_INTENT];
+		memcpy(intent, strings, record.intent_len);
+		intent[record.intent_len] = '\0';
+
+		int section_id = section_index(intent);
+
+		if (section_id < 0)
+		{
+			continue;
+		}
+
+		// Create the section if it does not exist yet
+		ht* section = section_ht_get(kb->sections, section_id);
+
+		if (section == NULL)
+		{
+			section = create_entity_ht();
+
+			if (section == NULL || !section_ht_set(kb->sections, section_id, section))
+			{
+				if (section != NULL)
+				{
+					unload_entity_ht(section);
+				}
+
+				free(strings);
+				return KB_NOMEM;
+			}
+		}
+
+		// The learned answer replaces the one in the file, if any
+		const char* key = strings + record.intent_len;
+		const char* value = key + record.key_len;
+
+		if (entity_ht_insert(section, key, record.key_len, key_hash_len(key, record.key_len),
+			value, record.value_len, true))
+		{
+			replayed++;
+		}
+	}
+
+	free(strings);
+
+	// Drop whatever follows the last complete record, new records are written from there
+#ifdef KB_HAVE_FSYNC
+	fflush(f);
+	if (ftruncate(fileno(f), good_end) != 0)
+	{
+		return KB_INVALID;
+	}
+#endif
+
+	if (fseek(f, good_end, SEEK_SET) != 0)
+	{
+		return KB_INVALID;
+	}
+
+	kb->journal_size = good_end;
+	return replayed;
+}
+
+/*
+ * Write the header of a new journal, at the current position of the file.
+ *
+ * Returns:
+ *   KB_OK, if it was written
+ *   KB_INVALID, if it could not be written
+ */
+static int journal_write_header(FILE* f)
+{
+	kb_journal_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KB_JOURNAL_MAGIC, sizeof(header.magic));
+	header.version = KB_JOURNAL_VERSION;
+	header.byte_order = KB_BINARY_BYTE_ORDER;
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1 || fflush(f) != 0)
+	{
+		return KB_INVALID;
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Start keeping the questions that the knowledge base cannot answer as pending questions, instead
+ * of asking the user for the answers (see chatbot_do_question()), after reading the ones already
+ * in the file.
+ *
+ * A question is only noted down in memory by kb_pending_add(), with the number of times it was asked
+ * (hits), so asking one never waits on a file. kb_pending_flush() writes them to the file at the end of
+ * each chatbot turn, on a thread of its own, one line per question, the most asked first:
+ *
+ *   hits<TAB>question word<TAB>entity
+ *
+ * kb_pending_answer() learns the answers to them from a file in the same form with the answer
+ * added after another tab (or without the hits), and removes them from the pending questions.
+ *
+ * Input:
+ *   file_name - the name of the file of pending questions (it is created if it does not exist)
+ *
+ * Returns:
+ *   the number of questions waiting for an answer
+ *   KB_NOMEM, if there was a memory allocation failure (questions are not kept then)
+ */
+int kb_pending_open(knowledge_base* kb, const char* file_name)
+{
+
+	// Only one file of pending questions at a time
+	kb_pending_close(kb);
+
+	kb_pending_queue* queue = calloc(1, sizeof(kb_pending_queue));
+	char* name = malloc(strlen(file_name) + 1);
+	unsigned int* index = calloc(KB_PENDING_INDEX_SIZE, sizeof(unsigned int));
+
+	if (queue == NULL || name == NULL || index == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		free(queue);
+		free(name);
+		free(index);
+		return KB_NOMEM;
+	}
+
+	strcpy(name, file_name);
+	queue->file_name = name;
+	queue->index = index;
+	queue->index_size = KB_PENDING_INDEX_SIZE;
+	queue->write_result = KB_OK;
+	kb->pending_questions = queue;
+
+	FILE* f = fopen(file_name, "r");
+
+	if (f == NULL)
+	{
+		return 0;
+	}
+
+	// Read the questions already in the file, lines that are not "hits<TAB>word<TAB>entity" are left out
+	char line[KB_PENDING_LINE];
+	char* fields[3];
+	int field_count;
+	int result = KB_OK;
+
+	while (result == KB_OK && pending_read_line(f, line, fields, 3, &field_count))
+	{
+		if (field_count != 3 || section_index(fields[1]) < 0 || fields[2][0] == '\0')
+		{
+			continue;
+		}
+
+		kb_pending_question* question = pending_find(queue, section_index(fields[1]), fields[2],
+			(unsigned int) strlen(fields[2]), true);
+
+		if (question == NULL)
+		{
+			result = KB_NOMEM;
+		}
+		else
+		{
+			question->hits += strtoul(fields[0], NULL, 10);
+		}
+	}
+
+	fclose(f);
+
+	if (result != KB_OK)
+	{
+		kb_pending_close(kb);
+		return result;
+	}
+
+	return (int) pending_waiting(queue);
+}
+
+/*
+ * Note down a question that the knowledge base cannot answer as a pending question, or count
+ * another hit if it is there already. Nothing is written to the file here (see kb_pending_flush()).
+ *
+ * Input:
+ *   intent - the question word
+ *   entity - the entity
+ *
+ * Returns:
+ *   KB_OK, if the question was noted down
+ *   KB_INVALID, if pending questions are not being kept (see kb_pending_open()) or the question word is not recognised
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_pending_add(knowledge_base* kb, const char* intent, const char* entity)
+{
+
+	kb_pending_queue* queue = kb->pending_questions;
+	int section_id = section_index(intent);
+
+	if (queue == NULL || section_id < 0)
+	{
+		return KB_INVALID;
+	}
+
+	kb_pending_question* question = pending_find(queue, section_id, entity, (unsigned int) strlen(entity), true);
+
+	if (question == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	question->hits++;
+	queue->changed = true;
+
+	return KB_OK;
+}
+
+/*
+ * Write the pending questions to their file, if they changed since they were last written.
+ *
+ * The file is written under a temporary name and renamed over the old one (see temp_file_open()).
+ * Without waiting, it is written on a thread of its own, and nothing is done while the last write
+ * is still going on (the questions are written by a later flush instead), so the chatbot never
+ * waits on the file.
+ *
+ * Input:
+ *   wait - 1 to write the file before returning (and wait for a write still going on), 0 not to wait
+ *
+ * Returns:
+ *   KB_OK, if the file was written or is being written (or there is nothing to write)
+ *   KB_INVALID, if the file could not be written (this time or the last time, without waiting)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_pending_flush(knowledge_base* kb, int wait)
+{
+
+	kb_pending_queue* queue = kb->pending_questions;
+
+	if (queue == NULL)
+	{
+		return KB_OK;
+	}
+
+	// A write still going on is left to finish, unless we wait for it
+	if (queue->write != NULL && pending_write_finish(queue, wait) == KB_NOTFOUND)
+	{
+		return KB_OK;
+	}
+
+	int result = queue->write_result;
+	queue->write_result = KB_OK;
+
+	if (!queue->changed)
+	{
+		return result;
+	}
+
+	kb_pending_job* job = calloc(1, sizeof(kb_pending_job));
+	char* file_name = malloc(strlen(queue->file_name) + 1);
+	size_t size = 0;
+	char* text = job != NULL && file_name != NULL ? pending_format(queue, &size) : NULL;
+
+	if (text == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		free(job);
+		free(file_name);
+		return KB_NOMEM;
+	}
+
+	strcpy(file_name, queue->file_name);
+	job->file_name = file_name;
+	job->text = text;
+	job->size = size;
+	queue->write = job;
+	queue->changed = false;
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_init(&job->lock, NULL);
+
+	if (!wait && pthread_create(&job->thread, NULL, pending_write_run, job) == 0)
+	{
+		return result;
+	}
+#endif
+
+	// Waiting (or the thread could not be started), the file is written straight away
+	pending_write_run(job);
+	queue->write = NULL;
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_destroy(&job->lock);
+#endif
+
+	int written = job->result;
+
+	free(job->file_name);
+	free(job->text);
+	free(job);
+
+	return written != KB_OK ? written : result;
+}
+
+/*
+ * Learn the answers to pending questions from a file, all in one go, and remove them from the
+ * pending questions (if they are being kept). Each line holds a question and its answer:
+ *
+ *   question word<TAB>entity<TAB>answer
+ *   hits<TAB>question word<TAB>entity<TAB>answer
+ *
+ * so a copy of the file of pending questions with the answers filled in can be given as it is.
+ * Lines without an answer, or whose question word is not recognised, are left out.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns:
+ *   the number of answers learned
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_pending_answer(knowledge_base* kb, FILE* f)
+{
+
+	char line[KB_PENDING_LINE];
+	char* fields[4];
+	int field_count;
+	int learned = 0;
+
+	while (pending_read_line(f, line, fields, 4, &field_count))
+	{
+		if (field_count == 0)
+		{
+			continue;
+		}
+
+		// Leave out the hits, if they are there
+		bool hits = isdigit((unsigned char) fields[0][0]);
+		char** question = hits ? fields + 1 : fields;
+
+		if (field_count - hits < 3)
+		{
+			continue;
+		}
+
+		int section_id = section_index(question[0]);
+
+		if (section_id < 0 || question[1][0] == '\0' || question[2][0] == '\0')
+		{
+			continue;
+		}
+
+		// A question word that has no section yet gets one, as when the chatbot is taught an answer
+		if (section_ht_get(kb->sections, section_id) == NULL)
+		{
+			ht* section = create_entity_ht();
+
+			if (section == NULL || !section_ht_set(kb->sections, section_id, section))
+			{
+				if (section != NULL)
+				{
+					unload_entity_ht(section);
+				}
+
+				return KB_NOMEM;
+			}
+		}
+
+		int result = kb_put(kb, kb_intent_words[section_id], question[1], question[2]);
+
+		if (result == KB_NOMEM)
+		{
+			return KB_NOMEM;
+		}
+
+		if (result != KB_FOUND)
+		{
+			continue;
+		}
+
+		learned++;
+
+		// The question is answered, it is no longer pending
+		kb_pending_queue* queue = kb->pending_questions;
+		kb_pending_question* pending = queue != NULL
+			? pending_find(queue, section_id, question[1], (unsigned int) strlen(question[1]), false) : NULL;
+
+		if (pending != NULL && pending->hits > 0)
+		{
+			pending->hits = 0;
+			queue->changed = true;
+		}
+	}
+
+	return learned;
+}
+
+/*
+ * Write the pending questions to a file in the form of the file they are kept in, the most asked first.
+ *
+ * Input:
+ *   f - the file (e.g. stdout), or NULL to only count them
+ *
+ * Returns:
+ *   the number of questions waiting for an answer
+ *   KB_INVALID, if pending questions are not being kept (see kb_pending_open())
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_pending_write(knowledge_base* kb, FILE* f)
+{
+
+	kb_pending_queue* queue = kb->pending_questions;
+
+	if (queue == NULL)
+	{
+		return KB_INVALID;
+	}
+
+	if (f != NULL)
+	{
+		size_t size;
+		char* text = pending_format(queue, &size);
+
+		if (text == NULL)
+		{
+			printf("Ran out of memory.\nNo memory is allocated.\n");
+			return KB_NOMEM;
+		}
+
+		fwrite(text, 1, size, f);
+		free(text);
+	}
+
+	return (int) pending_waiting(queue);
+}
+
+/*
+ * Stop keeping pending questions, after writing them to their file (and waiting for it).
+ * Questions that the knowledge base cannot answer are asked about again.
+ */
+void kb_pending_close(knowledge_base* kb)
+{
+
+	kb_pending_queue* queue = kb->pending_questions;
+
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	kb_pending_flush(kb, 1);
+
+	for (unsigned int i = 0; i < queue->count; i++)
+	{
+		free(queue->questions[i].entity);
+	}
+
+	free(queue->questions);
+	free(queue->index);
+	free(queue->file_name);
+	free(queue);
+	kb->pending_questions = NULL;
+}
+
+/*
+ * Find a question in the pending questions (the entity is compared case-insensitively),
+ * and add it with no hits if it is not there and add is true.
+ *
+ * Returns: the question, or NULL if it is not there (or we ran out of memory adding it)
+ */
+static kb_pending_question* pending_find(kb_pending_queue* queue, int section_id, const char* entity, unsigned int entity_len, bool add)
+{
+
+	unsigned int hash = key_hash_len(entity, entity_len);
+	unsigned int slot = pending_slot(queue, section_id, hash);
+
+	// Look along the slots from the question's own one until it or an empty one is found
+	while (queue->index[slot] != 0)
+	{
+		kb_pending_question* question = &queue->questions[queue->index[slot] - 1];
+
+		if (question->section_id == section_id && question->hash == hash
+			&& key_equals(question->entity, question->entity_len, entity, entity_len))
+		{
+			return question;
+		}
+
+		slot = (slot + 1) & (queue->index_size - 1);
+	}
+
+	if (!add)
+	{
+		return NULL;
+	}
+
+	// Keep the index at most half full, and make room for the question
+	if ((queue->count + 1) * 2 > queue->index_size)
+	{
+		if (!pending_index_grow(queue))
+		{
+			return NULL;
+		}
+
+		slot = pending_slot(queue, section_id, hash);
+
+		while (queue->index[slot] != 0)
+		{
+			slot = (slot + 1) & (queue->index_size - 1);
+		}
+	}
+
+	if (queue->count == queue->capacity)
+	{
+		unsigned int capacity = queue->capacity > 0 ? queue->capacity * 2 : KB_PENDING_INDEX_SIZE / 2;
+		kb_pending_question* bigger = realloc(queue->questions, capacity * sizeof(kb_pending_question));
+
+		if (bigger == NULL)
+		{
+			printf("Ran out of memory.\nNo memory is allocated.\n");
+			return NULL;
+		}
+
+		queue->questions = bigger;
+		queue->capacity = capacity;
+	}
+
+	char* copy = malloc(entity_len + 1);
+
+	if (copy == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return NULL;
+	}
+
+	memcpy(copy, entity, entity_len);
+	copy[entity_len] = '\0';
+
+	kb_pending_question* question = &queue->questions[queue->count];
+	question->section_id = section_id;
+	question->hash = hash;
+	question->entity_len = entity_len;
+	question->hits = 0;
+	question->entity = copy;
+
+	queue->index[slot] = ++queue->count;
+
+	return question;
+}
+
+// Double the index of the pending questions, returns false if we ran out of memory (it is then left as it was)
+static bool pending_index_grow(kb_pending_queue* queue)
+{
+	unsigned int size = queue->index_size * 2;
+	unsigned int* index = calloc(size, sizeof(unsigned int));
+
+	if (index == NULL)
+	{
+		printf("Ran out of memory.\nNo memory is allocated.\n");
+		return false;
+	}
+
+	free(queue->index);
+	queue->index = index;
+	queue->index_size = size;
+
+	for (unsigned int i = 0; i < queue->count; i++)
+	{
+		unsigned int slot = pending_slot(queue, queue->questions[i].section_id, queue->questions[i].hash);
+
+		while (index[slot] != 0)
+		{
+			slot = (slot + 1) & (size - 1);
+		}
+
+		index[slot] = i + 1;
+	}
+
+	return true;
+}
+
+// The slot of the index where a question starts being looked for
+static unsigned int pending_slot(const kb_pending_queue* queue, int section_id, unsigned int hash)
+{
+	return key_hash_mix(hash + (unsigned int) section_id) & (queue->index_size - 1);
+}
+
+// The number of pending questions still waiting for an answer
+static unsigned int pending_waiting(const kb_pending_queue* queue)
+{
+	unsigned int waiting = 0;
+
+	for (unsigned int i = 0; i < queue->count; i++)
+	{
+		waiting += queue->questions[i].hits > 0;
+	}
+
+	return waiting;
+}
+
+/*
+ * Format the pending questions still waiting for an answer as the lines of their file, the most asked first.
+ *
+ * Input:
+ *   size - receives the size of the text
+ *
+ * Returns: the text (not null-terminated, to be freed by the caller), or NULL if we ran out of memory
+ */
+static char* pending_format(const kb_pending_queue* queue, size_t* size)
+{
+
+	// Sort the questions by hits, those with the same hits stay in the order they were first asked
+	const kb_pending_question** sorted = malloc((queue->count + 1) * sizeof(kb_pending_question*));
+	unsigned int waiting = 0;
+	size_t text_size = 0;
+
+	if (sorted == NULL)
+	{
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < queue->count; i++)
+	{
+		const kb_pending_question* question = &queue->questions[i];
+
+		if (question->hits > 0)
+		{
+			sorted[waiting++] = question;
+
+			// Room for the hits, the question word, the entity, two tabs and the end of the line
+			text_size += 20 + strlen(kb_intent_words[question->section_id]) + question->entity_len + 3;
+		}
+	}
+
+	qsort(sorted, waiting, sizeof(kb_pending_question*), pending_compare);
+
+	char* text = malloc(text_size + 1);
+
+	if (text == NULL)
+	{
+		free(sorted);
+		return NULL;
+	}
+
+	size_t len = 0;
+
+	for (unsigned int i = 0; i < waiting; i++)
+	{
+		len += (size_t) sprintf(text + len, "%lu\t%s\t%s\n", sorted[i]->hits, kb_intent_words[sorted[i]->section_id],
+			sorted[i]->entity);
+	}
+
+	free(sorted);
+	*size = len;
+
+	return text;
+}
+
+// Orders pending questions by hits, the most first, then by when they were first asked
+static int pending_compare(const void* a, const void* b)
+{
+	const kb_pending_question* question_a = *(const kb_pending_question* const*) a;
+	const kb_pending_question* question_b = *(const kb_pending_question* const*) b;
+
+	if (question_a->hits != question_b->hits)
+	{
+		return question_a->hits > question_b->hits ? -1 : 1;
+	}
+
+	return question_a < question_b ? -1 : (question_a > question_b ? 1 : 0);
+}
+
+/*
+ * Read a line of a file of pending questions or answers, and split it into its fields, separated
+ * by tabs. The first field is the hits, if the line starts with a number; the last field takes
+ * the rest of the line, tabs included. The end of the line is removed, and so are spaces around
+ * each field. A line too long for KB_PENDING_LINE is skipped, it is read as one with no fields.
+ *
+ * Input:
+ *   f           - the file
+ *   line        - a buffer of KB_PENDING_LINE characters to read the line into
+ *   fields      - receives a pointer to each field (into line)
+ *   max_fields  - the most fields there may be, counting the hits
+ *   field_count - receives the number of fields
+ *
+ * Returns: true if a line was read, false at the end of the file
+ */
+static bool pending_read_line(FILE* f, char* line, char** fields, int max_fields, int* field_count)
+{
+	*field_count = 0;
+
+	if (fgets(line, KB_PENDING_LINE, f) == NULL)
+	{
+		return false;
+	}
+
+	size_t len = strlen(line);
+
+	// A line that filled the buffer without ending is too long, the rest of it is skipped as well
+	if (len == KB_PENDING_LINE - 1 && line[len - 1] != '\n')
+	{
+		int c;
+
+		while ((c = fgetc(f)) != EOF && c != '\n')
+		{
+			continue;
+		}
+
+		return true;
+	}
+
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+	{
+		line[--len] = '\0';
+	}
+
+	// A line that does not start with the hits has one field fewer
+	if (!isdigit((unsigned char) line[strspn(line, " ")]))
+	{
+		max_fields--;
+	}
+
+	for (char* field = line; field != NULL && *field_count < max_fields; (*field_count)++)
+	{
+		char* tab = *field_count < max_fields - 1 ? strchr(field, '\t') : NULL;
+
+		if (tab != NULL)
+		{
+			*tab = '\0';
+		}
+
+		// Trim the spaces around the field
+		while (isspace((unsigned char) *field))
+		{
+			field++;
+		}
+
+		size_t field_len = strlen(field);
+
+		while (field_len > 0 && isspace((unsigned char) field[field_len - 1]))
+		{
+			field[--field_len] = '\0';
+		}
+
+		fields[*field_count] = field;
+		field = tab != NULL ? tab + 1 : NULL;
+	}
+
+	return true;
+}
+
+/*
+ * Finish the write of the file of pending questions that is going on, if it is done (or once it is, when waiting).
+ *
+ * Returns:
+ *   KB_OK, if the write finished (how it went is kept in the queue's write_result)
+ *   KB_NOTFOUND, if it is still going on and we are not waiting
+ */
+static int pending_write_finish(kb_pending_queue* queue, bool wait)
+{
+
+	kb_pending_job* job = queue->write;
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_lock(&job->lock);
+	bool done = job->done;
+	pthread_mutex_unlock(&job->lock);
+
+	if (!done && !wait)
+	{
+		return KB_NOTFOUND;
+	}
+
+	pthread_join(job->thread, NULL);
+	pthread_mutex_destroy(&job->lock);
+#endif
+
+	if (job->result != KB_OK)
+	{
+		queue->write_result = job->result;
+	}
+
+	free(job->file_name);
+	free(job->text);
+	free(job);
+	queue->write = NULL;
+
+	return KB_OK;
+}
+
+/*
+ * Write the file of pending questions, on the thread started by kb_pending_flush() (or straight away).
+ */
+static void* pending_write_run(void* arg)
+{
+	kb_pending_job* job = arg;
+	char* temp_name;
+	FILE* f = temp_file_open(job->file_name, "w", &temp_name);
+	int result = KB_INVALID;
+
+	if (f != NULL)
+	{
+		result = fwrite(job->text, 1, job->size, f) == job->size ? KB_OK : KB_INVALID;
+		result = temp_file_commit(f, temp_name, job->file_name, result);
+	}
+
+#ifdef KB_HAVE_THREADS
+	pthread_mutex_lock(&job->lock);
+	job->result = result;
+	job->done = true;
+	pthread_mutex_unlock(&job->lock);
+#else
+	job->result = result;
+#endif
+
+	return NULL;
+}
+
+/*
+ * The knowledge_*() functions: the kb_*() function of the same name, on the default knowledge base.
+ */
+int knowledge_get(const char* intent, const char* entity, char* response, int n)
+{
+	return kb_get(&default_knowledge, intent, entity, response, n);
+}
+
+int knowledge_get_view(const char* intent, const char* entity, size_t entity_len, kb_view* response)
+{
+	return kb_get_view(&default_knowledge, intent, entity, entity_len, response);
+}
+
+int knowledge_get_words(const char* intent, char* const* words, kb_view* response)
+{
+	return kb_get_words(&default_knowledge, intent, words, response);
+}
+
+int knowledge_put(const char* intent, const char* entity, const char* response)
+{
+	return kb_put(&default_knowledge, intent, entity, response);
+}
+
+void knowledge_reset()
+{
+	kb_reset(&default_knowledge);
+}
+
+// Frees all of the knowledge, like kb_destroy() without freeing the default knowledge base itself
+void knowledge_unload()
+{
+	unload_knowledge_base(&default_knowledge);
+}
+
+int knowledge_freeze()
+{
+	return kb_freeze(&default_knowledge);
+}
+
+int knowledge_is_empty()
+{
+	return kb_is_empty(&default_knowledge);
+}
+
+int knowledge_read(FILE* f)
+{
+	return kb_read(&default_knowledge, f);
+}
+
+int knowledge_read_mapped(const char* file_name)
+{
+	return kb_read_mapped(&default_knowledge, file_name);
+}
+
+int knowledge_read_parallel(const char* file_name, unsigned int* threads)
+{
+	return kb_read_parallel(&default_knowledge, file_name, threads);
+}
+
+void knowledge_write(FILE* f)
+{
+	kb_write(&default_knowledge, f);
+}
+
+int knowledge_save(const char* file_name, int* rewritten)
+{
+	return kb_save(&default_knowledge, file_name, rewritten);
+}
+
+int knowledge_save_background(const char* file_name)
+{
+	return kb_save_background(&default_knowledge, file_name);
+}
+
+int knowledge_save_poll(int wait, char* file_name, int n, int* rewritten)
+{
+	return kb_save_poll(&default_knowledge, wait, file_name, n, rewritten);
+}
+
+int knowledge_read_binary(FILE* f)
+{
+	return kb_read_binary(&default_knowledge, f);
+}
+
+int knowledge_write_binary(FILE* f)
+{
+	return kb_write_binary(&default_knowledge, f);
+}
+
+int knowledge_journal_open(const char* file_name)
+{
+	return kb_journal_open(&default_knowledge, file_name);
+}
+
+int knowledge_journal_commit()
+{
+	return kb_journal_commit(&default_knowledge);
+}
+
+int knowledge_journal_checkpoint()
+{
+	return kb_journal_checkpoint(&default_knowledge);
+}
+
+void knowledge_journal_close()
+{
+	kb_journal_close(&default_knowledge);
+}
+
+int knowledge_pending_open(const char* file_name)
+{
+	return kb_pending_open(&default_knowledge, file_name);
+}
+
+int knowledge_pending_add(const char* intent, const char* entity)
+{
+	return kb_pending_add(&default_knowledge, intent, entity);
+}
+
+int knowledge_pending_flush(int wait)
+{
+	return kb_pending_flush(&default_knowledge, wait);
+}
+
+int knowledge_pending_answer(FILE* f)
+{
+	return kb_pending_answer(&default_knowledge, f);
+}
+
+int knowledge_pending_write(FILE* f)
+{
+	return kb_pending_write(&default_knowledge, f);
+}
+
+void knowledge_pending_close()
+{
+	kb_pending_close(&default_knowledge);
 }
@@ -26,7 +26,7 @@ int main(int argc, char* argv[]) {
 	int inc;                    /* the number of words in the user input */
 	char* inv[MAX_INPUT];       /* pointers to the beginning of each word of input */
 	char output[MAX_RESPONSE];  /* the chatbot's output */
-	int len;                    /* length of a word */
+	kb_view reply;              /* the output to print, which may be an answer longer than output */
 	int done = 0;               /* set to 1 to end the main loop */
 
 	/* initialise the chatbot */
@@ -34,6 +34,10 @@ int main(int argc, char* argv[]) {
 	inv[1] = NULL;
 	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
 
+	/* answer a file of questions instead of chatting, if asked to (see batch.c) */
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+		return chatbot_batch(argc, argv);
+
 	/* print a welcome message */
 	printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
 
@@ -46,26 +50,13 @@ int main(int argc, char* argv[]) {
 			fgets(input, MAX_INPUT, stdin);
 
 			/* split it into words */
-			inc = 0;
-			inv[inc] = strtok(input, delimiters);
-			while (inv[inc] != NULL) {
-
-				/* remove trailing punctuation */
-				len = strlen(inv[inc]);
-				while (len > 0 && ispunct(inv[inc][len - 1])) {
-					inv[inc][len - 1] = '\0';
-					len--;
-				}
-
-				/* go to the next word */
-				inc++;
-				inv[inc] = strtok(NULL, delimiters);
-			}
+			inc = split_words(input, inv);
 		} while (inc < 1);
 
 		/* invoke the chatbot */
 		done = chatbot_main(inc, inv, output, MAX_RESPONSE);
-		printf("%s: %s\n", chatbot_botname(), output);
+		reply = chatbot_output(output);
+		printf("%s: %.*s\n", chatbot_botname(), (int) reply.len, reply.text);
 
 	} while (!done);
 
@@ -73,6 +64,50 @@ int main(int argc, char* argv[]) {
 }
 
 
+/*
+ * Split a line of input into words, removing the trailing punctuation of each one.
+ *
+ * The words are found the way strtok() would find them, but without its hidden state,
+ * so that lines can be split on several threads at once (see batch.c).
+ *
+ * Input:
+ *   input - the line, which is changed to end each word with a null character
+ *   inv   - an array to receive a pointer to each word, followed by NULL (room for MAX_INPUT pointers)
+ *
+ * Returns:
+ *   the number of words
+ */
+int split_words(char* input, char* inv[]) {
+
+	int inc = 0;   /* the number of words found so far */
+	int len;       /* length of a word */
+	char* next = input + strspn(input, delimiters);
+
+	while (*next != '\0' && inc < MAX_INPUT - 1) {
+
+		/* end the word at the next delimiter */
+		inv[inc] = next;
+		len = strcspn(next, delimiters);
+		next += len;
+		if (*next != '\0')
+			*next++ = '\0';
+		next += strspn(next, delimiters);
+
+		/* remove trailing punctuation */
+		while (len > 0 && ispunct(inv[inc][len - 1])) {
+			inv[inc][len - 1] = '\0';
+			len--;
+		}
+
+		/* go to the next word */
+		inc++;
+	}
+
+	inv[inc] = NULL;
+	return inc;
+}
+
+
 /*
  * Utility function for comparing string case-insensitively.
  *
@@ -0,0 +1,239 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the line scanner used to parse knowledge base files.
+ *
+ * scan_line() finds the end of a line and the first '=' in it, in one pass.
+ * On x86-64 processors the line is looked at 16 bytes (SSE2) or 32 bytes (AVX2)
+ * at a time, the widest supported by the processor being picked when the program
+ * runs. Elsewhere (or for the last few bytes of the file) bytes are looked at one
+ * at a time.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "chat1002.h"
+
+// Contains struct declarations for data structure and its function prototypes
+#include "datastructure.h"
+
+// SSE2 and AVX2 versions are only built for x86-64 with GCC or Clang, which can pick one at run time
+#if (defined(__x86_64__) || defined(_M_X64)) && defined(__GNUC__)
+#define SCAN_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// Helper functions defined further down in this file
+static const char* scan_line_scalar(const char* data, const char* end, const char* found_equals, const char** equals);
+#ifdef SCAN_HAVE_X86
+static const char* scan_line_sse2(const char* data, const char* end, const char** equals);
+static const char* scan_line_avx2(const char* data, const char* end, const char** equals);
+#endif
+
+/*
+ * Find the end of a line, and the first '=' in it.
+ *
+ * Input:
+ *   data   - the start of the line
+ *   end    - the end of the text, the line ends there if there is no newline before it
+ *   equals - receives the first '=' of the line, or NULL if there is none
+ *
+ * Returns: the newline ending the line, or end if there is none
+ */
+const char* scan_line(const char* data, const char* end, const char** equals)
+{
+    return scan_line_using(scan_best_engine(), data, end, equals);
+}
+
+/*
+ * Find the end of a line, and the first '=' in it, using the given engine.
+ * This lets the benchmark compare the engines, everything else uses scan_line().
+ *
+ * Input:
+ *   engine - SCAN_SCALAR, SCAN_SSE2 or SCAN_AVX2 (must be supported, see scan_best_engine())
+ *   data, end, equals - as for scan_line()
+ *
+ * Returns: as for scan_line()
+ */
+const char* scan_line_using(int engine, const char* data, const char* end, const char** equals)
+{
+#ifdef SCAN_HAVE_X86
+    if (engine == SCAN_AVX2)
+    {
+        return scan_line_avx2(data, end, equals);
+    }
+
+    if (engine == SCAN_SSE2)
+    {
+        return scan_line_sse2(data, end, equals);
+    }
+#endif
+
+    return scan_line_scalar(data, end, NULL, equals);
+}
+
+/*
+ * Get the fastest line scanning engine supported by this processor.
+ *
+ * Returns: SCAN_AVX2, SCAN_SSE2 or SCAN_SCALAR
+ */
+int scan_best_engine(void)
+{
+#ifdef SCAN_HAVE_X86
+
+    // Every x86-64 processor has SSE2, AVX2 has to be asked for
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SCAN_AVX2;
+    }
+
+    return SCAN_SSE2;
+
+#else
+
+    return SCAN_SCALAR;
+
+#endif
+}
+
+/*
+ * Get the name of a line scanning engine, to print.
+ */
+const char* scan_engine_name(int engine)
+{
+    if (engine == SCAN_AVX2)
+    {
+        return "avx2";
+    }
+
+    if (engine == SCAN_SSE2)
+    {
+        return "sse2";
+    }
+
+    return "scalar";
+}
+
+/*
+ * Find the end of a line and the first '=' in it, one byte at a time.
+ * Also used to finish off the last few bytes for the SSE2 and AVX2 versions.
+ *
+ * Input:
+ *   data         - where to carry on scanning from
+ *   end          - the end of the text
+ *   found_equals - the first '=' of the line found so far, NULL if none yet
+ *   equals       - receives the first '=' of the line, or NULL if there is none
+ *
+ * Returns: the newline ending the line, or end if there is none
+ */
+static const char* scan_line_scalar(const char* data, const char* end, const char* found_equals, const char** equals)
+{
+    while (data < end && *data != '\n')
+    {
+        if (*data == '=' && found_equals == NULL)
+        {
+            found_equals = data;
+        }
+
+        data++;
+    }
+
+    *equals = found_equals;
+    return data;
+}
+
+#ifdef SCAN_HAVE_X86
+
+/*
+ * Find the end of a line and the first '=' in it, 16 bytes at a time using SSE2.
+ *
+ * Each block of 16 bytes is compared with '\n' and with '=' all at once, giving a bit mask
+ * of the matching bytes. The lowest bit set in the newline mask is the end of the line, and
+ * the lowest bit set in the '=' mask below it is the first '='.
+ */
+static const char* scan_line_sse2(const char* data, const char* end, const char** equals)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i equal_sign = _mm_set1_epi8('=');
+    const char* found_equals = NULL;
+
+    while (end - data >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*) data);
+        unsigned int newline_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+
+        // Look for the first '=' until one has been found, only before the newline if there is one
+        if (found_equals == NULL)
+        {
+            unsigned int equals_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, equal_sign));
+
+            if (newline_mask != 0)
+            {
+                equals_mask &= (newline_mask & -newline_mask) - 1;
+            }
+
+            if (equals_mask != 0)
+            {
+                found_equals = data + __builtin_ctz(equals_mask);
+            }
+        }
+
+        if (newline_mask != 0)
+        {
+            *equals = found_equals;
+            return data + __builtin_ctz(newline_mask);
+        }
+
+        data += 16;
+    }
+
+    // Fewer than 16 bytes left
+    return scan_line_scalar(data, end, found_equals, equals);
+}
+
+/*
+ * Find the end of a line and the first '=' in it, 32 bytes at a time using AVX2.
+ * Works the same way as scan_line_sse2(), and is only called if the processor supports AVX2.
+ */
+__attribute__((target("avx2")))
+static const char* scan_line_avx2(const char* data, const char* end, const char** equals)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i equal_sign = _mm256_set1_epi8('=');
+    const char* found_equals = NULL;
+
+    while (end - data >= 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*) data);
+        unsigned int newline_mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+
+        // Look for the first '=' until one has been found, only before the newline if there is one
+        if (found_equals == NULL)
+        {
+            unsigned int equals_mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, equal_sign));
+
+            if (newline_mask != 0)
+            {
+                equals_mask &= (newline_mask & -newline_mask) - 1;
+            }
+
+            if (equals_mask != 0)
+            {
+                found_equals = data + __builtin_ctz(equals_mask);
+            }
+        }
+
+        if (newline_mask != 0)
+        {
+            *equals = found_equals;
+            return data + __builtin_ctz(newline_mask);
+        }
+
+        data += 32;
+    }
+
+    // Fewer than 32 bytes left
+    return scan_line_scalar(data, end, found_equals, equals);
+}
+
+#endif